@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "scheduler.h"
+#include "time_utils.h"
+
+bool write_varint(FILE *file, uint64_t value) {
+    uint8_t bytes[10];
+    int count = 0;
+    do {
+        bytes[count] = value & 0x7f;
+        value >>= 7;
+        if (value != 0) {
+            bytes[count] |= 0x80;
+        }
+        count++;
+    } while (value != 0);
+    return fwrite(bytes, 1, count, file) == (size_t) count;
+}
+
+bool read_varint(FILE *file, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(file);
+        if (c == EOF) {
+            return false;
+        }
+        *value |= (uint64_t) (c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Capture *capture_open(char *path, int sample_rate, int64_t time) {
+    FILE *file = fopen(path, "a+b");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    int32_t file_rate;
+    if (fread(magic, sizeof(magic), 1, file) == 1 && fread(&file_rate, sizeof(file_rate), 1, file) == 1) {
+        if (memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0 || file_rate != sample_rate) {
+            ZEJF_LOG(2, "%s is not a capture of %d sps data\n", path, sample_rate);
+            fclose(file);
+            return NULL;
+        }
+        // appending after a read needs a positioning call in between
+        fseek(file, 0, SEEK_END);
+    } else {
+        file_rate = sample_rate;
+        fseek(file, 0, SEEK_END);
+        if (fwrite(CAPTURE_MAGIC, sizeof(magic), 1, file) != 1 || fwrite(&file_rate, sizeof(file_rate), 1, file) != 1) {
+            perror("fwrite");
+            fclose(file);
+            return NULL;
+        }
+    }
+
+    Capture *capture = malloc(sizeof(Capture));
+    if (capture == NULL) {
+        perror("malloc");
+        fclose(file);
+        return NULL;
+    }
+
+    capture->file = file;
+    capture->last_time = 0;
+    capture->last_flush_ms = millis();
+
+    if (!capture_write(capture, time, NULL, 0)) {
+        capture_close(capture);
+        return NULL;
+    }
+
+    return capture;
+}
+
+bool capture_write(Capture *capture, int64_t time, char *data, size_t length) {
+    int64_t delta = time - capture->last_time;
+    uint64_t zigzag = ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+    if (!write_varint(capture->file, zigzag) || !write_varint(capture->file, length)) {
+        perror("fwrite");
+        return false;
+    }
+    if (length > 0 && fwrite(data, 1, length, capture->file) != length) {
+        perror("fwrite");
+        return false;
+    }
+    capture->last_time = time;
+
+    int64_t now = millis();
+    if (now - capture->last_flush_ms >= CAPTURE_FLUSH_INTERVAL_MS) {
+        fflush(capture->file);
+        capture->last_flush_ms = now;
+    }
+    return true;
+}
+
+void capture_close(Capture *capture) {
+    if (capture == NULL) {
+        return;
+    }
+    fclose(capture->file);
+    free(capture);
+}
+
+Capture *replay_open(char *path, int *sample_rate) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    int32_t file_rate;
+    if (fread(magic, sizeof(magic), 1, file) != 1 || fread(&file_rate, sizeof(file_rate), 1, file) != 1 || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        ZEJF_LOG(2, "%s is not a capture file\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    Capture *replay = malloc(sizeof(Capture));
+    if (replay == NULL) {
+        perror("malloc");
+        fclose(file);
+        return NULL;
+    }
+
+    replay->file = file;
+    replay->last_time = 0;
+    replay->last_flush_ms = 0;
+    *sample_rate = file_rate;
+    return replay;
+}
+
+// data must hold at least CAPTURE_MAX_RECORD bytes
+bool replay_next(Capture *replay, int64_t *time, char *data, size_t *length) {
+    uint64_t zigzag;
+    uint64_t record_length;
+    if (!read_varint(replay->file, &zigzag) || !read_varint(replay->file, &record_length)) {
+        return false;
+    }
+    if (record_length > CAPTURE_MAX_RECORD) {
+        ZEJF_LOG(2, "Corrupted capture record\n");
+        return false;
+    }
+    if (record_length > 0 && fread(data, 1, record_length, replay->file) != record_length) {
+        return false;
+    }
+
+    int64_t delta = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+    if (record_length == 0) {
+        replay->last_time = 0;
+    }
+    replay->last_time += delta;
+    *time = replay->last_time;
+    *length = record_length;
+    return true;
+}
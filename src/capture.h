@@ -0,0 +1,33 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "ZEJFCAP1"
+#define CAPTURE_FLUSH_INTERVAL_MS 1000
+#define CAPTURE_MAX_RECORD 1024
+
+// File layout: CAPTURE_MAGIC and the sample rate as int32, then records of
+// zigzag varint time delta (ns), varint length and the raw bytes. Every serial
+// port session starts with a record of length 0 whose time is absolute.
+
+typedef struct capture_t
+{
+    FILE *file;
+    int64_t last_time;
+    int64_t last_flush_ms;
+} Capture;
+
+Capture *capture_open(char *path, int sample_rate, int64_t time);
+
+bool capture_write(Capture *capture, int64_t time, char *data, size_t length);
+
+void capture_close(Capture *capture);
+
+Capture *replay_open(char *path, int *sample_rate);
+
+bool replay_next(Capture *replay, int64_t *time, char *data, size_t *length);
+
+#endif
@@ -0,0 +1,207 @@
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "clock_discipline.h"
+#include "scheduler.h"
+
+#define CLOCK_STEP_THRESHOLD_NS 1000000000.0
+#define CLOCK_SOURCE_ALPHA 0.05
+#define CLOCK_SOURCE_BETA 0.001
+
+void clock_discipline_init(ClockDiscipline *cd, int sample_rate, double bandwidth) {
+    cd->bandwidth = bandwidth;
+    cd->sample_rate = sample_rate;
+    cd->locked = false;
+    cd->initialized = false;
+    cd->lock_count = 0;
+    cd->update_count = 0;
+    cd->block_samples = sample_rate * CLOCK_UPDATE_INTERVAL_MS / 1000;
+    if (cd->block_samples < 1) {
+        cd->block_samples = 1;
+    }
+    cd->block_count = 0;
+    cd->block_sum = 0;
+    cd->integrator = 0;
+    cd->phase_error = 0;
+}
+
+// PI loop: the Arduino shift is the frequency control, the averaged timing
+// diff of each block is the phase error. Gains come from a second order loop
+// with natural frequency 2 * pi * bandwidth and CLOCK_DAMPING.
+bool clock_discipline_update(ClockDiscipline *cd, int64_t diff_us, int shift, int *steps) {
+    cd->block_sum += diff_us;
+    cd->block_count++;
+    if (cd->block_count < cd->block_samples) {
+        return false;
+    }
+
+    double error = cd->block_sum / (double) cd->block_count;
+    cd->block_sum = 0;
+    cd->block_count = 0;
+    cd->phase_error = error;
+    cd->update_count++;
+
+    if (!cd->initialized) {
+        cd->integrator = shift;
+        cd->initialized = true;
+    }
+
+    if (!cd->locked) {
+        if (fabs(error) < CLOCK_LOCK_THRESHOLD_US) {
+            cd->lock_count++;
+            cd->locked = cd->lock_count >= CLOCK_LOCK_UPDATES;
+        } else {
+            cd->lock_count = 0;
+        }
+    }
+
+    double bandwidth = cd->locked ? cd->bandwidth : cd->bandwidth * CLOCK_CALIBRATION_GEAR;
+    double wn = 2.0 * M_PI * bandwidth;
+    double gain = cd->sample_rate * CLOCK_SHIFT_UNIT_US;
+    double interval = cd->block_samples / (double) cd->sample_rate;
+
+    // while the proportional term saturates the phase just slews towards zero
+    // and the integrator is frozen, otherwise it would wind up and overshoot
+    double correction = -(2.0 * CLOCK_DAMPING * wn / gain) * error;
+    if (correction > CLOCK_MAX_CORRECTION) {
+        correction = CLOCK_MAX_CORRECTION;
+    } else if (correction < -CLOCK_MAX_CORRECTION) {
+        correction = -CLOCK_MAX_CORRECTION;
+    } else {
+        cd->integrator -= (wn * wn / gain) * error * interval;
+    }
+
+    double target = cd->integrator + correction;
+
+    int conf = (int) lround(target) - shift;
+    if (conf > CLOCK_MAX_STEPS) {
+        conf = CLOCK_MAX_STEPS;
+    } else if (conf < -CLOCK_MAX_STEPS) {
+        conf = -CLOCK_MAX_STEPS;
+    }
+
+    *steps = conf;
+    return true;
+}
+
+// Sample timestamps come from CLOCK_MONOTONIC_RAW, which NTP never slews or steps.
+// Its offset to CLOCK_REALTIME is tracked by an alpha-beta filter so that the
+// timestamps still follow wall time in the long run.
+
+bool source_set = false;
+int64_t source_raw_ns;
+double source_offset_ns;
+double source_rate;
+
+int64_t raw_nanos(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &time);
+    return (int64_t) (time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+void clock_source_reset(void) {
+    source_set = false;
+}
+
+void clock_source_update(void) {
+    struct timespec real;
+    int64_t raw_ns = raw_nanos();
+    clock_gettime(CLOCK_REALTIME, &real);
+    int64_t offset = (int64_t) (real.tv_sec) * 1000000000 + real.tv_nsec - raw_ns;
+
+    if (!source_set) {
+        source_raw_ns = raw_ns;
+        source_offset_ns = offset;
+        source_rate = 0;
+        source_set = true;
+        return;
+    }
+
+    double dt = raw_ns - source_raw_ns;
+    if (dt <= 0) {
+        return;
+    }
+
+    double predicted = source_offset_ns + source_rate * dt;
+    double residual = offset - predicted;
+
+    if (fabs(residual) > CLOCK_STEP_THRESHOLD_NS) {
+        ZEJF_LOG(1, "System clock stepped by %.3fs\n", residual / 1000000000.0);
+        source_offset_ns = offset;
+        source_rate = 0;
+    } else {
+        source_offset_ns = predicted + CLOCK_SOURCE_ALPHA * residual;
+        source_rate += CLOCK_SOURCE_BETA * residual / dt;
+    }
+    source_raw_ns = raw_ns;
+}
+
+int64_t clock_source_now(void) {
+    if (!source_set) {
+        clock_source_update();
+    }
+    int64_t raw_ns = raw_nanos();
+    return raw_ns + (int64_t) (source_offset_ns + source_rate * (raw_ns - source_raw_ns));
+}
+
+uint32_t simulation_seed;
+
+double simulation_random(void) {
+    simulation_seed = simulation_seed * 1664525u + 1013904223u;
+    return simulation_seed / 4294967296.0;
+}
+
+// Feeds the loop with a simulated Arduino whose oscillator is off by drift_ppm
+// and whose samples arrive with a fixed latency plus uniform jitter. Fully
+// deterministic, so results of different builds or bandwidths can be compared.
+void clock_simulation_run(ClockSimulation *sim) {
+    ClockDiscipline cd;
+    clock_discipline_init(&cd, sim->sample_rate, sim->bandwidth);
+    simulation_seed = 12345;
+
+    double nominal_us = 1000000.0 / sim->sample_rate;
+    double true_time_us = 1000000000.0 + simulation_random() * nominal_us;
+    double first_expected_us = 0;
+    int shift = 0;
+
+    int64_t samples = (int64_t) sim->duration_sec * sim->sample_rate;
+    int64_t steady_count = 0;
+    double steady_sum = 0;
+    double steady_sum_sq = 0;
+
+    sim->convergence_sec = -1;
+    sim->steady_peak_us = 0;
+
+    for (int64_t k = 0; k < samples; k++) {
+        double measured_us = true_time_us + sim->latency_us + sim->jitter_us * (2.0 * simulation_random() - 1.0);
+        if (k == 0) {
+            first_expected_us = (floor(measured_us / nominal_us) + 1) * nominal_us;
+        } else {
+            double expected_us = first_expected_us + k * nominal_us;
+            double diff = measured_us - expected_us;
+            int steps;
+            if (clock_discipline_update(&cd, llround(diff), shift, &steps)) {
+                shift += steps;
+                if (cd.locked && sim->convergence_sec < 0) {
+                    sim->convergence_sec = k / (double) sim->sample_rate;
+                }
+            }
+
+            if (cd.locked && k >= samples / 2) {
+                double error = true_time_us + sim->latency_us - expected_us;
+                steady_count++;
+                steady_sum += error;
+                steady_sum_sq += error * error;
+                if (fabs(error) > sim->steady_peak_us) {
+                    sim->steady_peak_us = fabs(error);
+                }
+            }
+        }
+
+        true_time_us += nominal_us * (1.0 + sim->drift_ppm / 1000000.0) + shift * CLOCK_SHIFT_UNIT_US;
+    }
+
+    sim->steady_mean_us = steady_count > 0 ? steady_sum / steady_count : NAN;
+    sim->steady_rms_us = steady_count > 0 ? sqrt(steady_sum_sq / steady_count) : NAN;
+}
@@ -0,0 +1,65 @@
+#ifndef CLOCK_DISCIPLINE_H
+#define CLOCK_DISCIPLINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CLOCK_DEFAULT_BANDWIDTH 0.01
+#define CLOCK_CALIBRATION_GEAR 5.0
+#define CLOCK_DAMPING 0.707
+
+#define CLOCK_UPDATE_INTERVAL_MS 500
+#define CLOCK_LOCK_THRESHOLD_US 1500
+#define CLOCK_LOCK_UPDATES 6
+#define CLOCK_MAX_STEPS 50
+#define CLOCK_MAX_CORRECTION 100
+
+// change of the sample period caused by a single '+' or '-' sent to the Arduino
+#define CLOCK_SHIFT_UNIT_US 1.0
+
+typedef struct clock_discipline_t
+{
+    double bandwidth;
+    int sample_rate;
+
+    bool locked;
+    bool initialized;
+    int lock_count;
+    int64_t update_count;
+
+    int block_samples;
+    int block_count;
+    int64_t block_sum;
+
+    double integrator;
+    double phase_error;
+} ClockDiscipline;
+
+typedef struct clock_simulation_t
+{
+    int sample_rate;
+    double bandwidth;
+    double drift_ppm;
+    double jitter_us;
+    double latency_us;
+    int duration_sec;
+
+    double convergence_sec;
+    double steady_mean_us;
+    double steady_rms_us;
+    double steady_peak_us;
+} ClockSimulation;
+
+void clock_discipline_init(ClockDiscipline *cd, int sample_rate, double bandwidth);
+
+bool clock_discipline_update(ClockDiscipline *cd, int64_t diff_us, int shift, int *steps);
+
+void clock_source_reset(void);
+
+void clock_source_update(void);
+
+int64_t clock_source_now(void);
+
+void clock_simulation_run(ClockSimulation *sim);
+
+#endif
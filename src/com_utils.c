@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,4 +11,34 @@ int64_t read_64(FILE *file) {
         return 0;
     }
     return atol(buff);
+}
+
+// false on EOF or anything but a number followed by the end of the line
+bool read_64_checked(FILE *file, int64_t *value) {
+    char buff[32];
+    if (fgets(buff, 32, file) == NULL) {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    long long result = strtoll(buff, &end, 10);
+    if (end == buff || errno != 0) {
+        return false;
+    }
+    if (*end == '\r') {
+        end++;
+    }
+    if (*end != '\n') {
+        return false;
+    }
+    *value = result;
+    return true;
+}
+
+uint64_t read_u64(FILE *file) {
+    char buff[32];
+    if (fgets(buff, 32, file) == NULL) {
+        return 0;
+    }
+    return strtoull(buff, NULL, 10);
 }
\ No newline at end of file
@@ -1,9 +1,14 @@
 #ifndef COM_UTILS_H
 #define COM_UTILS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
 int64_t read_64(FILE *file);
 
+bool read_64_checked(FILE *file, int64_t *value);
+
+uint64_t read_u64(FILE *file);
+
 #endif
\ No newline at end of file
@@ -3,7 +3,9 @@
 #include <string.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -11,39 +13,185 @@
 
 #include "arraylist.h"
 #include "data.h"
+#include "decimator.h"
+#include "hour_index.h"
+#include "hour_io.h"
+#include "hour_path.h"
+#include "hour_pool.h"
+#include "lock_profile.h"
+#include "metrics.h"
 #include "my_string.h"
+#include "retention.h"
 #include "time_utils.h"
 #include "scheduler.h"
+#include "spectrum.h"
+#include "thread_pool.h"
 
-const int SAMPLE_RATES[5] = { 20, 40, 60, 100, 200 };
+const int SAMPLE_RATES[SAMPLE_RATE_COUNT] = { 20, 40, 60, 100, 200, 500, 1000 };
 int SAMPLES_PER_SECOND;
-int SAMPLE_TIME_MS;
 int SAMPLES_IN_HOUR;
 
 ArrayList *datahours;
 pthread_mutex_t data_lock;
 int64_t last_received_log_id = -1;
-DataHour *current_datahour = NULL;
-DataHour *last_datahour = NULL;
+DataHour *current_datahour[STREAM_COUNT] = { NULL };
+DataHour *last_datahour[STREAM_COUNT] = { NULL };
 
 size_t datahour_get_size() {
     return sizeof(DataHour) + SAMPLES_IN_HOUR * sizeof(int32_t);
 }
 
-DataHour *datahour_create(int32_t hour_id) {
-    DataHour *datahour = calloc(1, datahour_get_size());
+// bytes the samples take in memory and on disk
+size_t datahour_samples_size(DataHour *dh) {
+    return (size_t) SAMPLES_IN_HOUR * dh->sample_width;
+}
+
+int sample_width_for(int32_t value) {
+    if (value == ERR_VAL || (value > INT16_MIN && value <= INT16_MAX)) {
+        return SAMPLE_WIDTH_16;
+    }
+    if (value > SAMPLE_24_MIN && value <= SAMPLE_24_MAX) {
+        return SAMPLE_WIDTH_24;
+    }
+    return SAMPLE_WIDTH_32;
+}
+
+// the width of an hour file from the size of its samples, 0 if it's invalid
+int datahour_file_width(int64_t sample_bytes) {
+    for (int width = SAMPLE_WIDTH_16; width <= SAMPLE_WIDTH_32; width++) {
+        if (sample_bytes == (int64_t) SAMPLES_IN_HOUR * width) {
+            return width;
+        }
+    }
+    return 0;
+}
+
+int32_t sample_load(const uint8_t *samples, int width, int32_t index) {
+    if (width == SAMPLE_WIDTH_16) {
+        int16_t value;
+        memcpy(&value, samples + index * SAMPLE_WIDTH_16, sizeof(int16_t));
+        return value == INT16_MIN ? ERR_VAL : value;
+    }
+    if (width == SAMPLE_WIDTH_24) {
+        const uint8_t *p = samples + (size_t) index * SAMPLE_WIDTH_24;
+        uint32_t bits = p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16;
+        int32_t value = (int32_t) (bits & 0x800000 ? bits | 0xFF000000u : bits);
+        return value == SAMPLE_24_MIN ? ERR_VAL : value;
+    }
+    int32_t value;
+    memcpy(&value, samples + (size_t) index * SAMPLE_WIDTH_32, sizeof(int32_t));
+    return value;
+}
+
+// the value has to fit the width
+void sample_store(uint8_t *samples, int width, int32_t index, int32_t value) {
+    if (width == SAMPLE_WIDTH_16) {
+        int16_t narrow = value == ERR_VAL ? INT16_MIN : (int16_t) value;
+        memcpy(samples + index * SAMPLE_WIDTH_16, &narrow, sizeof(int16_t));
+    } else if (width == SAMPLE_WIDTH_24) {
+        uint32_t bits = (uint32_t) (value == ERR_VAL ? SAMPLE_24_MIN : value);
+        uint8_t *p = samples + (size_t) index * SAMPLE_WIDTH_24;
+        p[0] = bits;
+        p[1] = bits >> 8;
+        p[2] = bits >> 16;
+    } else {
+        memcpy(samples + (size_t) index * SAMPLE_WIDTH_32, &value, sizeof(int32_t));
+    }
+}
+
+int32_t datahour_get(DataHour *dh, int32_t index) {
+    return sample_load(dh->samples, dh->sample_width, index);
+}
+
+void datahour_read_samples(DataHour *dh, int32_t first, int32_t count, int32_t *out) {
+    if (dh->sample_width == SAMPLE_WIDTH_32) {
+        memcpy(out, dh->samples + (size_t) first * SAMPLE_WIDTH_32, count * sizeof(int32_t));
+        return;
+    }
+    for (int32_t i = 0; i < count; i++) {
+        out[i] = sample_load(dh->samples, dh->sample_width, first + i);
+    }
+}
+
+// Rewrites the samples in place. Wider samples never overlap the narrower
+// ones that are still to be read if the copy runs from the end, narrower
+// ones if it runs from the start.
+void datahour_convert(DataHour *dh, int width) {
+    int old_width = dh->sample_width;
+    if (width > old_width) {
+        for (int32_t i = SAMPLES_IN_HOUR - 1; i >= 0; i--) {
+            sample_store(dh->samples, width, i, sample_load(dh->samples, old_width, i));
+        }
+    } else {
+        for (int32_t i = 0; i < SAMPLES_IN_HOUR; i++) {
+            sample_store(dh->samples, width, i, sample_load(dh->samples, old_width, i));
+        }
+    }
+    dh->sample_width = width;
+}
+
+// values that don't fit widen the whole hour
+void datahour_set(DataHour *dh, int32_t index, int32_t value) {
+    int width = sample_width_for(value);
+    if (width > dh->sample_width) {
+        ZEJF_LOG(0, "Widening hour %d from %d to %d bytes per sample\n", dh->hour_id, dh->sample_width, width);
+        datahour_convert(dh, width);
+        dh->sealed = false;
+    }
+    sample_store(dh->samples, dh->sample_width, index, value);
+}
+
+// back to 32 bit for code that wants a plain array
+int32_t *datahour_widen(DataHour *dh) {
+    if (dh->sample_width != SAMPLE_WIDTH_32) {
+        datahour_convert(dh, SAMPLE_WIDTH_32);
+        dh->sealed = false;
+    }
+    return (int32_t *) dh->samples;
+}
+
+// Narrows a complete hour to the smallest width its values fit and gives the
+// pages behind the samples back. Returns true if the width changed.
+bool datahour_seal(DataHour *dh) {
+    if (dh->sealed || dh->tier_factor != 1) {
+        return false;
+    }
+    dh->sealed = true;
+
+    int width = SAMPLE_WIDTH_16;
+    for (int32_t i = 0; i < SAMPLES_IN_HOUR && width < dh->sample_width; i++) {
+        width = MAX(width, sample_width_for(datahour_get(dh, i)));
+    }
+    if (width >= dh->sample_width) {
+        return false;
+    }
+
+    datahour_convert(dh, width);
+    long page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t unused = ((uintptr_t) (dh->samples + datahour_samples_size(dh)) + page_size - 1) / page_size * page_size;
+    uintptr_t end = ((uintptr_t) dh + datahour_get_size()) / page_size * page_size;
+    if (end > unused) {
+        // fails on explicit huge pages, they just stay in use
+        madvise((void *) unused, end - unused, MADV_DONTNEED);
+    }
+    return true;
+}
+
+DataHour *datahour_create(int stream, int32_t hour_id) {
+    DataHour *datahour = hour_pool_alloc();
     if (datahour == NULL) {
-        perror("calloc");
         return NULL;
     }
 
+    memset(datahour, 0, sizeof(DataHour));
     datahour->hour_id = hour_id;
+    datahour->stream = stream;
     datahour->sample_count = 0;
+    datahour->tier_factor = 1;
+    datahour->sample_width = SAMPLE_WIDTH_32;
     datahour->modified = false;
     datahour->last_access_ms = millis();
-    for (int i = 0; i < SAMPLES_IN_HOUR; i++) {
-        datahour->samples[i] = ERR_VAL;
-    }
+    samples_fill_err((int32_t *) datahour->samples, SAMPLES_IN_HOUR);
     return datahour;
 }
 
@@ -52,11 +200,15 @@ void datahour_destroy(DataHour *datahour) {
         return;
     }
 
-    if (last_datahour != NULL && last_datahour->hour_id == datahour->hour_id) {
-        last_datahour = NULL;
+    if (last_datahour[datahour->stream] == datahour) {
+        last_datahour[datahour->stream] = NULL;
     }
 
-    free(datahour);
+    if (current_datahour[datahour->stream] == datahour) {
+        current_datahour[datahour->stream] = NULL;
+    }
+
+    hour_pool_free(datahour);
 }
 
 int mkpath(char *file_path, mode_t mode) {
@@ -78,71 +230,133 @@ bool datahour_save(DataHour *dh) {
         return false;
     }
 
-    String *file = get_datahour_path_newest(dh->hour_id);
-    String *path = string_create(file->data);
-    memset(strrchr(path->data, '/') + 1, '\0', 1);
-
-    struct stat st = { 0 };
+    // log_data() never writes to them
+    if (dh->tier_factor != 1) {
+        dh->modified = false;
+        return true;
+    }
 
-    if (stat(path->data, &st) == -1) {
-        ZEJF_LOG(1, "Creating %s\n", path->data);
-        if (mkpath(path->data, 0700) != 0) {
-            perror("mkdir");
-            string_destroy(file);
-            string_destroy(path);
-            return false;
-        }
+    int64_t start_us = micros();
+    HourLocation loc;
+    datahour_location(dh->stream, dh->hour_id, &loc);
+    if (!hour_location_make_dir(&loc)) {
+        hour_location_release(&loc);
+        return false;
     }
 
-    FILE *actual_file = fopen(file->data, "wb");
+    // written next to the hour and renamed over it, readers never see half a file
+    char tmp_name[HOUR_NAME_MAX];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", loc.name);
+
+    int fd = hour_location_open(&loc, tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    FILE *actual_file = fd == -1 ? NULL : fdopen(fd, "wb");
     if (actual_file == NULL) {
         perror("fopen");
-        string_destroy(file);
-        string_destroy(path);
+        if (fd != -1) {
+            close(fd);
+        }
+        hour_location_release(&loc);
         return false;
     }
 
-    ZEJF_LOG(1, "Saving to %s, %d\n", file->data, dh->hour_id);
+    ZEJF_LOG(1, "Saving to %s, %d\n", loc.path, dh->hour_id);
 
-    bool result;
-    if ((result = (fwrite(dh, datahour_get_size(), 1, actual_file) == 1))) {
-        dh->modified = false;
+    DataHourHeader header;
+    datahour_header(dh, &header);
+
+    bool result = fwrite(&header, sizeof(DataHourHeader), 1, actual_file) == 1 && fwrite(dh->samples, dh->sample_width, SAMPLES_IN_HOUR, actual_file) == (size_t) SAMPLES_IN_HOUR;
+    result = fclose(actual_file) == 0 && result;
+
+    if (result && !hour_location_rename(&loc, tmp_name, loc.name)) {
+        perror("rename");
+        result = false;
     }
 
-    fclose(actual_file);
-    string_destroy(file);
-    string_destroy(path);
+    if (result) {
+        datahour_saved(dh, start_us);
+    } else {
+        hour_location_unlink(&loc, tmp_name);
+    }
+    hour_location_release(&loc);
 
     return result;
 }
 
-DataHour *datahour_load(FILE *file) {
+void datahour_header(DataHour *dh, DataHourHeader *header) {
+    memset(header, 0, sizeof(DataHourHeader));
+    header->stream = dh->stream;
+    header->sample_width = dh->sample_width;
+    header->last_access_ms = dh->last_access_ms;
+    header->hour_id = dh->hour_id;
+    header->sample_count = dh->sample_count;
+}
+
+// the hour file was replaced with the current samples
+void datahour_saved(DataHour *dh, int64_t start_us) {
+    dh->modified = false;
+    HourIndex entry;
+    hour_index_compute(dh, &entry);
+    hour_index_update(&entry);
+    metrics_observe(&metrics.save_duration, micros() - start_us);
+}
+
+DataHour *datahour_load(FILE *file, int stream) {
     if (file == NULL) {
         return NULL;
     }
 
-    DataHour *datahour = malloc(datahour_get_size());
+    DataHour *datahour = hour_pool_alloc();
     if (datahour == NULL) {
-        perror("malloc");
         return NULL;
     }
 
-    if (fread(datahour, datahour_get_size(), 1, file) != 1) {
+    struct stat st;
+    int width = fstat(fileno(file), &st) == 0 ? datahour_file_width(st.st_size - (int64_t) sizeof(DataHourHeader)) : 0;
+    if (width == 0) {
+        ZEJF_LOG(2, "Hour file has an invalid size\n");
+        hour_pool_free(datahour);
+        return NULL;
+    }
+
+    DataHourHeader header;
+    if (fread(&header, sizeof(DataHourHeader), 1, file) != 1 || fread(datahour->samples, width, SAMPLES_IN_HOUR, file) != (size_t) SAMPLES_IN_HOUR) {
         if (errno != 0) {
             perror("fread");
         } else {
             ZEJF_LOG(2, "Read failed\n");
         }
-        free(datahour);
+        hour_pool_free(datahour);
         return NULL;
     }
 
-    datahour->modified = false;
-    datahour->last_access_ms = millis();
-
+    datahour_loaded(datahour, &header, stream, width);
     return datahour;
 }
 
+// the rest of the fields once the header and the samples were read
+void datahour_loaded(DataHour *dh, DataHourHeader *header, int stream, int sample_width) {
+    dh->sample_width = sample_width;
+    dh->sealed = sample_width != SAMPLE_WIDTH_32;
+    dh->modified = false;
+    dh->stream = stream;
+    dh->last_access_ms = millis();
+    dh->hour_id = header->hour_id;
+    dh->sample_count = header->sample_count;
+    dh->tier_factor = 1;
+    datahour_compute_digests(dh);
+}
+
+void datahour_compute_digests(DataHour *dh) {
+    int minute_samples = SAMPLES_IN_HOUR / DIGEST_MINUTES;
+    memset(dh->minute_digests, 0, sizeof(dh->minute_digests));
+    for (int i = 0; i < SAMPLES_IN_HOUR; i++) {
+        int32_t value = datahour_get(dh, i);
+        if (value != ERR_VAL) {
+            dh->minute_digests[i / minute_samples] += sample_digest(i, value);
+        }
+    }
+}
+
 void datahour_destructor(void **ptr) {
     if (ptr == NULL) {
         return;
@@ -151,16 +365,68 @@ void datahour_destructor(void **ptr) {
     datahour_destroy(dh);
 }
 
-DataHour *get_datahour(int32_t hour_id, bool load_from_file, bool create_new) {
+// the hour file or its decimated tier, not added to the loaded hours
+DataHour *datahour_read_file(int stream, int32_t hour_id, bool report_missing) {
+    HourLocation loc;
+    datahour_location(stream, hour_id, &loc);
+
+    DataHour *dh = NULL;
+    int fd = hour_location_open(&loc, loc.name, O_RDONLY, 0);
+    FILE *file = fd == -1 ? NULL : fdopen(fd, "rb");
+    if (file != NULL) {
+        ZEJF_LOG(1, "Load %s\n", loc.path);
+        dh = datahour_load(file, stream);
+        fclose(file);
+    } else {
+        int error = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        if ((dh = tier_load(stream, hour_id)) == NULL && report_missing) {
+            errno = error;
+            perror(loc.path);
+        }
+    }
+    hour_location_release(&loc);
+    return dh;
+}
+
+// Private copy of an hour for long reads. Loaded hours are copied since they
+// can have unsaved samples, the rest is read from disk without going through
+// the loaded hours, so scans don't push out the hours realtime clients use.
+DataHour *datahour_read(int stream, int32_t hour_id) {
+    DataHour *dh = NULL;
+    MUTEX_LOCK(&data_lock);
+    DataHour *loaded = get_datahour(stream, hour_id, false, false);
+    if (loaded != NULL && (dh = hour_pool_alloc()) != NULL) {
+        memcpy(dh, loaded, datahour_get_size());
+    }
+    MUTEX_UNLOCK(&data_lock);
+
+    if (loaded != NULL) {
+        return dh;
+    }
+
+    dh = datahour_read_file(stream, hour_id, false);
+    if (dh != NULL && dh->hour_id != hour_id) {
+        datahour_destroy(dh);
+        dh = NULL;
+    }
+    return dh;
+}
+
+DataHour *get_datahour(int stream, int32_t hour_id, bool load_from_file, bool create_new) {
     // optimalisation
-    if (last_datahour != NULL && last_datahour->hour_id == hour_id) {
-        return last_datahour;
+    if (last_datahour[stream] != NULL && last_datahour[stream]->hour_id == hour_id) {
+        metrics.datahour_hits++;
+        return last_datahour[stream];
     }
 
     for (size_t i = 0; i < datahours->item_count; i++) {
         DataHour *dh = *(DataHour **) list_get(datahours, i);
-        if (dh->hour_id == hour_id) {
-            last_datahour = dh;
+        if (dh->hour_id == hour_id && dh->stream == stream) {
+            last_datahour[stream] = dh;
+            metrics.datahour_hits++;
             return dh;
         }
     }
@@ -170,19 +436,8 @@ DataHour *get_datahour(int32_t hour_id, bool load_from_file, bool create_new) {
     bool modified = false;
 
     if (load_from_file) {
-        String *path = get_datahour_path_newest(hour_id);
-        if (path == NULL) {
-            return NULL;
-        }
-        FILE *file = fopen(path->data, "rb");
-        if (file != NULL) {
-            ZEJF_LOG(1, "Load %s\n", path->data);
-            dh = datahour_load(file);
-            fclose(file);
-        } else {
-            perror(path->data);
-        }
-        string_destroy(path);
+        metrics.datahour_misses++;
+        dh = datahour_read_file(stream, hour_id, true);
     }
 
     if (dh != NULL && dh->hour_id != hour_id) {
@@ -192,7 +447,7 @@ DataHour *get_datahour(int32_t hour_id, bool load_from_file, bool create_new) {
     }
 
     if (create_new && dh == NULL) {
-        dh = datahour_create(hour_id);
+        dh = datahour_create(stream, hour_id);
         ZEJF_LOG(0, "+1 DH\n");
     }
 
@@ -205,109 +460,90 @@ DataHour *get_datahour(int32_t hour_id, bool load_from_file, bool create_new) {
     }
 
     list_append(datahours, &dh);
-    last_datahour = dh;
+    last_datahour[stream] = dh;
     return dh;
 }
 
-char months[12][10] = { "January\0", "February\0", "March\0", "April\0", "May\0", "June\0", "July\0", "August\0", "September\0", "October\0", "November\0", "December\0" };
-
-String *get_datahour_path_old(int32_t hour_id) {
-    String *result = string_create(MAIN_FOLDER);
-    if (result == NULL) {
-        return NULL;
-    }
-    char text[128];
-    time_t now = hour_id * 60 * 60;
-    struct tm *t = localtime(&now);
+const char *STREAM_SUFFIXES[STREAM_COUNT] = { "", "_filtered" };
 
-    snprintf(text, sizeof(text), "%d_sps/", SAMPLES_PER_SECOND);
-    string_append(result, text);
-
-    strftime(text, sizeof(text) - 1, "%Y/", t);
-    string_append(result, text);
-    string_append(result, months[t->tm_mon]);
-
-    strftime(text, sizeof(text) - 1, "/%d/%HH.dat", t);
-    string_append(result, text);
+// the folder and name of the current hour file
+void datahour_location(int stream, int32_t hour_id, HourLocation *loc) {
+    hour_location_get(hour_id, loc);
+    hour_location_set_name(loc, "%02dH_%d%s.cs4", loc->hour, hour_id, STREAM_SUFFIXES[stream]);
+}
 
+String *get_datahour_path_old(int32_t hour_id) {
+    HourLocation loc;
+    hour_location_get(hour_id, &loc);
+    hour_location_set_name(&loc, "%02dH.dat", loc.hour);
+    String *result = string_create(loc.path);
+    hour_location_release(&loc);
     return result;
 }
 
 String *get_datahour_path_new(int32_t hour_id) {
-    String *result = string_create(MAIN_FOLDER);
-    if (result == NULL) {
-        return NULL;
-    }
-    char text[128];
-    time_t now = hour_id * 60 * 60;
-    struct tm *t = localtime(&now);
-
-    snprintf(text, sizeof(text), "%d_sps/", SAMPLES_PER_SECOND);
-    string_append(result, text);
-
-    strftime(text, sizeof(text) - 1, "%Y/", t);
-    string_append(result, text);
-    string_append(result, months[t->tm_mon]);
-
-    strftime(text, sizeof(text) - 1, "/%d/%HH", t);
-    string_append(result, text);
-
-    snprintf(text, sizeof(text), "_%d.dat", hour_id);
-    string_append(result, text);
-
+    HourLocation loc;
+    hour_location_get(hour_id, &loc);
+    hour_location_set_name(&loc, "%02dH_%d.dat", loc.hour, hour_id);
+    String *result = string_create(loc.path);
+    hour_location_release(&loc);
     return result;
 }
 
-String *get_datahour_path_newest(int32_t hour_id) {
-    String *result = string_create(MAIN_FOLDER);
-    if (result == NULL) {
-        return NULL;
-    }
-    char text[128];
-    time_t now = hour_id * 60 * 60;
-    struct tm *t = localtime(&now);
-
-    snprintf(text, sizeof(text), "%d_sps/", SAMPLES_PER_SECOND);
-    string_append(result, text);
-
-    strftime(text, sizeof(text) - 1, "%Y/", t);
-    string_append(result, text);
-    string_append(result, months[t->tm_mon]);
-
-    strftime(text, sizeof(text) - 1, "/%d/%HH", t);
-    string_append(result, text);
-
-    snprintf(text, sizeof(text), "_%d.cs4", hour_id);
-    string_append(result, text);
-
+String *get_datahour_path_newest(int stream, int32_t hour_id) {
+    HourLocation loc;
+    datahour_location(stream, hour_id, &loc);
+    String *result = string_create(loc.path);
+    hour_location_release(&loc);
     return result;
 }
 
-int32_t get_log(int64_t log_id) {
+int32_t get_log(int stream, int64_t log_id) {
     int32_t hour_id = get_hour_id(log_id);
-    DataHour *dh = get_datahour(hour_id, true, true);
+    DataHour *dh = get_datahour(stream, hour_id, true, true);
     if (dh == NULL) {
         return ERR_VAL;
     }
     dh->last_access_ms = millis();
-    return dh->samples[log_id % SAMPLES_IN_HOUR];
+    return datahour_get(dh, log_id % SAMPLES_IN_HOUR);
 }
 
-void log_data(int64_t log_id, int32_t val) {
+void log_data(int stream, int64_t log_id, int32_t val) {
     int32_t hour_id = get_hour_id(log_id);
-    if (current_datahour == NULL || current_datahour->hour_id != hour_id) {
-        current_datahour = get_datahour(hour_id, true, true);
-        if (current_datahour == NULL) {
+    DataHour *dh = current_datahour[stream];
+    if (dh == NULL || dh->hour_id != hour_id) {
+        dh = current_datahour[stream] = get_datahour(stream, hour_id, true, true);
+        if (dh == NULL) {
             return;
         }
+        if (dh->tier_factor != 1) {
+            ZEJF_LOG(2, "Hour %d is decimated and read only, dropping its new samples\n", hour_id);
+        }
     }
-    current_datahour->modified = true;
-    current_datahour->last_access_ms = millis();
-    if (current_datahour->samples[log_id % SAMPLES_IN_HOUR] == ERR_VAL && val != ERR_VAL) {
-        current_datahour->sample_count++;
+    if (dh->tier_factor != 1) {
+        statistics.tier_rejected++;
+        return;
+    }
+    dh->modified = true;
+    dh->last_access_ms = millis();
+    int32_t index = log_id % SAMPLES_IN_HOUR;
+    int32_t old = datahour_get(dh, index);
+    if (old == ERR_VAL && val != ERR_VAL) {
+        dh->sample_count++;
+    }
+
+    uint64_t *digest = &dh->minute_digests[index / (SAMPLES_IN_HOUR / DIGEST_MINUTES)];
+    if (old != ERR_VAL) {
+        *digest -= sample_digest(index, old);
+    }
+    if (val != ERR_VAL) {
+        *digest += sample_digest(index, val);
+    }
+    datahour_set(dh, index, val);
+    if (stream == STREAM_RAW) {
+        spectrum_sample(log_id);
+        last_received_log_id = log_id;
     }
-    current_datahour->samples[log_id % SAMPLES_IN_HOUR] = val;
-    last_received_log_id = log_id;
 }
 
 void data_init(void) {
@@ -324,21 +560,40 @@ void data_init(void) {
     }
 
     pthread_mutex_init(&data_lock, NULL);
+    hour_io_init();
+}
+
+// hour_io_save() if it's available, one by one otherwise
+void save_batch(DataHour **hours, size_t count) {
+    if (hour_io_save(hours, count)) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (hours[i]->modified) {
+            datahour_save(hours[i]);
+        }
+    }
 }
 
 void autosave() {
-    pthread_mutex_lock(&data_lock);
-    size_t i = 0;
+    MUTEX_LOCK(&data_lock);
+    DataHour *modified[AUTOSAVE_BATCH];
+    size_t batch = 0;
     size_t count = 0;
-    while (i < datahours->item_count) {
+    for (size_t i = 0; i < datahours->item_count; i++) {
         DataHour *dh = *(DataHour **) list_get(datahours, i);
-        if (dh->modified) {
-            datahour_save(dh);
-            count++;
+        if (!dh->modified) {
+            continue;
+        }
+        modified[batch++] = dh;
+        count++;
+        if (batch == AUTOSAVE_BATCH) {
+            save_batch(modified, batch);
+            batch = 0;
         }
-        i++;
     }
-    pthread_mutex_unlock(&data_lock);
+    save_batch(modified, batch);
+    MUTEX_UNLOCK(&data_lock);
 
     ZEJF_LOG(1, "Saved %ld datahours\n", count);
 }
@@ -348,7 +603,7 @@ size_t datahours_count() {
 }
 
 void cleanup() {
-    pthread_mutex_lock(&data_lock);
+    MUTEX_LOCK(&data_lock);
     size_t i = 0;
     size_t count = 0;
     int64_t current_millis = millis();
@@ -363,21 +618,177 @@ void cleanup() {
         i++;
     }
 
-    pthread_mutex_unlock(&data_lock);
+    MUTEX_UNLOCK(&data_lock);
 
     ZEJF_LOG(0, "destroyed %ld DataHours, current count: %ld\n", count, datahours->item_count);
 }
 
+// Runs task once for each of the count items, spread over up to
+// DATA_IO_MAX_THREADS workers. Without workers it runs them one by one.
+void data_run_parallel(ThreadPoolTask task, void *items, size_t item_size, size_t count) {
+    long threads = MIN(sysconf(_SC_NPROCESSORS_ONLN), DATA_IO_MAX_THREADS);
+    threads = MIN(threads, (long) count);
+    ThreadPool *pool = threads > 1 ? thread_pool_create(threads, count) : NULL;
+    for (size_t i = 0; i < count; i++) {
+        void *item = (char *) items + i * item_size;
+        if (pool != NULL) {
+            thread_pool_submit(pool, task, item);
+        } else {
+            task(item);
+        }
+    }
+    thread_pool_destroy(pool);
+}
+
+// skips the ones hour_io_load() already did
+void hour_load_task(void *arg) {
+    HourLoad *load = (HourLoad *) arg;
+    if (load->dh != NULL) {
+        return;
+    }
+    load->dh = datahour_read_file(load->stream, load->hour_id, false);
+    if (load->dh != NULL && load->dh->hour_id != load->hour_id) {
+        datahour_destroy(load->dh);
+        load->dh = NULL;
+    }
+}
+
+int64_t newest_log_id(DataHour *dh) {
+    for (int i = SAMPLES_IN_HOUR - 1; i >= 0; i--) {
+        if (datahour_get(dh, i) != ERR_VAL) {
+            return (int64_t) dh->hour_id * SAMPLES_IN_HOUR + i;
+        }
+    }
+    return -1;
+}
+
+// Loads the stored hours that cleanup() would keep anyway and recovers
+// last_received_log_id from the newest raw hour, so clients that connect
+// before the serial port delivers see where the data ends. The hours of the
+// window are tried whether the index knows them or not.
+void data_warm_start(void) {
+    int64_t start_ms = millis();
+    int32_t now = hours();
+    HourLoad loads[STREAM_COUNT * PERMANENTLY_LOADED_HOURS + 1];
+    size_t load_count = 0;
+    for (int stream = 0; stream < STREAM_COUNT; stream++) {
+        for (int32_t hour_id = now - PERMANENTLY_LOADED_HOURS + 1; hour_id <= now; hour_id++) {
+            loads[load_count++] = (HourLoad) { stream, hour_id, NULL };
+        }
+    }
+    int32_t newest_hour_id;
+    if (hour_index_newest(STREAM_RAW, &newest_hour_id) && now - newest_hour_id >= PERMANENTLY_LOADED_HOURS) {
+        loads[load_count++] = (HourLoad) { STREAM_RAW, newest_hour_id, NULL };
+    }
+
+    if (!hour_io_load(loads, load_count)) {
+        data_run_parallel(hour_load_task, loads, sizeof(HourLoad), load_count);
+    }
+
+    HourIndex entry;
+    for (size_t i = 0; i < load_count; i++) {
+        DataHour *dh = loads[i].dh;
+        if (dh != NULL && !hour_index_get(dh->stream, dh->hour_id, &entry)) {
+            hour_index_compute(dh, &entry);
+            hour_index_update(&entry);
+        }
+    }
+
+    size_t loaded = 0;
+    MUTEX_LOCK(&data_lock);
+    for (size_t i = 0; i < load_count; i++) {
+        DataHour *dh = loads[i].dh;
+        if (dh == NULL) {
+            continue;
+        }
+        if (dh->stream == STREAM_RAW) {
+            last_received_log_id = MAX(last_received_log_id, newest_log_id(dh));
+        }
+        if (now - dh->hour_id >= PERMANENTLY_LOADED_HOURS || get_datahour(dh->stream, dh->hour_id, false, false) != NULL) {
+            datahour_destroy(dh);
+            continue;
+        }
+        list_append(datahours, &dh);
+        loaded++;
+    }
+    MUTEX_UNLOCK(&data_lock);
+
+    ZEJF_LOG(1, "Loaded %ld datahours in %ld ms, last log id %ld\n", loaded, millis() - start_ms, last_received_log_id);
+}
+
+void save_task(void *arg) {
+    DataHour *dh = *(DataHour **) arg;
+    if (dh->modified) {
+        datahour_save(dh);
+    }
+}
+
+// like autosave, but all modified hours are written at the same time
 void data_destroy(void) {
-    autosave();
+    int64_t start_ms = millis();
+    MUTEX_LOCK(&data_lock);
+    DataHour **modified = malloc((datahours->item_count + 1) * sizeof(DataHour *));
+    if (modified == NULL) {
+        perror("malloc");
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < datahours->item_count; i++) {
+        DataHour *dh = *(DataHour **) list_get(datahours, i);
+        if (!dh->modified) {
+            continue;
+        }
+        if (modified != NULL) {
+            modified[count] = dh;
+        } else {
+            datahour_save(dh);
+        }
+        count++;
+    }
+    if (modified != NULL && !hour_io_save(modified, count)) {
+        data_run_parallel(save_task, modified, sizeof(DataHour *), count);
+    }
+    MUTEX_UNLOCK(&data_lock);
+    free(modified);
+
+    ZEJF_LOG(1, "Saved %ld datahours in %ld ms\n", count, millis() - start_ms);
     list_destroy(datahours, datahour_destructor);
+    decimators_destroy();
+    hour_io_destroy();
+    hour_path_destroy();
+}
+
+// Complete hours are narrowed before autosave, the ones that changed are
+// saved again in their new width.
+void seal_hours(void) {
+    MUTEX_LOCK(&data_lock);
+    int32_t current_hour_id = hours();
+    size_t count = 0;
+    for (size_t i = 0; i < datahours->item_count; i++) {
+        DataHour *dh = *(DataHour **) list_get(datahours, i);
+        if (dh->hour_id < current_hour_id && datahour_seal(dh)) {
+            dh->modified = true;
+            count++;
+        }
+    }
+    MUTEX_UNLOCK(&data_lock);
+
+    if (count > 0) {
+        ZEJF_LOG(1, "Narrowed %ld datahours\n", count);
+    }
 }
 
 void *run_data_manager() {
+    int64_t last_retention_ms = 0;
+    bool retention_pending = true;
     while (true) {
         pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        seal_hours();
         autosave();
         cleanup();
+        if (retention_pending || millis() - last_retention_ms >= RETENTION_INTERVAL_MINUTES * 60 * 1000) {
+            retention_pending = run_retention();
+            last_retention_ms = millis();
+        }
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
         sleep(30);
     }
@@ -6,57 +6,125 @@
 #include <stdio.h>
 
 #include <pthread.h>
+#include <sys/types.h>
 
+#include "hour_path.h"
 #include "my_string.h"
 
-extern const int SAMPLE_RATES[5];
+#define SAMPLE_RATE_COUNT 7
+
+extern const int SAMPLE_RATES[SAMPLE_RATE_COUNT];
 extern int SAMPLES_PER_SECOND;
-extern int SAMPLE_TIME_MS;
 extern int SAMPLES_IN_HOUR;
 
 #define ERR_VAL -2147483647
 
 #define PERMANENTLY_LOADED_HOURS 12
 #define STORE_TIME_MINUTES 5
+#define DATA_IO_MAX_THREADS 8
+#define AUTOSAVE_BATCH 32
 
 #define MAIN_FOLDER "./ZejfSeis_Server/"
 
+#define STREAM_RAW 0
+#define STREAM_FILTERED 1
+#define STREAM_COUNT 2
+
+#define DIGEST_MINUTES 60
+
+// bytes per stored sample, the narrow widths use their minimum as ERR_VAL
+#define SAMPLE_WIDTH_16 2
+#define SAMPLE_WIDTH_24 3
+#define SAMPLE_WIDTH_32 4
+#define SAMPLE_24_MIN (-8388608)
+#define SAMPLE_24_MAX 8388607
+
 extern pthread_mutex_t data_lock;
 
 extern int64_t last_received_log_id;
 
+// start of an hour file, the samples follow
+typedef struct datahour_header_t
+{
+    bool modified;
+    uint8_t stream; // fits into the padding, the file layout is unchanged
+    uint8_t sample_width; // informative, older files have garbage here, the file size decides
+    int64_t last_access_ms;
+    int32_t hour_id;
+    int sample_count;
+} DataHourHeader;
+
 typedef struct datahour_t
 {
     bool modified;
+    uint8_t stream;
     int64_t last_access_ms;
     int32_t hour_id;
     int sample_count;
-    int32_t samples[];
+    int32_t tier_factor; // 1 for full rate, hours loaded from a decimated tier are read only
+    uint8_t sample_width;
+    bool sealed; // already narrowed as far as its values allow
+    uint64_t minute_digests[DIGEST_MINUTES]; // sums of sample_digest(), kept up to date by log_data
+    uint8_t samples[]; // room for 32 bit samples, use datahour_get() and datahour_set()
 } DataHour;
 
 size_t datahour_get_size();
 
-DataHour *datahour_create(int32_t hour_id);
+DataHour *datahour_create(int stream, int32_t hour_id);
 
 void datahour_destroy(DataHour *datahour);
 
 bool datahour_save(DataHour *dh);
 
-int32_t get_log(int64_t log_id);
+DataHour *datahour_load(FILE *file, int stream);
+
+void datahour_loaded(DataHour *dh, DataHourHeader *header, int stream, int sample_width);
+
+int datahour_file_width(int64_t sample_bytes);
+
+size_t datahour_samples_size(DataHour *dh);
+
+int32_t datahour_get(DataHour *dh, int32_t index);
 
-void log_data(int64_t log_id, int32_t val);
+void datahour_set(DataHour *dh, int32_t index, int32_t value);
+
+void datahour_read_samples(DataHour *dh, int32_t first, int32_t count, int32_t *out);
+
+int32_t *datahour_widen(DataHour *dh);
+
+bool datahour_seal(DataHour *dh);
+
+void datahour_header(DataHour *dh, DataHourHeader *header);
+
+void datahour_saved(DataHour *dh, int64_t start_us);
+
+void datahour_compute_digests(DataHour *dh);
+
+int mkpath(char *file_path, mode_t mode);
+
+int32_t get_log(int stream, int64_t log_id);
+
+void log_data(int stream, int64_t log_id, int32_t val);
 
 void data_init(void);
 
+void data_warm_start(void);
+
 void data_destroy(void);
 
 String *get_datahour_path_new(int32_t hour_id);
 
-String *get_datahour_path_newest(int32_t hour_id);
+String *get_datahour_path_newest(int stream, int32_t hour_id);
+
+void datahour_location(int stream, int32_t hour_id, HourLocation *loc);
 
 String *get_datahour_path_old(int32_t hour_id);
 
-DataHour *get_datahour(int32_t hour_id, bool load_from_file, bool create_new);
+DataHour *get_datahour(int stream, int32_t hour_id, bool load_from_file, bool create_new);
+
+DataHour *datahour_read_file(int stream, int32_t hour_id, bool report_missing);
+
+DataHour *datahour_read(int stream, int32_t hour_id);
 
 void *run_data_manager();
 
@@ -0,0 +1,194 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arraylist.h"
+#include "data.h"
+#include "decimator.h"
+#include "lock_profile.h"
+
+ArrayList *decimators = NULL;
+pthread_mutex_t decimators_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// windowed sinc lowpass with its cutoff slightly below the new nyquist frequency
+bool fir_init(Fir *fir, int factor) {
+    fir->factor = factor;
+    fir->taps = DECIMATOR_TAPS_PER_FACTOR * factor + 1;
+    fir->half = (fir->taps - 1) / 2;
+    fir->coefficients = malloc(fir->taps * sizeof(double));
+    if (fir->coefficients == NULL) {
+        perror("malloc");
+        return false;
+    }
+
+    double cutoff = DECIMATOR_PASSBAND * 0.5 / factor;
+    double sum = 0;
+    double *h = fir->coefficients;
+    for (int i = 0; i < fir->taps; i++) {
+        int n = i - fir->half;
+        double sinc = n == 0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * n) / (M_PI * n);
+        double blackman = 0.42 - 0.5 * cos(2.0 * M_PI * i / (fir->taps - 1)) + 0.08 * cos(4.0 * M_PI * i / (fir->taps - 1));
+        h[i] = sinc * blackman;
+        sum += h[i];
+    }
+
+    for (int i = 0; i < fir->taps; i++) {
+        h[i] /= sum;
+    }
+
+    return true;
+}
+
+void fir_destroy(Fir *fir) {
+    free(fir->coefficients);
+    fir->coefficients = NULL;
+}
+
+// Only the kept outputs are ever computed, which is what a polyphase
+// decimator saves. Independent accumulators keep the dot product free of a
+// serial dependency so the compiler can vectorize it. The sum is done in
+// double, counts reach 2^31 and a float has 24 bits of mantissa.
+double fir_apply(Fir *fir, double *window) {
+    double acc[8] = { 0 };
+    double *h = fir->coefficients;
+    int i = 0;
+    for (; i + 8 <= fir->taps; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            acc[j] += h[i + j] * window[i + j];
+        }
+    }
+    double result = 0;
+    for (; i < fir->taps; i++) {
+        result += h[i] * window[i];
+    }
+    for (int j = 0; j < 8; j++) {
+        result += acc[j];
+    }
+    return result;
+}
+
+bool decimation_rate_valid(int rate) {
+    return rate > 0 && rate < SAMPLES_PER_SECOND && SAMPLES_PER_SECOND % rate == 0;
+}
+
+void decimators_init(void) {
+    decimators = list_create(sizeof(Decimator *));
+}
+
+void decimator_destructor(void **ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    Decimator *decimator = *(Decimator **) ptr;
+    fir_destroy(&decimator->fir);
+    free(decimator->history);
+    free(decimator);
+}
+
+// decimators_lock must be held
+Decimator *decimator_get(int stream, int rate) {
+    for (size_t i = 0; i < decimators->item_count; i++) {
+        Decimator *decimator = *(Decimator **) list_get(decimators, i);
+        if (decimator->stream == stream && decimator->rate == rate) {
+            return decimator;
+        }
+    }
+
+    if (!decimation_rate_valid(rate)) {
+        return NULL;
+    }
+
+    Decimator *decimator = calloc(1, sizeof(Decimator));
+    if (decimator == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    if (!fir_init(&decimator->fir, SAMPLES_PER_SECOND / rate)) {
+        free(decimator);
+        return NULL;
+    }
+
+    // written twice so that the last taps samples are always contiguous
+    decimator->history = calloc(2 * decimator->fir.taps, sizeof(double));
+    if (decimator->history == NULL) {
+        perror("calloc");
+        fir_destroy(&decimator->fir);
+        free(decimator);
+        return NULL;
+    }
+
+    decimator->stream = stream;
+    decimator->rate = rate;
+    decimator->last_log_id = -1;
+
+    list_append(decimators, &decimator);
+    return decimator;
+}
+
+void decimator_push(Decimator *decimator, int64_t log_id, int32_t value) {
+    if (value == ERR_VAL || log_id != decimator->last_log_id + 1) {
+        decimator->filled = 0;
+    }
+    decimator->last_log_id = log_id;
+    if (value == ERR_VAL) {
+        return;
+    }
+
+    int taps = decimator->fir.taps;
+    decimator->history[decimator->history_pos] = value;
+    decimator->history[decimator->history_pos + taps] = value;
+    decimator->history_pos = (decimator->history_pos + 1) % taps;
+    decimator->filled++;
+
+    int64_t center = log_id - decimator->fir.half;
+    if (decimator->filled < taps || center % decimator->fir.factor != 0) {
+        return;
+    }
+
+    int64_t index = decimator->ring_count % DECIMATOR_RING_SIZE;
+    decimator->ring_log_ids[index] = center;
+    decimator->ring_values[index] = (int32_t) lround(fir_apply(&decimator->fir, decimator->history + decimator->history_pos));
+    decimator->ring_count++;
+}
+
+void decimators_push(int stream, int64_t *log_ids, int32_t *values, size_t count) {
+    MUTEX_LOCK(&decimators_lock);
+    for (size_t i = 0; i < decimators->item_count; i++) {
+        Decimator *decimator = *(Decimator **) list_get(decimators, i);
+        if (decimator->stream != stream) {
+            continue;
+        }
+        for (size_t j = 0; j < count; j++) {
+            decimator_push(decimator, log_ids[j], values[j]);
+        }
+    }
+    MUTEX_UNLOCK(&decimators_lock);
+}
+
+// decimators_lock must be held, copies the buffered outputs newer than after_log_id
+size_t decimator_read(Decimator *decimator, int64_t after_log_id, int64_t *log_ids, int32_t *values, size_t max_count) {
+    int64_t first = decimator->ring_count - DECIMATOR_RING_SIZE;
+    if (first < 0) {
+        first = 0;
+    }
+
+    size_t count = 0;
+    for (int64_t i = first; i < decimator->ring_count && count < max_count; i++) {
+        int64_t index = i % DECIMATOR_RING_SIZE;
+        if (decimator->ring_log_ids[index] > after_log_id) {
+            log_ids[count] = decimator->ring_log_ids[index];
+            values[count] = decimator->ring_values[index];
+            count++;
+        }
+    }
+    return count;
+}
+
+void decimators_destroy(void) {
+    MUTEX_LOCK(&decimators_lock);
+    list_destroy(decimators, decimator_destructor);
+    decimators = NULL;
+    MUTEX_UNLOCK(&decimators_lock);
+}
@@ -0,0 +1,61 @@
+#ifndef DECIMATOR_H
+#define DECIMATOR_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DECIMATOR_TAPS_PER_FACTOR 8
+#define DECIMATOR_PASSBAND 0.8
+#define DECIMATOR_RING_SIZE 256
+
+// Anti-aliasing FIR for decimation by factor. Outputs exist only for log_ids
+// divisible by factor and are centered on them, so they need (taps - 1) / 2
+// samples after the log_id they belong to.
+typedef struct fir_t
+{
+    int factor;
+    int taps;
+    int half;
+    double *coefficients;
+} Fir;
+
+// Streaming decimator shared by all realtime clients of one stream and rate
+typedef struct decimator_t
+{
+    int stream;
+    int rate;
+    Fir fir;
+
+    double *history;
+    int history_pos;
+    int64_t filled;
+    int64_t last_log_id;
+
+    int64_t ring_log_ids[DECIMATOR_RING_SIZE];
+    int32_t ring_values[DECIMATOR_RING_SIZE];
+    int64_t ring_count;
+} Decimator;
+
+extern pthread_mutex_t decimators_lock;
+
+bool fir_init(Fir *fir, int factor);
+
+void fir_destroy(Fir *fir);
+
+double fir_apply(Fir *fir, double *window);
+
+bool decimation_rate_valid(int rate);
+
+void decimators_init(void);
+
+Decimator *decimator_get(int stream, int rate);
+
+void decimators_push(int stream, int64_t *log_ids, int32_t *values, size_t count);
+
+size_t decimator_read(Decimator *decimator, int64_t after_log_id, int64_t *log_ids, int32_t *values, size_t max_count);
+
+void decimators_destroy(void);
+
+#endif
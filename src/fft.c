@@ -0,0 +1,85 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fft.h"
+
+bool fft_init(Fft *fft, int size) {
+    if (size < 2 || (size & (size - 1)) != 0) {
+        return false;
+    }
+
+    fft->size = size;
+    fft->reversed = malloc(size * sizeof(int));
+    fft->cos_table = malloc(size / 2 * sizeof(double));
+    fft->sin_table = malloc(size / 2 * sizeof(double));
+    if (fft->reversed == NULL || fft->cos_table == NULL || fft->sin_table == NULL) {
+        perror("malloc");
+        fft_destroy(fft);
+        return false;
+    }
+
+    int bits = 0;
+    while ((1 << bits) < size) {
+        bits++;
+    }
+
+    for (int i = 0; i < size; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        fft->reversed[i] = r;
+    }
+
+    for (int i = 0; i < size / 2; i++) {
+        fft->cos_table[i] = cos(2.0 * M_PI * i / size);
+        fft->sin_table[i] = -sin(2.0 * M_PI * i / size);
+    }
+
+    return true;
+}
+
+void fft_destroy(Fft *fft) {
+    free(fft->reversed);
+    free(fft->cos_table);
+    free(fft->sin_table);
+    fft->reversed = NULL;
+    fft->cos_table = NULL;
+    fft->sin_table = NULL;
+}
+
+void fft_forward(Fft *fft, double *re, double *im) {
+    int n = fft->size;
+
+    for (int i = 0; i < n; i++) {
+        int j = fft->reversed[i];
+        if (j > i) {
+            double t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    for (int len = 2; len <= n; len <<= 1) {
+        int half = len / 2;
+        int step = n / len;
+        for (int start = 0; start < n; start += len) {
+            for (int k = 0; k < half; k++) {
+                double wr = fft->cos_table[k * step];
+                double wi = fft->sin_table[k * step];
+                int a = start + k;
+                int b = a + half;
+                double tr = re[b] * wr - im[b] * wi;
+                double ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
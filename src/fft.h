@@ -0,0 +1,21 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <stdbool.h>
+
+// in place radix-2 complex FFT, size must be a power of two
+typedef struct fft_t
+{
+    int size;
+    int *reversed;
+    double *cos_table;
+    double *sin_table;
+} Fft;
+
+bool fft_init(Fft *fft, int size);
+
+void fft_destroy(Fft *fft);
+
+void fft_forward(Fft *fft, double *re, double *im);
+
+#endif
@@ -0,0 +1,138 @@
+#include <math.h>
+#include <string.h>
+
+#include "data.h"
+#include "filter.h"
+
+// Butterworth Q values of the two sections of a 4th order filter
+const double BUTTERWORTH_Q[2] = { 0.54119610, 1.30656296 };
+
+void biquad_design(Biquad *bq, bool highpass, int sample_rate, double freq, double q) {
+    double w0 = 2.0 * M_PI * freq / sample_rate;
+    double cos_w0 = cos(w0);
+    double alpha = sin(w0) / (2.0 * q);
+    double a0 = 1.0 + alpha;
+
+    if (highpass) {
+        bq->b0 = (1.0 + cos_w0) / 2.0 / a0;
+        bq->b1 = -(1.0 + cos_w0) / a0;
+    } else {
+        bq->b0 = (1.0 - cos_w0) / 2.0 / a0;
+        bq->b1 = (1.0 - cos_w0) / a0;
+    }
+    bq->b2 = bq->b0;
+    bq->a1 = -2.0 * cos_w0 / a0;
+    bq->a2 = (1.0 - alpha) / a0;
+}
+
+// low_hz <= 0 gives a lowpass, high_hz <= 0 or above 90% of nyquist a highpass
+bool filter_init(FilterChain *chain, int sample_rate, double low_hz, double high_hz) {
+    memset(chain, 0, sizeof(FilterChain));
+    chain->last_log_id = -1;
+
+    if (high_hz >= sample_rate * 0.45) {
+        high_hz = 0;
+    }
+
+    if (low_hz > 0) {
+        for (int i = 0; i < 2; i++) {
+            biquad_design(&chain->sections[chain->section_count++], true, sample_rate, low_hz, BUTTERWORTH_Q[i]);
+        }
+    }
+
+    if (high_hz > 0) {
+        for (int i = 0; i < 2; i++) {
+            biquad_design(&chain->sections[chain->section_count++], false, sample_rate, high_hz, BUTTERWORTH_Q[i]);
+        }
+    }
+
+    return chain->section_count > 0;
+}
+
+// start from the steady state of a constant input so that the DC offset of the
+// sensor doesn't ring through the highpass after every gap
+void filter_reset(FilterChain *chain, double x0) {
+    for (int i = 0; i < chain->section_count; i++) {
+        Biquad *bq = &chain->sections[i];
+        double y0 = x0 * (bq->b0 + bq->b1 + bq->b2) / (1.0 + bq->a1 + bq->a2);
+        bq->x1 = bq->x2 = x0;
+        bq->y1 = bq->y2 = y0;
+        x0 = y0;
+    }
+}
+
+// The feedforward half of each section has no dependency between samples and
+// is left to the compiler to vectorize, only the feedback half runs serially.
+void biquad_process_block(Biquad *bq, double *data, size_t count) {
+    double w[FILTER_BLOCK_SIZE];
+
+    if (count >= 2) {
+        w[0] = bq->b0 * data[0] + bq->b1 * bq->x1 + bq->b2 * bq->x2;
+        w[1] = bq->b0 * data[1] + bq->b1 * data[0] + bq->b2 * bq->x1;
+        for (size_t i = 2; i < count; i++) {
+            w[i] = bq->b0 * data[i] + bq->b1 * data[i - 1] + bq->b2 * data[i - 2];
+        }
+        bq->x2 = data[count - 2];
+        bq->x1 = data[count - 1];
+    } else {
+        w[0] = bq->b0 * data[0] + bq->b1 * bq->x1 + bq->b2 * bq->x2;
+        bq->x2 = bq->x1;
+        bq->x1 = data[0];
+    }
+
+    double y1 = bq->y1;
+    double y2 = bq->y2;
+    for (size_t i = 0; i < count; i++) {
+        double y = w[i] - bq->a1 * y1 - bq->a2 * y2;
+        data[i] = y;
+        y2 = y1;
+        y1 = y;
+    }
+    bq->y1 = y1;
+    bq->y2 = y2;
+}
+
+// input holds consecutive log_ids starting at first_log_id
+void filter_process(FilterChain *chain, int64_t first_log_id, int32_t *input, int32_t *output, size_t count) {
+    double block[FILTER_BLOCK_SIZE];
+
+    if (first_log_id != chain->last_log_id + 1) {
+        chain->last_log_id = -1;
+    }
+
+    size_t i = 0;
+    while (i < count) {
+        if (input[i] == ERR_VAL) {
+            output[i] = ERR_VAL;
+            chain->last_log_id = -1;
+            i++;
+            continue;
+        }
+
+        if (chain->last_log_id == -1) {
+            filter_reset(chain, input[i]);
+        }
+
+        size_t length = 0;
+        while (i + length < count && length < FILTER_BLOCK_SIZE && input[i + length] != ERR_VAL) {
+            block[length] = input[i + length];
+            length++;
+        }
+
+        for (int s = 0; s < chain->section_count; s++) {
+            biquad_process_block(&chain->sections[s], block, length);
+        }
+
+        for (size_t j = 0; j < length; j++) {
+            output[i + j] = (int32_t) lround(block[j]);
+        }
+
+        i += length;
+        chain->last_log_id = first_log_id + i - 1;
+    }
+
+    chain->last_log_id = first_log_id + count - 1;
+    if (count > 0 && input[count - 1] == ERR_VAL) {
+        chain->last_log_id = -1;
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILTER_MAX_SECTIONS 4
+#define FILTER_BLOCK_SIZE 256
+
+#define FILTER_DEFAULT_LOW_HZ 0.5
+#define FILTER_DEFAULT_HIGH_HZ 10.0
+
+// second order section in direct form I, a0 normalized to 1
+typedef struct biquad_t
+{
+    double b0, b1, b2;
+    double a1, a2;
+    double x1, x2;
+    double y1, y2;
+} Biquad;
+
+typedef struct filter_chain_t
+{
+    int section_count;
+    Biquad sections[FILTER_MAX_SECTIONS];
+    int64_t last_log_id;
+} FilterChain;
+
+bool filter_init(FilterChain *chain, int sample_rate, double low_hz, double high_hz);
+
+void filter_process(FilterChain *chain, int64_t first_log_id, int32_t *input, int32_t *output, size_t count);
+
+#endif
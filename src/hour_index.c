@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <ftw.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "arraylist.h"
+#include "data.h"
+#include "hour_index.h"
+#include "lock_profile.h"
+#include "scheduler.h"
+
+// a record of the file and where it was, the later one of an hour wins
+typedef struct hour_record_t
+{
+    HourIndex entry;
+    size_t position;
+} HourRecord;
+
+// sorted by stream and hour_id
+ArrayList *hour_index = NULL;
+pthread_mutex_t hour_index_lock;
+FILE *hour_index_file = NULL;
+bool hour_index_empty = false;
+volatile bool scrubber_running = false;
+
+// splitmix64 of the position and value, summed over the samples. The sum does
+// not depend on the order, so it can be kept up to date sample by sample.
+uint64_t sample_digest(int32_t sample_index, int32_t value) {
+    uint64_t z = ((uint64_t) (uint32_t) sample_index << 32 | (uint32_t) value) + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+void hour_index_compute(DataHour *dh, HourIndex *entry) {
+    int32_t min = INT32_MAX;
+    int32_t max = INT32_MIN;
+    double sum_squares = 0;
+    uint64_t digest = 0;
+    int32_t count = 0;
+
+    for (int i = 0; i < SAMPLES_IN_HOUR; i++) {
+        int32_t value = datahour_get(dh, i);
+        if (value == ERR_VAL) {
+            continue;
+        }
+        min = value < min ? value : min;
+        max = value > max ? value : max;
+        sum_squares += (double) value * value;
+        digest += sample_digest(i, value);
+        count++;
+    }
+
+    entry->hour_id = dh->hour_id;
+    entry->stream = dh->stream;
+    entry->sample_count = count;
+    entry->min = count > 0 ? min : 0;
+    entry->max = count > 0 ? max : 0;
+    entry->rms = count > 0 ? (float) sqrt(sum_squares / count) : 0;
+    entry->digest = digest;
+}
+
+int compare_entries(int stream, int32_t hour_id, const HourIndex *entry) {
+    if (stream != entry->stream) {
+        return stream < entry->stream ? -1 : 1;
+    }
+    return (hour_id > entry->hour_id) - (hour_id < entry->hour_id);
+}
+
+// the first entry not before the hour
+size_t hour_index_position(int stream, int32_t hour_id) {
+    size_t low = 0;
+    size_t high = hour_index->item_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (compare_entries(stream, hour_id, list_get(hour_index, middle)) > 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+HourIndex *hour_index_find(int stream, int32_t hour_id) {
+    size_t position = hour_index_position(stream, hour_id);
+    if (position < hour_index->item_count) {
+        HourIndex *entry = list_get(hour_index, position);
+        if (entry->hour_id == hour_id && entry->stream == stream) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// new hours usually go to the end of their stream
+bool hour_index_insert(HourIndex *entry) {
+    size_t position = hour_index_position(entry->stream, entry->hour_id);
+    if (!list_append(hour_index, entry)) {
+        return false;
+    }
+    HourIndex *entries = (HourIndex *) hour_index->data;
+    memmove(entries + position + 1, entries + position, (hour_index->item_count - 1 - position) * sizeof(HourIndex));
+    entries[position] = *entry;
+    return true;
+}
+
+int compare_records(const void *a, const void *b) {
+    const HourRecord *x = a;
+    const HourRecord *y = b;
+    int result = compare_entries(x->entry.stream, x->entry.hour_id, &y->entry);
+    return result != 0 ? result : (x->position > y->position) - (x->position < y->position);
+}
+
+// sorts the records of the file and keeps the last one of each hour
+size_t hour_index_read(FILE *file) {
+    ArrayList *records = list_create(sizeof(HourRecord));
+    if (records == NULL) {
+        return 0;
+    }
+    HourRecord record;
+    record.position = 0;
+    while (fread(&record.entry, sizeof(HourIndex), 1, file) == 1) {
+        if (!list_append(records, &record)) {
+            break;
+        }
+        record.position++;
+    }
+
+    qsort(records->data, records->item_count, sizeof(HourRecord), compare_records);
+    for (size_t i = 0; i < records->item_count; i++) {
+        HourRecord *current = list_get(records, i);
+        HourRecord *next = i + 1 < records->item_count ? list_get(records, i + 1) : NULL;
+        if (next == NULL || next->entry.stream != current->entry.stream || next->entry.hour_id != current->entry.hour_id) {
+            list_append(hour_index, &current->entry);
+        }
+    }
+
+    size_t count = records->item_count;
+    list_destroy(records, NULL);
+    return count;
+}
+
+void get_hour_index_path(char *path, size_t size, char *suffix) {
+    snprintf(path, size, "%s%d_sps/%s%s", MAIN_FOLDER, SAMPLES_PER_SECOND, HOUR_INDEX_FILE, suffix);
+}
+
+// rewrites the file with one record per hour, hour_index_lock must be held
+void hour_index_compact(void) {
+    char path[128];
+    char tmp_path[128];
+    get_hour_index_path(path, sizeof(path), "");
+    get_hour_index_path(tmp_path, sizeof(tmp_path), ".tmp");
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        perror(tmp_path);
+        return;
+    }
+
+    if (hour_index->item_count > 0 && fwrite(hour_index->data, sizeof(HourIndex), hour_index->item_count, file) != hour_index->item_count) {
+        perror("fwrite");
+        fclose(file);
+        return;
+    }
+
+    fclose(file);
+    if (rename(tmp_path, path) != 0) {
+        perror("rename");
+        return;
+    }
+
+    // the open handle still points to the replaced file
+    if (hour_index_file != NULL) {
+        fclose(hour_index_file);
+        hour_index_file = fopen(path, "ab");
+        if (hour_index_file == NULL) {
+            perror(path);
+        }
+    }
+}
+
+void hour_index_init(void) {
+    hour_index = list_create(sizeof(HourIndex));
+    pthread_mutex_init(&hour_index_lock, NULL);
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s%d_sps", MAIN_FOLDER, SAMPLES_PER_SECOND);
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        perror(path);
+        return;
+    }
+
+    get_hour_index_path(path, sizeof(path), "");
+
+    size_t records = 0;
+    FILE *file = fopen(path, "rb");
+    if (file != NULL) {
+        records = hour_index_read(file);
+        fclose(file);
+    }
+
+    hour_index_empty = records == 0;
+    if (records > 2 * hour_index->item_count + 64) {
+        ZEJF_LOG(1, "Compacting hour index, %ld records for %ld hours\n", records, hour_index->item_count);
+        hour_index_compact();
+    }
+
+    hour_index_file = fopen(path, "ab");
+    if (hour_index_file == NULL) {
+        perror(path);
+    }
+
+    ZEJF_LOG(1, "Hour index has %ld hours\n", hour_index->item_count);
+}
+
+void hour_index_update(HourIndex *entry) {
+    MUTEX_LOCK(&hour_index_lock);
+    if (hour_index == NULL) {
+        MUTEX_UNLOCK(&hour_index_lock);
+        return;
+    }
+
+    HourIndex *existing = hour_index_find(entry->stream, entry->hour_id);
+    if (existing != NULL && memcmp(existing, entry, sizeof(HourIndex)) == 0) {
+        MUTEX_UNLOCK(&hour_index_lock);
+        return;
+    }
+
+    if (existing != NULL) {
+        *existing = *entry;
+    } else {
+        hour_index_insert(entry);
+    }
+
+    if (hour_index_file != NULL) {
+        if (fwrite(entry, sizeof(HourIndex), 1, hour_index_file) != 1) {
+            perror("fwrite");
+        }
+        fflush(hour_index_file);
+    }
+    MUTEX_UNLOCK(&hour_index_lock);
+}
+
+bool hour_index_get(int stream, int32_t hour_id, HourIndex *entry) {
+    MUTEX_LOCK(&hour_index_lock);
+    HourIndex *existing = hour_index == NULL ? NULL : hour_index_find(stream, hour_id);
+    if (existing != NULL) {
+        *entry = *existing;
+    }
+    MUTEX_UNLOCK(&hour_index_lock);
+    return existing != NULL;
+}
+
+// Hours saved before the index existed aren't in it. Their file is read
+// once and indexed, false if there is no such hour.
+bool hour_index_lookup(int stream, int32_t hour_id, HourIndex *entry) {
+    if (hour_index_get(stream, hour_id, entry)) {
+        return true;
+    }
+    DataHour *dh = datahour_read_file(stream, hour_id, false);
+    bool found = dh != NULL && dh->hour_id == hour_id;
+    if (found) {
+        hour_index_compute(dh, entry);
+        hour_index_update(entry);
+    }
+    datahour_destroy(dh);
+    return found;
+}
+
+bool hour_index_newest(int stream, int32_t *hour_id) {
+    MUTEX_LOCK(&hour_index_lock);
+    size_t position = hour_index == NULL ? 0 : hour_index_position(stream + 1, INT32_MIN);
+    HourIndex *entry = position > 0 ? list_get(hour_index, position - 1) : NULL;
+    bool found = entry != NULL && entry->stream == stream;
+    if (found) {
+        *hour_id = entry->hour_id;
+    }
+    MUTEX_UNLOCK(&hour_index_lock);
+    return found;
+}
+
+// an empty index next to hour folders, e.g. after an upgrade
+bool hour_index_needs_scrub(void) {
+    if (!hour_index_empty) {
+        return false;
+    }
+    char path[128];
+    snprintf(path, sizeof(path), "%s%d_sps", MAIN_FOLDER, SAMPLES_PER_SECOND);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return false;
+    }
+    bool folders = false;
+    struct dirent *entry;
+    while (!folders && (entry = readdir(dir)) != NULL) {
+        folders = entry->d_name[0] >= '0' && entry->d_name[0] <= '9';
+    }
+    closedir(dir);
+    return folders;
+}
+
+size_t hour_index_count(int64_t *total_samples) {
+    MUTEX_LOCK(&hour_index_lock);
+    size_t count = 0;
+    *total_samples = 0;
+    for (size_t i = 0; hour_index != NULL && i < hour_index->item_count; i++) {
+        HourIndex *entry = list_get(hour_index, i);
+        if (entry->stream == STREAM_RAW) {
+            *total_samples += entry->sample_count;
+            count++;
+        }
+    }
+    MUTEX_UNLOCK(&hour_index_lock);
+    return count;
+}
+
+// sorted hour ids of the stream, the caller frees the array
+int32_t *hour_index_list(int stream, size_t *count) {
+    MUTEX_LOCK(&hour_index_lock);
+    size_t first = 0;
+    size_t last = 0;
+    if (hour_index != NULL) {
+        first = hour_index_position(stream, INT32_MIN);
+        last = hour_index_position(stream + 1, INT32_MIN);
+    }
+    int32_t *hour_ids = malloc((last - first + 1) * sizeof(int32_t));
+    *count = 0;
+    if (hour_ids == NULL) {
+        perror("malloc");
+        MUTEX_UNLOCK(&hour_index_lock);
+        return NULL;
+    }
+    for (size_t i = first; i < last; i++) {
+        HourIndex *entry = list_get(hour_index, i);
+        hour_ids[(*count)++] = entry->hour_id;
+    }
+    MUTEX_UNLOCK(&hour_index_lock);
+    return hour_ids;
+}
+
+void hour_index_destroy(void) {
+    MUTEX_LOCK(&hour_index_lock);
+    if (hour_index_file != NULL) {
+        fclose(hour_index_file);
+        hour_index_file = NULL;
+    }
+    list_destroy(hour_index, NULL);
+    hour_index = NULL;
+    MUTEX_UNLOCK(&hour_index_lock);
+}
+
+int scrubbed_hours;
+int scrub_updates;
+
+// file names end with _<hour_id>.cs4 or _<hour_id>_filtered.cs4
+int scrub_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) ftw;
+    if (type != FTW_F) {
+        return 0;
+    }
+
+    const char *name = strrchr(path, '/');
+    const char *underscore = name == NULL ? NULL : strchr(name, '_');
+    const char *extension = strrchr(path, '.');
+    if (underscore == NULL || extension == NULL || strcmp(extension, ".cs4") != 0) {
+        return 0;
+    }
+
+    int32_t hour_id;
+    if (sscanf(underscore + 1, "%d", &hour_id) != 1) {
+        return 0;
+    }
+    int stream = strstr(underscore, "_filtered.") != NULL ? STREAM_FILTERED : STREAM_RAW;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    // hours in memory may be newer than their file, saving them updates the index
+    MUTEX_LOCK(&data_lock);
+    bool loaded = get_datahour(stream, hour_id, false, false) != NULL;
+    MUTEX_UNLOCK(&data_lock);
+
+    FILE *file = loaded ? NULL : fopen(path, "rb");
+    DataHour *dh = file == NULL ? NULL : datahour_load(file, stream);
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    if (dh != NULL && dh->hour_id == hour_id) {
+        HourIndex entry;
+        HourIndex existing;
+        hour_index_compute(dh, &entry);
+        if (!hour_index_get(stream, hour_id, &existing) || memcmp(&existing, &entry, sizeof(HourIndex)) != 0) {
+            ZEJF_LOG(1, "Scrubber: index of %s was out of date\n", path);
+            hour_index_update(&entry);
+            scrub_updates++;
+        }
+        scrubbed_hours++;
+    }
+
+    datahour_destroy(dh);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    return 0;
+}
+
+// walks all hour files of the current sample rate and brings the index up to date
+void *run_scrubber() {
+    struct sched_param param = { 0 };
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        ZEJF_LOG(1, "Cannot lower the priority of the scrubber thread\n");
+    }
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s%d_sps", MAIN_FOLDER, SAMPLES_PER_SECOND);
+
+    scrubbed_hours = 0;
+    scrub_updates = 0;
+    if (nftw(path, scrub_file, 16, FTW_PHYS) != 0) {
+        perror(path);
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    MUTEX_LOCK(&hour_index_lock);
+    if (hour_index != NULL) {
+        hour_index_compact();
+    }
+    MUTEX_UNLOCK(&hour_index_lock);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+    ZEJF_LOG(1, "Scrubber checked %d hours, %d index records updated\n", scrubbed_hours, scrub_updates);
+    scrubber_running = false;
+    return NULL;
+}
@@ -0,0 +1,52 @@
+#ifndef HOUR_INDEX_H
+#define HOUR_INDEX_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data.h"
+
+#define HOUR_INDEX_FILE "index.dat"
+
+// One record per saved DataHour. The file is only ever appended to, the last
+// record of an hour wins and duplicates are dropped on startup.
+typedef struct hour_index_t
+{
+    int32_t hour_id;
+    int32_t stream;
+    int32_t sample_count;
+    int32_t min;
+    int32_t max;
+    float rms;
+    uint64_t digest;
+} HourIndex;
+
+extern volatile bool scrubber_running;
+
+void hour_index_init(void);
+
+void hour_index_destroy(void);
+
+uint64_t sample_digest(int32_t sample_index, int32_t value);
+
+void hour_index_compute(DataHour *dh, HourIndex *entry);
+
+void hour_index_update(HourIndex *entry);
+
+bool hour_index_get(int stream, int32_t hour_id, HourIndex *entry);
+
+bool hour_index_lookup(int stream, int32_t hour_id, HourIndex *entry);
+
+bool hour_index_newest(int stream, int32_t *hour_id);
+
+bool hour_index_needs_scrub(void);
+
+size_t hour_index_count(int64_t *total_samples);
+
+int32_t *hour_index_list(int stream, size_t *count);
+
+void *run_scrubber();
+
+#endif
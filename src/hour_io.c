@@ -0,0 +1,438 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#ifdef ZEJF_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "data.h"
+#include "hour_io.h"
+#include "hour_pool.h"
+#include "lock_profile.h"
+#include "scheduler.h"
+#include "time_utils.h"
+
+#ifdef ZEJF_IO_URING
+
+// the operation never completed, its buffers might still be in use
+#define RING_NO_RESULT INT32_MIN
+
+typedef struct hour_ring_t
+{
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+
+    unsigned local_tail;
+    unsigned pending;
+    bool abandoned; // submitted operations were given up on, the kernel may still run them
+} HourRing;
+
+// one file of a batch
+typedef struct hour_job_t
+{
+    DataHour *dh;
+    HourLocation loc;
+    char tmp_name[HOUR_NAME_MAX];
+    DataHourHeader header;
+    struct iovec iov[2];
+    int fd;
+    int64_t start_us;
+} HourJob;
+
+HourRing ring = { .fd = -1 };
+bool hour_io_available = false;
+pthread_mutex_t hour_io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void ring_unmap(void) {
+    if (ring.sqes != NULL && ring.sqes != MAP_FAILED) {
+        munmap(ring.sqes, ring.sqes_size);
+    }
+    if (ring.cq_ptr != NULL && ring.cq_ptr != MAP_FAILED && ring.cq_ptr != ring.sq_ptr) {
+        munmap(ring.cq_ptr, ring.cq_size);
+    }
+    if (ring.sq_ptr != NULL && ring.sq_ptr != MAP_FAILED) {
+        munmap(ring.sq_ptr, ring.sq_size);
+    }
+    if (ring.fd != -1) {
+        close(ring.fd);
+    }
+    memset(&ring, 0, sizeof(HourRing));
+    ring.fd = -1;
+}
+
+// everything the batches use, renameat needs Linux 5.11
+bool ring_supported(void) {
+    const int needed[] = { IORING_OP_OPENAT, IORING_OP_READV, IORING_OP_WRITEV, IORING_OP_CLOSE, IORING_OP_RENAMEAT };
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL) {
+        perror("calloc");
+        return false;
+    }
+
+    bool supported = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+bool hour_io_init(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, HOUR_IO_RING_ENTRIES, &params);
+    if (ring.fd < 0) {
+        ZEJF_LOG(1, "io_uring is not available (%s), hour files use stdio\n", strerror(errno));
+        ring.fd = -1;
+        return false;
+    }
+
+    ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        ring.sq_size = ring.cq_size = MAX(ring.sq_size, ring.cq_size);
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_ptr = single_mmap ? ring.sq_ptr : mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sq_ptr == MAP_FAILED || ring.cq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        perror("mmap");
+        ring_unmap();
+        return false;
+    }
+
+    char *sq = (char *) ring.sq_ptr;
+    char *cq = (char *) ring.cq_ptr;
+    ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring.cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring.local_tail = *ring.sq_tail;
+
+    if (!ring_supported()) {
+        ZEJF_LOG(1, "io_uring lacks file operations, hour files use stdio\n");
+        ring_unmap();
+        return false;
+    }
+
+    hour_io_available = true;
+    ZEJF_LOG(1, "Hour files use io_uring\n");
+    return true;
+}
+
+void hour_io_destroy(void) {
+    MUTEX_LOCK(&hour_io_lock);
+    hour_io_available = false;
+    ring_unmap();
+    MUTEX_UNLOCK(&hour_io_lock);
+}
+
+// next submission, published by ring_run()
+struct io_uring_sqe *ring_sqe(uint8_t opcode, int fd, uint64_t user_data) {
+    unsigned index = ring.local_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    ring.sq_array[index] = index;
+    ring.local_tail++;
+    ring.pending++;
+    return sqe;
+}
+
+void prep_openat(uint64_t user_data, int dir_fd, const char *path, int flags, mode_t mode) {
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_OPENAT, dir_fd, user_data);
+    sqe->addr = (uintptr_t) path;
+    sqe->len = mode;
+    sqe->open_flags = flags | O_CLOEXEC;
+}
+
+// the whole file in one request, the close only runs if it succeeds
+void prep_rw_close(uint64_t user_data, uint8_t opcode, int fd, struct iovec *iov) {
+    struct io_uring_sqe *sqe = ring_sqe(opcode, fd, user_data);
+    sqe->addr = (uintptr_t) iov;
+    sqe->len = 2;
+    sqe->flags = IOSQE_IO_LINK;
+    ring_sqe(IORING_OP_CLOSE, fd, user_data + 1);
+}
+
+void prep_rename(uint64_t user_data, int dir_fd, const char *from, const char *to) {
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_RENAMEAT, dir_fd, user_data);
+    sqe->addr = (uintptr_t) from;
+    sqe->len = dir_fd;
+    sqe->addr2 = (uintptr_t) to;
+}
+
+unsigned ring_reap(int *results) {
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+    for (; head != tail; head++, count++) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        results[cqe->user_data] = cqe->res;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+// waits for what the kernel already took after a failed submit
+void ring_drain(int *results, unsigned in_flight) {
+    int attempts = 0;
+    while (in_flight > 0 && attempts < 3) {
+        int ret = syscall(__NR_io_uring_enter, ring.fd, 0, in_flight, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            attempts++;
+        }
+        in_flight -= MIN(in_flight, ring_reap(results));
+    }
+    ring.abandoned = in_flight > 0;
+}
+
+// Submits everything prepared since the last call and waits until it all
+// completed. results[user_data] gets the result of each operation, the ones
+// that never completed are left at RING_NO_RESULT. On failure the ring is
+// given up and false returned.
+bool ring_run(int *results, size_t result_count) {
+    for (size_t i = 0; i < result_count; i++) {
+        results[i] = RING_NO_RESULT;
+    }
+
+    unsigned pending = ring.pending;
+    ring.pending = 0;
+    if (!hour_io_available) {
+        return false;
+    }
+
+    __atomic_store_n(ring.sq_tail, ring.local_tail, __ATOMIC_RELEASE);
+    unsigned submitted = 0;
+    unsigned completed = 0;
+    while (completed < pending) {
+        int ret = syscall(__NR_io_uring_enter, ring.fd, pending - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            ZEJF_LOG(2, "io_uring failed, hour files use stdio from now on\n");
+            hour_io_available = false;
+            ring_drain(results, submitted - completed);
+            return false;
+        }
+        submitted += MAX(ret, 0);
+        completed += ring_reap(results);
+    }
+    return true;
+}
+
+void load_batch(HourLoad *loads, size_t count) {
+    HourJob jobs[HOUR_IO_BATCH];
+    int opened[HOUR_IO_BATCH];
+    int results[HOUR_IO_BATCH * 2];
+
+    for (size_t i = 0; i < count; i++) {
+        HourJob *job = &jobs[i];
+        memset(job, 0, sizeof(HourJob));
+        datahour_location(loads[i].stream, loads[i].hour_id, &job->loc);
+        job->dh = hour_pool_alloc();
+        if (job->dh == NULL) {
+            continue;
+        }
+        // relative to the cached folder, the whole path if there is none
+        if (job->loc.dir_fd != -1) {
+            prep_openat(i, job->loc.dir_fd, job->loc.name, O_RDONLY, 0);
+        } else {
+            prep_openat(i, AT_FDCWD, job->loc.path, O_RDONLY, 0);
+        }
+    }
+    ring_run(opened, count);
+
+    for (size_t i = 0; i < count; i++) {
+        HourJob *job = &jobs[i];
+        job->fd = opened[i];
+        if (job->fd >= 0) {
+            job->iov[0] = (struct iovec) { &job->header, sizeof(DataHourHeader) };
+            // as much as the widest file, the read size tells the width
+            job->iov[1] = (struct iovec) { job->dh->samples, SAMPLES_IN_HOUR * sizeof(int32_t) };
+            prep_rw_close(i * 2, IORING_OP_READV, job->fd, job->iov);
+        }
+    }
+    ring_run(results, count * 2);
+
+    for (size_t i = 0; i < count; i++) {
+        HourJob *job = &jobs[i];
+        HourLoad *load = &loads[i];
+        load->dh = NULL;
+        if (job->fd >= 0 && results[i * 2] == RING_NO_RESULT && ring.abandoned) {
+            // the kernel might still write into the buffer, so it is never reused
+            ZEJF_LOG(2, "Abandoned the buffer of hour %d\n", load->hour_id);
+            hour_location_release(&job->loc);
+            continue;
+        }
+        if (job->fd >= 0 && (results[i * 2 + 1] == -ECANCELED || results[i * 2 + 1] == RING_NO_RESULT)) {
+            close(job->fd);
+        }
+
+        int width = job->fd >= 0 && results[i * 2] >= 0 ? datahour_file_width(results[i * 2] - (int64_t) sizeof(DataHourHeader)) : 0;
+        if (width != 0) {
+            datahour_loaded(job->dh, &job->header, load->stream, width);
+            ZEJF_LOG(1, "Load %s\n", job->loc.path);
+            load->dh = job->dh;
+        } else {
+            hour_pool_free(job->dh);
+            // tier files, errors and short reads take the usual path
+            load->dh = datahour_read_file(load->stream, load->hour_id, false);
+        }
+
+        if (load->dh != NULL && load->dh->hour_id != load->hour_id) {
+            datahour_destroy(load->dh);
+            load->dh = NULL;
+        }
+        hour_location_release(&job->loc);
+    }
+}
+
+// the hour files are replaced the same way datahour_save() does it
+void save_batch_ring(DataHour **hours, size_t count) {
+    HourJob jobs[HOUR_IO_BATCH];
+    int opened[HOUR_IO_BATCH];
+    int results[HOUR_IO_BATCH * 2];
+    int renamed[HOUR_IO_BATCH];
+
+    for (size_t i = 0; i < count; i++) {
+        HourJob *job = &jobs[i];
+        memset(job, 0, sizeof(HourJob));
+        job->dh = hours[i];
+        if (job->dh->tier_factor != 1) {
+            datahour_save(job->dh);
+            job->dh = NULL;
+            continue;
+        }
+
+        job->start_us = micros();
+        datahour_location(job->dh->stream, job->dh->hour_id, &job->loc);
+        if (!hour_location_make_dir(&job->loc)) {
+            hour_location_release(&job->loc);
+            job->dh = NULL;
+            continue;
+        }
+        snprintf(job->tmp_name, sizeof(job->tmp_name), "%s.tmp", job->loc.name);
+        datahour_header(job->dh, &job->header);
+        ZEJF_LOG(1, "Saving to %s, %d\n", job->loc.path, job->dh->hour_id);
+        prep_openat(i, job->loc.dir_fd, job->tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    ring_run(opened, count);
+
+    for (size_t i = 0; i < count; i++) {
+        HourJob *job = &jobs[i];
+        job->fd = job->dh != NULL ? opened[i] : -1;
+        if (job->fd >= 0) {
+            job->iov[0] = (struct iovec) { &job->header, sizeof(DataHourHeader) };
+            job->iov[1] = (struct iovec) { job->dh->samples, datahour_samples_size(job->dh) };
+            prep_rw_close(i * 2, IORING_OP_WRITEV, job->fd, job->iov);
+        }
+    }
+    ring_run(results, count * 2);
+
+    for (size_t i = 0; i < count; i++) {
+        HourJob *job = &jobs[i];
+        if (job->fd >= 0 && results[i * 2] == (int) (sizeof(DataHourHeader) + datahour_samples_size(job->dh)) && results[i * 2 + 1] == 0) {
+            prep_rename(i, job->loc.dir_fd, job->tmp_name, job->loc.name);
+        }
+    }
+    ring_run(renamed, count);
+
+    for (size_t i = 0; i < count; i++) {
+        HourJob *job = &jobs[i];
+        if (job->dh == NULL) {
+            continue;
+        }
+        // the kernel only reads the samples, a stale write lands in the
+        // unlinked temporary file
+        if (renamed[i] == 0) {
+            datahour_saved(job->dh, job->start_us);
+        } else {
+            if (job->fd >= 0 && (results[i * 2 + 1] == -ECANCELED || results[i * 2 + 1] == RING_NO_RESULT)) {
+                close(job->fd);
+            }
+            if (job->fd >= 0) {
+                hour_location_unlink(&job->loc, job->tmp_name);
+            }
+            // reports the error, or succeeds if only the ring failed
+            datahour_save(job->dh);
+        }
+        hour_location_release(&job->loc);
+    }
+}
+
+// False if the ring isn't available or failed on the way. The loads that
+// were done keep their dh, the caller loads the rest.
+bool hour_io_load(HourLoad *loads, size_t count) {
+    MUTEX_LOCK(&hour_io_lock);
+    for (size_t i = 0; hour_io_available && i < count; i += HOUR_IO_BATCH) {
+        load_batch(loads + i, MIN(count - i, HOUR_IO_BATCH));
+    }
+    bool available = hour_io_available;
+    MUTEX_UNLOCK(&hour_io_lock);
+    return available;
+}
+
+// false the same way, the hours that were saved are no longer modified
+bool hour_io_save(DataHour **hours, size_t count) {
+    MUTEX_LOCK(&hour_io_lock);
+    for (size_t i = 0; hour_io_available && i < count; i += HOUR_IO_BATCH) {
+        save_batch_ring(hours + i, MIN(count - i, HOUR_IO_BATCH));
+    }
+    bool available = hour_io_available;
+    MUTEX_UNLOCK(&hour_io_lock);
+    return available;
+}
+
+#else
+
+bool hour_io_init(void) {
+    return false;
+}
+
+void hour_io_destroy(void) {
+}
+
+bool hour_io_load(HourLoad *loads, size_t count) {
+    (void) loads;
+    (void) count;
+    return false;
+}
+
+bool hour_io_save(DataHour **hours, size_t count) {
+    (void) hours;
+    (void) count;
+    return false;
+}
+
+#endif
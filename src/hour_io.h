@@ -0,0 +1,29 @@
+#ifndef HOUR_IO_H
+#define HOUR_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data.h"
+
+#define HOUR_IO_RING_ENTRIES 64
+// every hour takes two submissions in the same pass
+#define HOUR_IO_BATCH (HOUR_IO_RING_ENTRIES / 2)
+
+typedef struct hour_load_t
+{
+    int stream;
+    int32_t hour_id;
+    DataHour *dh;
+} HourLoad;
+
+bool hour_io_init(void);
+
+void hour_io_destroy(void);
+
+bool hour_io_load(HourLoad *loads, size_t count);
+
+bool hour_io_save(DataHour **hours, size_t count);
+
+#endif
@@ -0,0 +1,237 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "data.h"
+#include "hour_path.h"
+#include "lock_profile.h"
+#include "scheduler.h"
+
+pthread_mutex_t hour_path_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char months[12][10] = { "January", "February", "March", "April", "May", "June", "July", "August", "September", "October", "November", "December" };
+
+HourDay hour_days[HOUR_DAY_CACHE_SIZE];
+uint64_t hour_day_uses = 0;
+
+void format_dir(struct tm *t, char *dir) {
+    snprintf(dir, HOUR_DIR_MAX, MAIN_FOLDER "%d_sps/%d/%s/%02d/", SAMPLES_PER_SECOND, t->tm_year + 1900, months[t->tm_mon], t->tm_mday);
+}
+
+HourDay *find_day(int32_t hour_id) {
+    for (int i = 0; i < HOUR_DAY_CACHE_SIZE; i++) {
+        HourDay *day = &hour_days[i];
+        if (day->hour_count > 0 && day->sample_rate == SAMPLES_PER_SECOND && hour_id >= day->first_hour_id && hour_id < day->first_hour_id + day->hour_count) {
+            return day;
+        }
+    }
+    return NULL;
+}
+
+// NULL if the day can't be cached, t is the local time of the hour either way
+HourDay *cache_day(int32_t hour_id, struct tm *t) {
+    time_t time = (time_t) hour_id * 60 * 60;
+    localtime_r(&time, t);
+
+    int32_t first_hour_id = hour_id - t->tm_hour;
+    time_t first_time = (time_t) first_hour_id * 60 * 60;
+    time_t last_time = first_time + 23 * 60 * 60;
+    struct tm first;
+    struct tm last;
+    localtime_r(&first_time, &first);
+    localtime_r(&last_time, &last);
+    if (first.tm_hour != 0 || last.tm_hour != 23 || first.tm_yday != t->tm_yday || last.tm_yday != t->tm_yday) {
+        return NULL;
+    }
+
+    HourDay *day = NULL;
+    for (int i = 0; i < HOUR_DAY_CACHE_SIZE; i++) {
+        HourDay *candidate = &hour_days[i];
+        if (candidate->refs == 0 && (day == NULL || candidate->hour_count == 0 || candidate->last_use < day->last_use)) {
+            day = candidate;
+            if (day->hour_count == 0) {
+                break;
+            }
+        }
+    }
+    if (day == NULL) {
+        return NULL;
+    }
+
+    if (day->hour_count > 0 && day->dir_fd != -1) {
+        close(day->dir_fd);
+    }
+    day->sample_rate = SAMPLES_PER_SECOND;
+    day->first_hour_id = first_hour_id;
+    day->hour_count = 24;
+    format_dir(t, day->dir);
+    day->dir_fd = open(day->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return day;
+}
+
+// formats the folder of the hour, the name is empty
+void hour_location_get(int32_t hour_id, HourLocation *loc) {
+    struct tm t;
+    MUTEX_LOCK(&hour_path_lock);
+    HourDay *day = find_day(hour_id);
+    if (day == NULL) {
+        day = cache_day(hour_id, &t);
+    }
+    if (day != NULL) {
+        day->refs++;
+        day->last_use = ++hour_day_uses;
+        loc->dir_fd = day->dir_fd;
+        loc->hour = hour_id - day->first_hour_id;
+        strcpy(loc->path, day->dir);
+    }
+    MUTEX_UNLOCK(&hour_path_lock);
+
+    loc->day = day;
+    loc->own_fd = false;
+    if (day == NULL) {
+        loc->dir_fd = -1;
+        loc->hour = t.tm_hour;
+        format_dir(&t, loc->path);
+    }
+    loc->dir_length = strlen(loc->path);
+    loc->name = loc->path + loc->dir_length;
+}
+
+void hour_location_set_name(HourLocation *loc, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(loc->name, HOUR_NAME_MAX, format, args);
+    va_end(args);
+}
+
+void location_dir(HourLocation *loc, char *dir) {
+    memcpy(dir, loc->path, loc->dir_length);
+    dir[loc->dir_length] = '\0';
+}
+
+// a new descriptor of the folder replaces the one of the location, and the
+// cached one unless another holder might still use it
+bool reopen_dir(HourLocation *loc, const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    MUTEX_LOCK(&hour_path_lock);
+    HourDay *day = loc->day;
+    bool shared = day != NULL && (day->dir_fd == -1 || day->refs == 1);
+    if (shared) {
+        if (day->dir_fd != -1) {
+            close(day->dir_fd);
+        }
+        day->dir_fd = fd;
+    }
+    MUTEX_UNLOCK(&hour_path_lock);
+
+    if (loc->own_fd) {
+        close(loc->dir_fd);
+    }
+    loc->own_fd = !shared;
+    loc->dir_fd = fd;
+    return true;
+}
+
+// Creates the folder if needed and keeps it open. A cached folder that was
+// removed in the meantime is created again.
+bool hour_location_make_dir(HourLocation *loc) {
+    struct stat st;
+    if (loc->dir_fd != -1 && fstat(loc->dir_fd, &st) == 0 && st.st_nlink > 0) {
+        return true;
+    }
+
+    char dir[HOUR_DIR_MAX];
+    location_dir(loc, dir);
+    if (stat(dir, &st) == -1) {
+        ZEJF_LOG(1, "Creating %s\n", dir);
+        if (mkpath(dir, 0700) != 0) {
+            perror("mkdir");
+            return false;
+        }
+    }
+
+    if (!reopen_dir(loc, dir)) {
+        perror(dir);
+        return false;
+    }
+    return true;
+}
+
+// A file in the folder of the hour. A cached folder that was removed and
+// created again is opened again once.
+int hour_location_open(HourLocation *loc, const char *name, int flags, mode_t mode) {
+    if (loc->dir_fd != -1) {
+        int fd = openat(loc->dir_fd, name, flags | O_CLOEXEC, mode);
+        struct stat st;
+        if (fd == -1 && errno == ENOENT && fstat(loc->dir_fd, &st) == 0 && st.st_nlink == 0) {
+            char dir[HOUR_DIR_MAX];
+            location_dir(loc, dir);
+            if (reopen_dir(loc, dir)) {
+                fd = openat(loc->dir_fd, name, flags | O_CLOEXEC, mode);
+            } else {
+                errno = ENOENT;
+            }
+        }
+        return fd;
+    }
+    char path[HOUR_DIR_MAX + HOUR_NAME_MAX];
+    snprintf(path, sizeof(path), "%.*s%s", (int) loc->dir_length, loc->path, name);
+    return open(path, flags | O_CLOEXEC, mode);
+}
+
+bool hour_location_rename(HourLocation *loc, const char *from, const char *to) {
+    if (loc->dir_fd != -1) {
+        return renameat(loc->dir_fd, from, loc->dir_fd, to) == 0;
+    }
+    char from_path[HOUR_DIR_MAX + HOUR_NAME_MAX];
+    char to_path[HOUR_DIR_MAX + HOUR_NAME_MAX];
+    snprintf(from_path, sizeof(from_path), "%.*s%s", (int) loc->dir_length, loc->path, from);
+    snprintf(to_path, sizeof(to_path), "%.*s%s", (int) loc->dir_length, loc->path, to);
+    return rename(from_path, to_path) == 0;
+}
+
+void hour_location_unlink(HourLocation *loc, const char *name) {
+    if (loc->dir_fd != -1) {
+        unlinkat(loc->dir_fd, name, 0);
+        return;
+    }
+    char path[HOUR_DIR_MAX + HOUR_NAME_MAX];
+    snprintf(path, sizeof(path), "%.*s%s", (int) loc->dir_length, loc->path, name);
+    unlink(path);
+}
+
+void hour_location_release(HourLocation *loc) {
+    if (loc->own_fd) {
+        close(loc->dir_fd);
+    }
+    if (loc->day != NULL) {
+        MUTEX_LOCK(&hour_path_lock);
+        loc->day->refs--;
+        MUTEX_UNLOCK(&hour_path_lock);
+    }
+    loc->day = NULL;
+    loc->own_fd = false;
+    loc->dir_fd = -1;
+}
+
+void hour_path_destroy(void) {
+    MUTEX_LOCK(&hour_path_lock);
+    for (int i = 0; i < HOUR_DAY_CACHE_SIZE; i++) {
+        if (hour_days[i].hour_count > 0 && hour_days[i].dir_fd != -1) {
+            close(hour_days[i].dir_fd);
+        }
+        hour_days[i].hour_count = 0;
+    }
+    MUTEX_UNLOCK(&hour_path_lock);
+}
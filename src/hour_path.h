@@ -0,0 +1,57 @@
+#ifndef HOUR_PATH_H
+#define HOUR_PATH_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define HOUR_DIR_MAX 128
+#define HOUR_NAME_MAX 64
+#define HOUR_DAY_CACHE_SIZE 16
+
+// Folder of one local day. Days with a daylight saving change are not
+// cached, their hours don't map to the hour of the day by subtraction.
+typedef struct hour_day_t
+{
+    int sample_rate;
+    int32_t first_hour_id;
+    int32_t hour_count; // 0 for a free entry
+    int dir_fd; // -1 until the folder exists
+    int refs;
+    uint64_t last_use;
+    char dir[HOUR_DIR_MAX];
+} HourDay;
+
+// Where an hour file lives, dir_fd stays open until hour_location_release()
+typedef struct hour_location_t
+{
+    HourDay *day; // NULL if the day isn't cached
+    int dir_fd;
+    bool own_fd; // a descriptor only this location uses
+    int hour; // local hour of the day
+    size_t dir_length;
+    char *name; // the file name part of path
+    char path[HOUR_DIR_MAX + HOUR_NAME_MAX];
+} HourLocation;
+
+extern pthread_mutex_t hour_path_lock;
+
+void hour_location_get(int32_t hour_id, HourLocation *loc);
+
+void hour_location_set_name(HourLocation *loc, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+bool hour_location_make_dir(HourLocation *loc);
+
+int hour_location_open(HourLocation *loc, const char *name, int flags, mode_t mode);
+
+bool hour_location_rename(HourLocation *loc, const char *from, const char *to);
+
+void hour_location_unlink(HourLocation *loc, const char *name);
+
+void hour_location_release(HourLocation *loc);
+
+void hour_path_destroy(void);
+
+#endif
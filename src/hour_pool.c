@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "data.h"
+#include "hour_pool.h"
+#include "lock_profile.h"
+#include "scheduler.h"
+#include "time_utils.h"
+
+pthread_mutex_t hour_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+HourPool pool = { 0 };
+
+size_t round_up(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+// explicit huge pages if some are reserved, transparent ones otherwise
+bool map_huge_slab(void) {
+    pool.stride = round_up(datahour_get_size(), HOUR_POOL_HUGE_PAGE_SIZE);
+    pool.slab_size = pool.stride * HOUR_POOL_SLOTS;
+    void *slab = mmap(NULL, pool.slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (slab != MAP_FAILED) {
+        pool.slab = slab;
+        pool.huge_pages = true;
+        return true;
+    }
+    ZEJF_LOG(1, "No reserved huge pages for %ld MB, trying transparent huge pages\n", pool.slab_size / (1024 * 1024));
+
+    // over-allocated so the slots can start on a huge page boundary
+    size_t mapped_size = pool.slab_size + HOUR_POOL_HUGE_PAGE_SIZE;
+    char *mapped = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapped == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    char *aligned = (char *) round_up((uintptr_t) mapped, HOUR_POOL_HUGE_PAGE_SIZE);
+    if (aligned != mapped) {
+        munmap(mapped, aligned - mapped);
+    }
+    size_t tail = mapped + mapped_size - (aligned + pool.slab_size);
+    if (tail > 0) {
+        munmap(aligned + pool.slab_size, tail);
+    }
+    pool.slab = aligned;
+    pool.transparent_huge_pages = madvise(pool.slab, pool.slab_size, MADV_HUGEPAGE) == 0;
+    if (!pool.transparent_huge_pages) {
+        perror("madvise");
+    }
+    return true;
+}
+
+bool map_slab(void) {
+    pool.stride = round_up(datahour_get_size(), sysconf(_SC_PAGESIZE));
+    pool.slab_size = pool.stride * HOUR_POOL_SLOTS;
+    void *slab = mmap(NULL, pool.slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slab == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    pool.slab = slab;
+    return true;
+}
+
+// Pages are only touched when a slot is first used. Without a slab every
+// hour comes from malloc, the tools never call this.
+void hour_pool_init(bool huge_pages) {
+    MUTEX_LOCK(&hour_pool_lock);
+    if (pool.slab != NULL) {
+        MUTEX_UNLOCK(&hour_pool_lock);
+        return;
+    }
+
+    pool.free_slots = malloc(HOUR_POOL_SLOTS * sizeof(size_t));
+    if (pool.free_slots == NULL) {
+        perror("malloc");
+    } else if (huge_pages ? map_huge_slab() : map_slab()) {
+        // the lowest slots are handed out first
+        for (size_t i = 0; i < HOUR_POOL_SLOTS; i++) {
+            pool.free_slots[i] = HOUR_POOL_SLOTS - 1 - i;
+        }
+        pool.free_count = HOUR_POOL_SLOTS;
+    } else {
+        free(pool.free_slots);
+        pool.free_slots = NULL;
+        pool.slab = NULL;
+    }
+    MUTEX_UNLOCK(&hour_pool_lock);
+}
+
+// uninitialized, datahour_create() and the loaders fill it in
+DataHour *hour_pool_alloc(void) {
+    MUTEX_LOCK(&hour_pool_lock);
+    DataHour *dh = NULL;
+    pool.allocations++;
+    if (pool.free_count > 0) {
+        size_t slot = pool.free_slots[--pool.free_count];
+        dh = (DataHour *) (pool.slab + slot * pool.stride);
+        pool.in_use++;
+        pool.peak_in_use = MAX(pool.peak_in_use, pool.in_use);
+        // untouched slots come off the stack in order
+        if (slot < pool.touched) {
+            pool.reused++;
+        } else {
+            pool.touched = slot + 1;
+        }
+    } else {
+        pool.overflow += pool.slab != NULL;
+    }
+    MUTEX_UNLOCK(&hour_pool_lock);
+
+    if (dh == NULL && (dh = malloc(datahour_get_size())) == NULL) {
+        perror("malloc");
+    }
+    return dh;
+}
+
+void hour_pool_free(DataHour *dh) {
+    if (dh == NULL) {
+        return;
+    }
+    char *address = (char *) dh;
+    if (pool.slab == NULL || address < pool.slab || address >= pool.slab + pool.slab_size) {
+        free(dh);
+        return;
+    }
+
+    MUTEX_LOCK(&hour_pool_lock);
+    pool.free_slots[pool.free_count++] = (address - pool.slab) / pool.stride;
+    pool.in_use--;
+    MUTEX_UNLOCK(&hour_pool_lock);
+}
+
+// Only the first block is written value by value, the rest is copied from
+// it, which lets memcpy use the widest stores the CPU has.
+void samples_fill_err(int32_t *samples, size_t count) {
+    size_t filled = MIN(count, (size_t) HOUR_POOL_FILL_BLOCK);
+    for (size_t i = 0; i < filled; i++) {
+        samples[i] = ERR_VAL;
+    }
+    while (filled < count) {
+        size_t n = MIN(count - filled, (size_t) HOUR_POOL_FILL_BLOCK);
+        memcpy(samples + filled, samples, n * sizeof(int32_t));
+        filled += n;
+    }
+}
+
+void hour_pool_print(void) {
+    MUTEX_LOCK(&hour_pool_lock);
+    if (pool.slab == NULL) {
+        printf("datahour pool: off\n");
+    } else {
+        printf("datahour pool: %ld/%d slots in use (peak %ld), %.1f MB slots, %s\n", pool.in_use, HOUR_POOL_SLOTS, pool.peak_in_use,
+                pool.stride / (1024.0 * 1024.0), pool.huge_pages ? "huge pages" : pool.transparent_huge_pages ? "transparent huge pages" : "normal pages");
+        printf("datahour allocations: %ld (%ld reused slots, %ld from malloc)\n", pool.allocations, pool.reused, pool.overflow);
+    }
+    MUTEX_UNLOCK(&hour_pool_lock);
+}
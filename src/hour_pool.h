@@ -0,0 +1,50 @@
+#ifndef HOUR_POOL_H
+#define HOUR_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data.h"
+
+// the loaded window of every stream plus room for requests and saving
+#define HOUR_POOL_SLOTS (STREAM_COUNT * PERMANENTLY_LOADED_HOURS + 8)
+#define HOUR_POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// values copied at once by samples_fill_err(), small enough to stay in L1
+#define HOUR_POOL_FILL_BLOCK 4096
+
+// One mapping cut into equal slots, each big enough for a DataHour. Freed
+// slots go back on the stack and keep their pages, hours beyond the slots
+// come from malloc.
+typedef struct hour_pool_t
+{
+    char *slab;
+    size_t slab_size;
+    size_t stride;
+    size_t *free_slots;
+    size_t free_count;
+    bool huge_pages;
+    bool transparent_huge_pages;
+
+    size_t touched;
+    size_t in_use;
+    size_t peak_in_use;
+    uint64_t allocations;
+    uint64_t reused;
+    uint64_t overflow;
+} HourPool;
+
+extern pthread_mutex_t hour_pool_lock;
+
+void hour_pool_init(bool huge_pages);
+
+DataHour *hour_pool_alloc(void);
+
+void hour_pool_free(DataHour *dh);
+
+void samples_fill_err(int32_t *samples, size_t count);
+
+void hour_pool_print(void);
+
+#endif
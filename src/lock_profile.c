@@ -0,0 +1,175 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lock_profile.h"
+#include "time_utils.h"
+
+#ifdef ZEJF_LOCK_PROFILE
+
+typedef struct held_lock_t
+{
+    pthread_mutex_t *lock;
+    int site;
+    int64_t acquired_ns;
+} HeldLock;
+
+LockSite lock_sites[LOCK_PROFILE_MAX_SITES];
+int lock_site_count = 0;
+pthread_mutex_t lock_sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread HeldLock held_locks[LOCK_PROFILE_MAX_HELD];
+__thread int held_count = 0;
+
+// each call site registers once and remembers its index
+int register_site(int *site, const char *name, const char *file, int line) {
+    int index = __atomic_load_n(site, __ATOMIC_ACQUIRE);
+    if (index >= 0) {
+        return index;
+    }
+
+    pthread_mutex_lock(&lock_sites_lock);
+    for (index = 0; index < lock_site_count; index++) {
+        if (lock_sites[index].line == line && strcmp(lock_sites[index].file, file) == 0) {
+            break;
+        }
+    }
+    if (index == lock_site_count && lock_site_count < LOCK_PROFILE_MAX_SITES) {
+        lock_sites[index].name = name;
+        lock_sites[index].file = file;
+        lock_sites[index].line = line;
+        __atomic_store_n(&lock_site_count, lock_site_count + 1, __ATOMIC_RELEASE);
+    }
+    if (index < LOCK_PROFILE_MAX_SITES) {
+        __atomic_store_n(site, index, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&lock_sites_lock);
+    return index < LOCK_PROFILE_MAX_SITES ? index : -1;
+}
+
+void profiled_lock(pthread_mutex_t *lock, int *site, const char *name, const char *file, int line, Histogram *wait_histogram) {
+    int index = register_site(site, name, file, line);
+    int64_t wait_ns = 0;
+    bool contended = pthread_mutex_trylock(lock) != 0;
+    if (contended) {
+        int64_t start = nanos();
+        pthread_mutex_lock(lock);
+        wait_ns = nanos() - start;
+    }
+
+    if (wait_histogram != NULL) {
+        metrics_observe(wait_histogram, wait_ns / 1000);
+    }
+    if (index < 0) {
+        return;
+    }
+
+    LockSite *lock_site = &lock_sites[index];
+    METRIC_ADD(lock_site->acquisitions, 1);
+    METRIC_ADD(lock_site->contended, contended);
+    METRIC_ADD(lock_site->wait_ns, wait_ns);
+    metrics_observe(&lock_site->wait, wait_ns / 1000);
+
+    if (held_count < LOCK_PROFILE_MAX_HELD) {
+        held_locks[held_count].lock = lock;
+        held_locks[held_count].site = index;
+        held_locks[held_count].acquired_ns = nanos();
+        held_count++;
+    }
+}
+
+// the hold time goes to the site that took the lock
+void end_hold(pthread_mutex_t *lock) {
+    int64_t now = nanos();
+    for (int i = held_count - 1; i >= 0; i--) {
+        if (held_locks[i].lock != lock) {
+            continue;
+        }
+        LockSite *lock_site = &lock_sites[held_locks[i].site];
+        int64_t hold_ns = now - held_locks[i].acquired_ns;
+        METRIC_ADD(lock_site->hold_ns, hold_ns);
+        metrics_observe(&lock_site->hold, hold_ns / 1000);
+        memmove(&held_locks[i], &held_locks[i + 1], (held_count - i - 1) * sizeof(HeldLock));
+        held_count--;
+        break;
+    }
+}
+
+void profiled_unlock(pthread_mutex_t *lock) {
+    end_hold(lock);
+    pthread_mutex_unlock(lock);
+}
+
+// pthread_cond_wait() takes the lock back without telling how long that took,
+// so it is released and taken again through profiled_lock() to measure it.
+// Callers check their condition in a loop anyway.
+void profiled_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, int *site, const char *name, const char *file, int line) {
+    end_hold(lock);
+    pthread_cond_wait(cond, lock);
+    pthread_mutex_unlock(lock);
+    profiled_lock(lock, site, name, file, line, NULL);
+}
+
+int compare_wait(const void *a, const void *b) {
+    const LockSite *site_a = *(const LockSite **) a;
+    const LockSite *site_b = *(const LockSite **) b;
+    if (site_a->wait_ns != site_b->wait_ns) {
+        return site_a->wait_ns < site_b->wait_ns ? 1 : -1;
+    }
+    return site_a->hold_ns < site_b->hold_ns ? 1 : site_a->hold_ns > site_b->hold_ns ? -1 : 0;
+}
+
+// sites of the same lock expression are summed up, the counters are read
+// without stopping the server so the numbers can be slightly off
+void lock_profile_print(void) {
+    int count = __atomic_load_n(&lock_site_count, __ATOMIC_ACQUIRE);
+    LockSite *sites[LOCK_PROFILE_MAX_SITES];
+    bool printed[LOCK_PROFILE_MAX_SITES] = { false };
+
+    printf("\n========= Lock profile ===========\n");
+    for (int i = 0; i < count; i++) {
+        if (printed[i]) {
+            continue;
+        }
+
+        LockSite total = { 0 };
+        int site_count = 0;
+        for (int j = i; j < count; j++) {
+            LockSite *site = &lock_sites[j];
+            if (strcmp(site->name, lock_sites[i].name) != 0) {
+                continue;
+            }
+            printed[j] = true;
+            sites[site_count++] = site;
+            total.acquisitions += site->acquisitions;
+            total.contended += site->contended;
+            total.wait_ns += site->wait_ns;
+            total.hold_ns += site->hold_ns;
+            for (int bucket = 0; bucket <= METRICS_BUCKETS; bucket++) {
+                total.wait.buckets[bucket] += site->wait.buckets[bucket];
+                total.hold.buckets[bucket] += site->hold.buckets[bucket];
+            }
+        }
+
+        printf("%s: %lu acquisitions, %.1f%% contended, waited %.3fms, held %.3fms\n", lock_sites[i].name, total.acquisitions,
+                total.acquisitions > 0 ? total.contended * 100.0 / total.acquisitions : 0, total.wait_ns / 1e6, total.hold_ns / 1e6);
+        metrics_print_histogram("wait", &total.wait);
+        metrics_print_histogram("hold", &total.hold);
+
+        qsort(sites, site_count, sizeof(LockSite *), compare_wait);
+        for (int j = 0; j < site_count && j < LOCK_PROFILE_TOP_SITES; j++) {
+            const char *file = strrchr(sites[j]->file, '/');
+            printf("    %s:%d %lu acquisitions, waited %.3fms, held %.3fms\n", file != NULL ? file + 1 : sites[j]->file, sites[j]->line, sites[j]->acquisitions, sites[j]->wait_ns / 1e6, sites[j]->hold_ns / 1e6);
+        }
+    }
+    printf("================================\n\n");
+}
+
+#else
+
+void lock_profile_print(void) {
+    printf("Lock profiling is disabled, build with -DZEJF_LOCK_PROFILE=ON\n");
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef LOCK_PROFILE_H
+#define LOCK_PROFILE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+// Every lock and unlock of the server's mutexes goes through these. Built
+// with ZEJF_LOCK_PROFILE they record wait and hold times per call site,
+// otherwise they are the plain pthread calls.
+#ifdef ZEJF_LOCK_PROFILE
+
+#define LOCK_PROFILE_MAX_SITES 256
+#define LOCK_PROFILE_MAX_HELD 8
+#define LOCK_PROFILE_TOP_SITES 5
+
+typedef struct lock_site_t
+{
+    const char *name;
+    const char *file;
+    int line;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    Histogram wait;
+    Histogram hold;
+} LockSite;
+
+#define MUTEX_LOCK(lock)                                                   \
+    do {                                                                   \
+        static int lock_site_ = -1;                                        \
+        profiled_lock(lock, &lock_site_, #lock, __FILE__, __LINE__, NULL); \
+    } while (0)
+#define MUTEX_LOCK_TIMED(lock, wait_histogram)                                       \
+    do {                                                                             \
+        static int lock_site_ = -1;                                                  \
+        profiled_lock(lock, &lock_site_, #lock, __FILE__, __LINE__, wait_histogram); \
+    } while (0)
+#define MUTEX_UNLOCK(lock) profiled_unlock(lock)
+// the time asleep is neither hold nor wait time
+#define COND_WAIT(cond, lock)                                                     \
+    do {                                                                          \
+        static int lock_site_ = -1;                                               \
+        profiled_cond_wait(cond, lock, &lock_site_, #lock, __FILE__, __LINE__); \
+    } while (0)
+
+void profiled_lock(pthread_mutex_t *lock, int *site, const char *name, const char *file, int line, Histogram *wait_histogram);
+
+void profiled_unlock(pthread_mutex_t *lock);
+
+void profiled_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, int *site, const char *name, const char *file, int line);
+
+#else
+
+#define MUTEX_LOCK(lock) pthread_mutex_lock(lock)
+#define MUTEX_LOCK_TIMED(lock, wait_histogram) metrics_lock(lock, wait_histogram)
+#define MUTEX_UNLOCK(lock) pthread_mutex_unlock(lock)
+#define COND_WAIT(cond, lock) pthread_cond_wait(cond, lock)
+
+#endif
+
+void lock_profile_print(void);
+
+#endif
@@ -0,0 +1,198 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "logger.h"
+#include "scheduler.h"
+#include "time_utils.h"
+
+volatile int log_level = ZEJF_LOG_LEVEL;
+
+LogRecord log_records[LOG_QUEUE_RECORDS];
+size_t log_enqueue_pos = 0;
+size_t log_dequeue_pos = 0;
+uint64_t log_dropped = 0;
+
+volatile bool logger_running = false;
+sem_t logger_semaphore;
+pthread_t logger_thread;
+
+FILE *log_file = NULL;
+const char *log_file_path = NULL;
+int64_t log_file_size = 0;
+int64_t log_max_file_size = 0;
+
+__thread char log_line[LOG_LINE_MAX];
+
+// Formats into the thread's buffer and hands the line to the writer thread.
+// Producers never wait: when the queue is full the line is dropped and
+// counted. Without a running writer the line is printed directly.
+void zejf_log(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(log_line, LOG_LINE_MAX, format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    length = MIN(length, LOG_LINE_MAX - 1);
+
+    if (!logger_running) {
+        fwrite(log_line, 1, length, stdout);
+        return;
+    }
+
+    size_t pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+    LogRecord *record;
+    while (true) {
+        record = &log_records[pos % LOG_QUEUE_RECORDS];
+        size_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    record->time_ms = millis();
+    record->length = length;
+    memcpy(record->text, log_line, length);
+    __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&logger_semaphore);
+}
+
+// path.1 is the newest old file, the oldest one is deleted
+void rotate_log_file(void) {
+    fclose(log_file);
+    char from[512];
+    char to[512];
+    for (int i = LOG_ROTATE_KEEP; i > 0; i--) {
+        snprintf(from, sizeof(from), i == 1 ? "%s" : "%s.%d", log_file_path, i - 1);
+        snprintf(to, sizeof(to), "%s.%d", log_file_path, i);
+        if (rename(from, to) != 0 && errno != ENOENT) {
+            perror(from);
+        }
+    }
+    log_file = fopen(log_file_path, "a");
+    if (log_file == NULL) {
+        perror(log_file_path);
+    }
+    log_file_size = 0;
+}
+
+void write_log_line(const char *text, size_t length, int64_t time_ms) {
+    if (log_file == NULL) {
+        fwrite(text, 1, length, stdout);
+        return;
+    }
+
+    if (log_max_file_size > 0 && log_file_size + (int64_t) (length + LOG_TIME_PREFIX_LENGTH) > log_max_file_size) {
+        rotate_log_file();
+        if (log_file == NULL) {
+            return;
+        }
+    }
+
+    char date[32];
+    time_t seconds = time_ms / 1000;
+    struct tm t;
+    localtime_r(&seconds, &t);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &t);
+    log_file_size += fprintf(log_file, "%s.%03ld ", date, time_ms % 1000);
+    log_file_size += fwrite(text, 1, length, log_file);
+}
+
+// single consumer, returns the number of lines written
+size_t drain_log_queue(void) {
+    size_t count = 0;
+    while (true) {
+        LogRecord *record = &log_records[log_dequeue_pos % LOG_QUEUE_RECORDS];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != log_dequeue_pos + 1) {
+            break;
+        }
+        write_log_line(record->text, record->length, record->time_ms);
+        __atomic_store_n(&record->sequence, log_dequeue_pos + LOG_QUEUE_RECORDS, __ATOMIC_RELEASE);
+        log_dequeue_pos++;
+        count++;
+    }
+    return count;
+}
+
+void *run_logger() {
+    uint64_t reported_dropped = 0;
+    while (true) {
+        sem_wait(&logger_semaphore);
+        bool running = logger_running;
+        drain_log_queue();
+
+        uint64_t dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+        if (dropped != reported_dropped) {
+            char text[64];
+            int length = snprintf(text, sizeof(text), "%lu log lines dropped\n", dropped - reported_dropped);
+            write_log_line(text, length, millis());
+            reported_dropped = dropped;
+        }
+
+        fflush(log_file != NULL ? log_file : stdout);
+        if (!running) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+bool logger_start(const char *file, int64_t max_file_size) {
+    for (size_t i = 0; i < LOG_QUEUE_RECORDS; i++) {
+        log_records[i].sequence = i;
+    }
+    log_enqueue_pos = 0;
+    log_dequeue_pos = 0;
+
+    if (file != NULL) {
+        log_file = fopen(file, "a");
+        if (log_file == NULL) {
+            perror(file);
+            return false;
+        }
+        struct stat st;
+        log_file_size = fstat(fileno(log_file), &st) == 0 ? st.st_size : 0;
+        log_file_path = file;
+        log_max_file_size = max_file_size;
+    }
+
+    static bool semaphore_ready = false;
+    if (!semaphore_ready) {
+        sem_init(&logger_semaphore, 0, 0);
+        semaphore_ready = true;
+    }
+    logger_running = true;
+    pthread_create(&logger_thread, NULL, run_logger, NULL);
+    return true;
+}
+
+// writes out what is still queued, later lines are printed directly. The
+// semaphore is left alone, a late producer might still post it.
+void logger_stop(void) {
+    if (!logger_running) {
+        return;
+    }
+    logger_running = false;
+    sem_post(&logger_semaphore);
+    pthread_join(logger_thread, NULL);
+    drain_log_queue();
+    if (log_file != NULL) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_LINE_MAX 256
+#define LOG_QUEUE_RECORDS 1024 // power of 2
+#define LOG_DEFAULT_FILE_SIZE_MB 10
+#define LOG_ROTATE_KEEP 3
+// "YYYY-MM-DD HH:MM:SS.mmm "
+#define LOG_TIME_PREFIX_LENGTH 24
+
+// One slot of the log queue. sequence tells whose turn it is: the slot is
+// free for the producer at position sequence and holds a record for the
+// consumer at position sequence - 1.
+typedef struct log_record_t
+{
+    size_t sequence;
+    int64_t time_ms;
+    size_t length;
+    char text[LOG_LINE_MAX];
+} LogRecord;
+
+extern volatile int log_level;
+
+void zejf_log(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+bool logger_start(const char *file, int64_t max_file_size);
+
+void logger_stop(void);
+
+#endif
@@ -2,18 +2,44 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "clock_discipline.h"
 #include "data.h"
+#include "decimator.h"
+#include "filter.h"
+#include "logger.h"
+#include "recent.h"
+#include "retention.h"
 #include "scheduler.h"
 #include "serial_reader.h"
+#include "trigger.h"
+
+// long options without a short form
+#define OPTION_STA 256
+#define OPTION_LTA 257
+#define OPTION_TRIGGER_ON 258
+#define OPTION_TRIGGER_OFF 259
+#define OPTION_KEEP_FULL 260
+#define OPTION_KEEP_DECIMATED 261
+#define OPTION_TIER_RATE 262
+#define OPTION_RECENT 263
+#define OPTION_METRICS_PORT 264
+#define OPTION_LOG_FILE 265
+#define OPTION_LOG_SIZE 266
+#define OPTION_LOG_LEVEL 267
+#define OPTION_HUGE_PAGES 268
 
 void print_usage(void) {
-    printf("Usage: -s <serial port> -i <ip address> -p <port number> -r <sample rate>\n");
+    printf("Usage: -s <serial port> -i <ip address> -p <port number> -r <sample rate> [-b <clock loop bandwidth Hz>] [-c <capture file>] [-R <replay file> [-x <replay speed>]] [-f <low Hz>:<high Hz> | off]\n");
+    printf("       [--sta <s>] [--lta <s>] [--trigger_on <ratio>] [--trigger_off <ratio>]\n");
+    printf("       [--keep_full <days>] [--keep_decimated <days>] [--tier_rate <sps>] [--recent <minutes>] [--metrics_port <port>]\n");
+    printf("       [--log_file <path>] [--log_size <MB>] [--log_level <0-3>] [--huge_pages]\n");
 }
 
 void print_sample_rate_usage() {
     printf("Supported sample rates:\n");
-    for (int i = 0; i < 5; i++) {
+    for (int i = 0; i < SAMPLE_RATE_COUNT; i++) {
         printf("%d: %dHz\n", i, SAMPLE_RATES[i]);
     }
 }
@@ -23,17 +49,53 @@ int main(int argc, char *argv[]) {
     char *ip = "0.0.0.0";
     int port = 6222;
     int sample_rate = 40;
+    double clock_bandwidth = CLOCK_DEFAULT_BANDWIDTH;
+    char *capture = NULL;
+    char *replay = NULL;
+    double replay_speed = 1.0;
+    double filter_low = FILTER_DEFAULT_LOW_HZ;
+    double filter_high = FILTER_DEFAULT_HIGH_HZ;
+    double sta = TRIGGER_DEFAULT_STA_SEC;
+    double lta = TRIGGER_DEFAULT_LTA_SEC;
+    double trigger_on = TRIGGER_DEFAULT_ON;
+    double trigger_off = TRIGGER_DEFAULT_OFF;
+    int keep_full = 0;
+    int keep_decimated = 0;
+    int tier_rate = 0;
+    int recent = RECENT_DEFAULT_MINUTES;
+    int metrics_port = 0;
+    char *log_file = NULL;
+    int log_size = LOG_DEFAULT_FILE_SIZE_MB;
+    bool huge_pages = false;
     static struct option long_options[] = {
         { "serial", required_argument, 0, 's' },
         { "ip", required_argument, 0, 'i' },
         { "port", required_argument, 0, 'p' },
         { "sample_rate", required_argument, 0, 'r' },
+        { "bandwidth", required_argument, 0, 'b' },
+        { "capture", required_argument, 0, 'c' },
+        { "replay", required_argument, 0, 'R' },
+        { "replay_speed", required_argument, 0, 'x' },
+        { "filter", required_argument, 0, 'f' },
+        { "sta", required_argument, 0, OPTION_STA },
+        { "lta", required_argument, 0, OPTION_LTA },
+        { "trigger_on", required_argument, 0, OPTION_TRIGGER_ON },
+        { "trigger_off", required_argument, 0, OPTION_TRIGGER_OFF },
+        { "keep_full", required_argument, 0, OPTION_KEEP_FULL },
+        { "keep_decimated", required_argument, 0, OPTION_KEEP_DECIMATED },
+        { "tier_rate", required_argument, 0, OPTION_TIER_RATE },
+        { "recent", required_argument, 0, OPTION_RECENT },
+        { "metrics_port", required_argument, 0, OPTION_METRICS_PORT },
+        { "log_file", required_argument, 0, OPTION_LOG_FILE },
+        { "log_size", required_argument, 0, OPTION_LOG_SIZE },
+        { "log_level", required_argument, 0, OPTION_LOG_LEVEL },
+        { "huge_pages", no_argument, 0, OPTION_HUGE_PAGES },
         { 0, 0, 0, 0 }
     };
 
     int opt = 0;
     int long_index = 0;
-    while ((opt = getopt_long(argc, argv, "s:i:p:r:", long_options, &long_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "s:i:p:r:b:c:R:x:f:", long_options, &long_index)) != -1) {
         switch (opt) {
         case 's':
             serial = optarg;
@@ -47,6 +109,66 @@ int main(int argc, char *argv[]) {
         case 'r':
             sample_rate = atoi(optarg);
             break;
+        case 'b':
+            clock_bandwidth = atof(optarg);
+            break;
+        case 'c':
+            capture = optarg;
+            break;
+        case 'R':
+            replay = optarg;
+            break;
+        case 'x':
+            replay_speed = atof(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "off") == 0) {
+                filter_low = 0;
+                filter_high = 0;
+            } else if (sscanf(optarg, "%lf:%lf", &filter_low, &filter_high) != 2) {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPTION_STA:
+            sta = atof(optarg);
+            break;
+        case OPTION_LTA:
+            lta = atof(optarg);
+            break;
+        case OPTION_TRIGGER_ON:
+            trigger_on = atof(optarg);
+            break;
+        case OPTION_TRIGGER_OFF:
+            trigger_off = atof(optarg);
+            break;
+        case OPTION_KEEP_FULL:
+            keep_full = atoi(optarg);
+            break;
+        case OPTION_KEEP_DECIMATED:
+            keep_decimated = atoi(optarg);
+            break;
+        case OPTION_TIER_RATE:
+            tier_rate = atoi(optarg);
+            break;
+        case OPTION_RECENT:
+            recent = atoi(optarg);
+            break;
+        case OPTION_METRICS_PORT:
+            metrics_port = atoi(optarg);
+            break;
+        case OPTION_LOG_FILE:
+            log_file = optarg;
+            break;
+        case OPTION_LOG_SIZE:
+            log_size = atoi(optarg);
+            break;
+        case OPTION_LOG_LEVEL:
+            log_level = atoi(optarg);
+            break;
+        case OPTION_HUGE_PAGES:
+            huge_pages = true;
+            break;
         default:
             print_usage();
             return EXIT_FAILURE;
@@ -54,7 +176,7 @@ int main(int argc, char *argv[]) {
     }
 
     int sample_rate_id = -1;
-    for (int i = 0; i < 5; i++) {
+    for (int i = 0; i < SAMPLE_RATE_COUNT; i++) {
         if (SAMPLE_RATES[i] == sample_rate) {
             sample_rate_id = i;
         }
@@ -65,20 +187,54 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    if (clock_bandwidth <= 0 || sta <= 0 || lta <= sta || trigger_off >= trigger_on) {
+        print_usage();
+        exit(1);
+    }
+
     SAMPLES_PER_SECOND = sample_rate;
-    SAMPLE_TIME_MS = 1000 / SAMPLES_PER_SECOND;
     SAMPLES_IN_HOUR = SAMPLES_PER_SECOND * 60 * 60;
 
+    // 0 keeps the tier forever, the decimated tier has to outlive the full rate one
+    if (tier_rate == 0) {
+        tier_rate = sample_rate / RETENTION_DEFAULT_TIER_FACTOR;
+    }
+    if (keep_full < 0 || keep_decimated < 0 || (keep_decimated > 0 && keep_decimated <= keep_full) || !decimation_rate_valid(tier_rate) || recent < 0 || metrics_port < 0 || log_size < 0 || log_level < ZEJF_LOG_DEBUG || log_level > ZEJF_LOG_CRITICAL + 1) {
+        print_usage();
+        exit(1);
+    }
+
     ZEJF_LOG(1, "Starting ZejfSeis Server with serial port %s, ip %s:%d\n", serial, ip, port);
 
     String *ip_string = string_create(ip);
     String *serial_string = string_create(serial);
+    String *capture_string = capture != NULL ? string_create(capture) : NULL;
+    String *replay_string = replay != NULL ? string_create(replay) : NULL;
+    String *log_file_string = log_file != NULL ? string_create(log_file) : NULL;
 
     Options options = {
         .ip_address = ip_string,
         .port = port,
         .serial = serial_string,
-        .sample_rate_id = sample_rate_id
+        .sample_rate_id = sample_rate_id,
+        .clock_bandwidth = clock_bandwidth,
+        .capture_file = capture_string,
+        .replay_file = replay_string,
+        .replay_speed = replay_speed,
+        .filter_low_hz = filter_low,
+        .filter_high_hz = filter_high,
+        .trigger_sta_sec = sta,
+        .trigger_lta_sec = lta,
+        .trigger_on = trigger_on,
+        .trigger_off = trigger_off,
+        .keep_full_days = keep_full,
+        .keep_decimated_days = keep_decimated,
+        .tier_rate = tier_rate,
+        .recent_minutes = recent,
+        .metrics_port = metrics_port,
+        .log_file = log_file_string,
+        .log_file_size_mb = log_size,
+        .huge_pages = huge_pages
     };
 
     //test2();
@@ -86,6 +242,9 @@ int main(int argc, char *argv[]) {
 
     string_destroy(ip_string);
     string_destroy(serial_string);
+    string_destroy(capture_string);
+    string_destroy(replay_string);
+    string_destroy(log_file_string);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "data.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "serial_reader.h"
+#include "server.h"
+#include "time_utils.h"
+
+Metrics metrics = { 0 };
+
+int metrics_fd = -1;
+
+void metrics_observe(Histogram *histogram, int64_t us) {
+    int bucket = 0;
+    int64_t bound = 1;
+    while (bucket < METRICS_BUCKETS && us > bound) {
+        bucket++;
+        bound *= 4;
+    }
+    METRIC_ADD(histogram->buckets[bucket], 1);
+    METRIC_ADD(histogram->count, 1);
+    METRIC_ADD(histogram->sum_us, us > 0 ? us : 0);
+}
+
+// only a contended lock pays for reading the clock
+void metrics_lock(pthread_mutex_t *lock, Histogram *wait) {
+    if (pthread_mutex_trylock(lock) == 0) {
+        metrics_observe(wait, 0);
+        return;
+    }
+    int64_t start = micros();
+    pthread_mutex_lock(lock);
+    metrics_observe(wait, micros() - start);
+}
+
+void metrics_print_histogram(const char *label, Histogram *histogram) {
+    printf("    %s:", label);
+    int64_t bound = 1;
+    for (int bucket = 0; bucket <= METRICS_BUCKETS; bucket++) {
+        uint64_t count = METRIC_GET(histogram->buckets[bucket]);
+        if (count > 0 && bucket < METRICS_BUCKETS) {
+            printf(" <=%ldus:%lu", bound, count);
+        } else if (count > 0) {
+            printf(" more:%lu", count);
+        }
+        bound *= 4;
+    }
+    printf("\n");
+}
+
+void write_metric(FILE *out, const char *name, const char *type, const char *help, double value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+void write_histogram(FILE *out, const char *name, const char *label, Histogram *histogram) {
+    uint64_t cumulative = 0;
+    double bound = 1e-6;
+    for (int bucket = 0; bucket <= METRICS_BUCKETS; bucket++) {
+        cumulative += METRIC_GET(histogram->buckets[bucket]);
+        if (bucket < METRICS_BUCKETS) {
+            fprintf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, label, *label ? "," : "", bound, cumulative);
+        } else {
+            fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, *label ? "," : "", cumulative);
+        }
+        bound *= 4;
+    }
+    fprintf(out, "%s_sum%s%s%s %.6f\n", name, *label ? "{" : "", label, *label ? "}" : "", METRIC_GET(histogram->sum_us) / 1e6);
+    fprintf(out, "%s_count%s%s%s %lu\n", name, *label ? "{" : "", label, *label ? "}" : "", METRIC_GET(histogram->count));
+}
+
+void write_histogram_header(FILE *out, const char *name, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+}
+
+void write_metrics(FILE *out) {
+    write_metric(out, "zejf_ingested_samples_total", "counter", "Samples stored by the queue thread", METRIC_GET(metrics.ingested_samples));
+    write_metric(out, "zejf_queue_depth", "gauge", "Samples waiting in the log queue at the last pass", METRIC_GET(metrics.queue_depth));
+    write_metric(out, "zejf_serial_timing_diff_seconds", "gauge", "Phase error of the serial clock loop", METRIC_GET(metrics.serial_diff_us) / 1e6);
+    write_metric(out, "zejf_datahour_cache_hits_total", "counter", "DataHour lookups answered from memory", METRIC_GET(metrics.datahour_hits));
+    write_metric(out, "zejf_datahour_cache_misses_total", "counter", "DataHour lookups that went to disk", METRIC_GET(metrics.datahour_misses));
+    write_metric(out, "zejf_datahours_loaded", "gauge", "DataHours in memory", datahours_count());
+    write_metric(out, "zejf_gaps_total", "counter", "Gaps in the sample stream", statistics.gaps);
+    write_metric(out, "zejf_queue_overflows_total", "counter", "Samples dropped because the log queue was full", statistics.queue_overflows);
+
+    write_histogram_header(out, "zejf_ingest_latency_seconds", "Time from serial arrival to storage");
+    write_histogram(out, "zejf_ingest_latency_seconds", "", &metrics.ingest_latency);
+    write_histogram_header(out, "zejf_realtime_latency_seconds", "Time from serial arrival to a realtime write");
+    write_histogram(out, "zejf_realtime_latency_seconds", "", &metrics.realtime_latency);
+    write_histogram_header(out, "zejf_save_duration_seconds", "Time to write one DataHour");
+    write_histogram(out, "zejf_save_duration_seconds", "", &metrics.save_duration);
+    write_histogram_header(out, "zejf_lock_wait_seconds", "Time spent waiting for a lock");
+    write_histogram(out, "zejf_lock_wait_seconds", "lock=\"data\"", &metrics.data_lock_wait);
+    write_histogram(out, "zejf_lock_wait_seconds", "lock=\"log_queue\"", &metrics.log_queue_lock_wait);
+
+    server_write_metrics(out);
+}
+
+void serve_metrics(int socket) {
+    struct timeval timeout = { METRICS_TIMEOUT_SEC, 0 };
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[METRICS_REQUEST_MAX];
+    if (read(socket, request, sizeof(request)) <= 0) {
+        return;
+    }
+
+    char *body = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&body, &size);
+    if (out == NULL) {
+        perror("open_memstream");
+        return;
+    }
+    write_metrics(out);
+    fclose(out);
+
+    char header[128];
+    int len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %ld\r\n\r\n", size);
+    if (write(socket, header, len) <= 0 || write(socket, body, size) < 0) {
+        perror("write");
+    }
+    free(body);
+}
+
+// Plain HTTP/1.0, every request gets the metrics and the connection is closed
+void *run_metrics(void *arg) {
+    Options *opts = (Options *) arg;
+    int opt = 1;
+
+    if ((metrics_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        ZEJF_LOG(2, "Unable to open metrics socket: %s\n", strerror(errno));
+        pthread_exit(0);
+    }
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr(opts->ip_address->data);
+    address.sin_port = htons(opts->metrics_port);
+
+    if (bind(metrics_fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(metrics_fd, 4) < 0) {
+        ZEJF_LOG(2, "Unable to open metrics on port %d: %s\n", opts->metrics_port, strerror(errno));
+        pthread_exit(0);
+    }
+    ZEJF_LOG(1, "Metrics on %s:%d\n", opts->ip_address->data, opts->metrics_port);
+
+    while (true) {
+        int socket = accept(metrics_fd, NULL, NULL);
+        if (socket < 0) {
+            ZEJF_LOG(1, "Metrics closed: %s\n", strerror(errno));
+            pthread_exit(0);
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        serve_metrics(socket);
+        close(socket);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+}
+
+void metrics_close(void) {
+    if (metrics_fd != -1) {
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+}
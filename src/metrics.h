@@ -0,0 +1,54 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// bucket k counts observations up to 4^k microseconds, the last one is +Inf
+#define METRICS_BUCKETS 16
+#define METRICS_REQUEST_MAX 1024
+#define METRICS_TIMEOUT_SEC 2
+
+// Updated with relaxed atomics from any thread, read by the metrics thread
+typedef struct histogram_t
+{
+    uint64_t buckets[METRICS_BUCKETS + 1];
+    uint64_t count;
+    uint64_t sum_us;
+} Histogram;
+
+typedef struct metrics_t
+{
+    uint64_t ingested_samples;
+    int64_t queue_depth;
+    int64_t serial_diff_us;
+    int64_t last_ingest_us; // arrival time of the newest stored sample
+    uint64_t datahour_hits; // both only change with data_lock held
+    uint64_t datahour_misses;
+    uint64_t saves;
+
+    Histogram ingest_latency;
+    Histogram realtime_latency;
+    Histogram save_duration;
+    Histogram data_lock_wait;
+    Histogram log_queue_lock_wait;
+} Metrics;
+
+extern Metrics metrics;
+
+#define METRIC_ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+#define METRIC_SET(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define METRIC_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void metrics_observe(Histogram *histogram, int64_t us);
+
+void metrics_lock(pthread_mutex_t *lock, Histogram *wait);
+
+void metrics_print_histogram(const char *label, Histogram *histogram);
+
+void *run_metrics(void *arg);
+
+void metrics_close(void);
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "data.h"
+#include "lock_profile.h"
+#include "recent.h"
+#include "time_utils.h"
+
+pthread_mutex_t recent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+RecentRing recent_rings[STREAM_COUNT];
+int64_t recent_window = 0;
+
+size_t recent_text_max(void) {
+    // the offsets are 32 bit
+    return MIN((size_t) recent_window * RECENT_LINE_TYPICAL, (size_t) UINT32_MAX);
+}
+
+void recent_init(int minutes) {
+    recent_window = (int64_t) minutes * 60 * SAMPLES_PER_SECOND;
+}
+
+// doubles both buffers and moves the lines to the start of the text
+bool recent_grow(RecentRing *ring) {
+    size_t capacity = ring->capacity == 0 ? (size_t) RECENT_INITIAL_SECONDS * SAMPLES_PER_SECOND : ring->capacity * 2;
+    capacity = MIN(capacity, (size_t) recent_window);
+    size_t text_size = MIN(MAX(capacity * RECENT_LINE_TYPICAL, ring->text_size), recent_text_max());
+    // the growth stops at the window
+    if (capacity == ring->capacity && text_size == ring->text_size) {
+        return false;
+    }
+
+    char *text = malloc(text_size);
+    int64_t *log_ids = malloc(capacity * sizeof(int64_t));
+    uint32_t *offsets = malloc(capacity * sizeof(uint32_t));
+    if (text == NULL || log_ids == NULL || offsets == NULL) {
+        perror("malloc");
+        free(text);
+        free(log_ids);
+        free(offsets);
+        return false;
+    }
+
+    size_t length = 0;
+    if (ring->count > 0) {
+        size_t start = ring->offsets[ring->first];
+        bool wrapped = start >= ring->text_head;
+        size_t first_part = wrapped ? ring->text_end - start : ring->text_head - start;
+        memcpy(text, ring->text + start, first_part);
+        memcpy(text + first_part, ring->text, wrapped ? ring->text_head : 0);
+        length = first_part + (wrapped ? ring->text_head : 0);
+        for (size_t i = 0; i < ring->count; i++) {
+            size_t slot = (ring->first + i) % ring->capacity;
+            log_ids[i] = ring->log_ids[slot];
+            offsets[i] = ring->offsets[slot] >= start ? ring->offsets[slot] - start : ring->offsets[slot] + first_part;
+        }
+    }
+
+    free(ring->text);
+    free(ring->log_ids);
+    free(ring->offsets);
+    ring->text = text;
+    ring->text_size = text_size;
+    ring->text_head = length;
+    ring->text_end = 0;
+    ring->log_ids = log_ids;
+    ring->offsets = offsets;
+    ring->capacity = capacity;
+    ring->first = 0;
+    return true;
+}
+
+// where the next line of len bytes goes, or false if the oldest line is in the way
+bool recent_fits(RecentRing *ring, size_t len) {
+    if (ring->count == 0) {
+        ring->text_head = 0;
+        ring->text_end = 0;
+        return len <= ring->text_size;
+    }
+    size_t oldest = ring->offsets[ring->first];
+    if (oldest >= ring->text_head) {
+        return ring->text_head + len <= oldest;
+    }
+    if (ring->text_head + len <= ring->text_size) {
+        return true;
+    }
+    if (len <= oldest) {
+        ring->text_end = ring->text_head;
+        ring->text_head = 0;
+        return true;
+    }
+    return false;
+}
+
+void recent_evict(RecentRing *ring) {
+    ring->first = (ring->first + 1) % ring->capacity;
+    ring->count--;
+}
+
+// samples that are not newer than the newest one in the ring are ignored
+void recent_push(int stream, int64_t *log_ids, int32_t *values, size_t count) {
+    if (recent_window <= 0) {
+        return;
+    }
+
+    RecentRing *ring = &recent_rings[stream];
+    char line[RECENT_LINE_MAX + 1];
+
+    MUTEX_LOCK(&recent_lock);
+    for (size_t i = 0; i < count; i++) {
+        if (values[i] == ERR_VAL) {
+            continue;
+        }
+        if (ring->count > 0 && log_ids[i] <= ring->log_ids[(ring->first + ring->count - 1) % ring->capacity]) {
+            continue;
+        }
+
+        while (ring->count > 0 && ring->log_ids[ring->first] <= log_ids[i] - recent_window) {
+            recent_evict(ring);
+        }
+
+        int len = snprintf(line, sizeof(line), "%d\n%ld\n", values[i], log_ids[i]);
+        while (ring->count == ring->capacity || !recent_fits(ring, len)) {
+            if (!recent_grow(ring)) {
+                if (ring->count == 0) {
+                    break;
+                }
+                recent_evict(ring);
+            }
+        }
+        if (ring->capacity == 0 || !recent_fits(ring, len)) {
+            continue;
+        }
+
+        size_t slot = (ring->first + ring->count) % ring->capacity;
+        ring->log_ids[slot] = log_ids[i];
+        ring->offsets[slot] = ring->text_head;
+        memcpy(ring->text + ring->text_head, line, len);
+        ring->text_head += len;
+        ring->count++;
+    }
+    MUTEX_UNLOCK(&recent_lock);
+}
+
+// Returns the whole "logs" message with the samples from first_log_id on, or
+// NULL if the ring has none. oldest_log_id is set to the oldest sample the
+// ring holds, so that the caller can request the older part from storage.
+char *recent_read(int stream, int64_t first_log_id, size_t *size, int64_t *oldest_log_id) {
+    *oldest_log_id = INT64_MAX;
+    if (recent_window <= 0) {
+        return NULL;
+    }
+
+    RecentRing *ring = &recent_rings[stream];
+    char terminator[16];
+    int terminator_len = snprintf(terminator, sizeof(terminator), "%d\n", ERR_VAL);
+    char *message = NULL;
+
+    MUTEX_LOCK(&recent_lock);
+    if (ring->count == 0) {
+        goto unlock;
+    }
+    *oldest_log_id = ring->log_ids[ring->first];
+
+    size_t low = 0;
+    size_t high = ring->count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (ring->log_ids[(ring->first + mid) % ring->capacity] < first_log_id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == ring->count) {
+        goto unlock;
+    }
+
+    size_t start = ring->offsets[(ring->first + low) % ring->capacity];
+    bool wrapped = start >= ring->text_head;
+    size_t first_part = wrapped ? ring->text_end - start : ring->text_head - start;
+    size_t second_part = wrapped ? ring->text_head : 0;
+
+    *size = 5 + first_part + second_part + terminator_len;
+    message = malloc(*size);
+    if (message == NULL) {
+        perror("malloc");
+        goto unlock;
+    }
+
+    memcpy(message, "logs\n", 5);
+    memcpy(message + 5, ring->text + start, first_part);
+    memcpy(message + 5 + first_part, ring->text, second_part);
+    memcpy(message + 5 + first_part + second_part, terminator, terminator_len);
+
+unlock:
+    MUTEX_UNLOCK(&recent_lock);
+    return message;
+}
+
+void recent_destroy(void) {
+    MUTEX_LOCK(&recent_lock);
+    for (int stream = 0; stream < STREAM_COUNT; stream++) {
+        RecentRing *ring = &recent_rings[stream];
+        free(ring->text);
+        free(ring->log_ids);
+        free(ring->offsets);
+        memset(ring, 0, sizeof(RecentRing));
+    }
+    MUTEX_UNLOCK(&recent_lock);
+}
@@ -0,0 +1,44 @@
+#ifndef RECENT_H
+#define RECENT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECENT_DEFAULT_MINUTES 10
+// "%d\n%ld\n" of the widest value and log_id
+#define RECENT_LINE_MAX 33
+// a 7 digit value and a 12 digit log_id, the text is sized for these
+#define RECENT_LINE_TYPICAL 24
+#define RECENT_INITIAL_SECONDS 60
+
+// The newest samples of one stream, already formatted the way send_logs
+// writes them. Lines have different lengths, so the text wraps around as a
+// whole line and text_end marks where the valid text before the wrap ends.
+// Both buffers start at a minute and double until they hold the window, if
+// the lines are longer than typical the oldest ones make room.
+typedef struct recent_ring_t
+{
+    char *text;
+    size_t text_size;
+    size_t text_head;
+    size_t text_end;
+
+    int64_t *log_ids;
+    uint32_t *offsets;
+    size_t capacity;
+    size_t first;
+    size_t count;
+} RecentRing;
+
+extern pthread_mutex_t recent_lock;
+
+void recent_init(int minutes);
+
+void recent_push(int stream, int64_t *log_ids, int32_t *values, size_t count);
+
+char *recent_read(int stream, int64_t first_log_id, size_t *size, int64_t *oldest_log_id);
+
+void recent_destroy(void);
+
+#endif
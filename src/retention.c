@@ -0,0 +1,353 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "data.h"
+#include "decimator.h"
+#include "hour_index.h"
+#include "lock_profile.h"
+#include "my_string.h"
+#include "retention.h"
+#include "scheduler.h"
+#include "time_utils.h"
+
+// hours below these were already handled, kept in RETENTION_FILE
+int32_t converted_below = INT32_MIN;
+int32_t dropped_below = INT32_MIN;
+
+void get_retention_path(char *path, size_t size, char *suffix) {
+    snprintf(path, size, "%s%d_sps/%s%s", MAIN_FOLDER, SAMPLES_PER_SECOND, RETENTION_FILE, suffix);
+}
+
+void retention_init(void) {
+    char path[128];
+    get_retention_path(path, sizeof(path), "");
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return;
+    }
+    int32_t limits[2];
+    if (fread(limits, sizeof(int32_t), 2, file) == 2) {
+        converted_below = limits[0];
+        dropped_below = limits[1];
+    }
+    fclose(file);
+}
+
+void retention_save(void) {
+    char path[128];
+    char tmp_path[128];
+    get_retention_path(path, sizeof(path), "");
+    get_retention_path(tmp_path, sizeof(tmp_path), ".tmp");
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        perror(tmp_path);
+        return;
+    }
+    int32_t limits[2] = { converted_below, dropped_below };
+    bool result = fwrite(limits, sizeof(int32_t), 2, file) == 2;
+    result = fclose(file) == 0 && result;
+    if (!result || rename(tmp_path, path) != 0) {
+        perror(path);
+        unlink(tmp_path);
+    }
+}
+
+// decimated or removed, the full rate samples are gone
+bool retention_tiered(int32_t hour_id) {
+    return hour_id < converted_below;
+}
+
+String *get_tier_path(int stream, int32_t hour_id) {
+    String *path = get_datahour_path_newest(stream, hour_id);
+    if (path == NULL) {
+        return NULL;
+    }
+    strcpy(strrchr(path->data, '.'), ".dec");
+    return path;
+}
+
+// the decimated samples end up at their log_ids, everything between is missing
+DataHour *tier_load(int stream, int32_t hour_id) {
+    String *path = get_tier_path(stream, hour_id);
+    if (path == NULL) {
+        return NULL;
+    }
+
+    FILE *file = fopen(path->data, "rb");
+    if (file == NULL) {
+        string_destroy(path);
+        return NULL;
+    }
+
+    TierHeader header;
+    DataHour *dh = NULL;
+    int32_t *samples = NULL;
+    if (fread(&header, sizeof(TierHeader), 1, file) != 1 || header.hour_id != hour_id || header.factor <= 0 || SAMPLES_IN_HOUR % header.factor != 0) {
+        ZEJF_LOG(2, "Invalid tier file %s\n", path->data);
+        goto cleanup;
+    }
+
+    size_t count = SAMPLES_IN_HOUR / header.factor;
+    samples = malloc(count * sizeof(int32_t));
+    if (samples == NULL) {
+        perror("malloc");
+        goto cleanup;
+    }
+
+    if (fread(samples, sizeof(int32_t), count, file) != count) {
+        ZEJF_LOG(2, "Tier file %s is truncated\n", path->data);
+        goto cleanup;
+    }
+
+    dh = datahour_create(stream, hour_id);
+    if (dh == NULL) {
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        datahour_set(dh, i * header.factor, samples[i]);
+        if (samples[i] != ERR_VAL) {
+            dh->sample_count++;
+        }
+    }
+    dh->tier_factor = header.factor;
+    datahour_compute_digests(dh);
+    ZEJF_LOG(1, "Load %s\n", path->data);
+
+cleanup:
+    free(samples);
+    fclose(file);
+    string_destroy(path);
+    return dh;
+}
+
+// Anti-aliasing filter centered on each kept sample. Near gaps and the edges
+// of the hour the available taps are renormalized, outputs that would rely
+// on less than half of the filter are dropped.
+bool tier_write(DataHour *dh, int factor, char *path) {
+    Fir fir;
+    if (!fir_init(&fir, factor)) {
+        return false;
+    }
+
+    size_t count = SAMPLES_IN_HOUR / factor;
+    int32_t *samples = malloc(count * sizeof(int32_t));
+    if (samples == NULL) {
+        perror("malloc");
+        fir_destroy(&fir);
+        return false;
+    }
+
+    // the hour is a private copy, widening it is fine
+    int32_t *values = datahour_widen(dh);
+    TierHeader header = { dh->hour_id, factor, 0, 0 };
+    for (size_t k = 0; k < count; k++) {
+        int64_t center = (int64_t) k * factor;
+        samples[k] = ERR_VAL;
+        if (values[center] == ERR_VAL) {
+            continue;
+        }
+
+        double sum = 0;
+        double weight = 0;
+        int64_t first = center - fir.half;
+        for (int j = 0; j < fir.taps; j++) {
+            int64_t index = first + j;
+            if (index < 0 || index >= SAMPLES_IN_HOUR || values[index] == ERR_VAL) {
+                continue;
+            }
+            sum += fir.coefficients[j] * (double) values[index];
+            weight += fir.coefficients[j];
+        }
+
+        if (weight >= RETENTION_MIN_WEIGHT) {
+            samples[k] = (int32_t) lround(sum / weight);
+            header.sample_count++;
+        }
+    }
+    fir_destroy(&fir);
+
+    FILE *file = fopen(path, "wb");
+    bool result = file != NULL;
+    if (file == NULL) {
+        perror(path);
+    } else {
+        result = fwrite(&header, sizeof(TierHeader), 1, file) == 1 && fwrite(samples, sizeof(int32_t), count, file) == count;
+        result = fclose(file) == 0 && result;
+        if (!result) {
+            perror(path);
+        }
+    }
+
+    free(samples);
+    return result;
+}
+
+// data_lock must be held, nothing can load the hour while it is
+bool hour_loaded(int32_t hour_id) {
+    bool loaded = false;
+    for (int stream = 0; stream < STREAM_COUNT; stream++) {
+        loaded |= get_datahour(stream, hour_id, false, false) != NULL;
+    }
+    return loaded;
+}
+
+bool same_file(struct stat *a, struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// The decimated copy is written next to the full rate file without any lock.
+// The swap happens under data_lock and only if the hour is still unloaded and
+// its file wasn't saved in the meantime. False if it has to wait.
+bool convert_hour(int stream, int32_t hour_id) {
+    String *path = get_datahour_path_newest(stream, hour_id);
+    String *tier_path = get_tier_path(stream, hour_id);
+    if (path == NULL || tier_path == NULL) {
+        string_destroy(path);
+        string_destroy(tier_path);
+        return true;
+    }
+    String *tmp_path = string_create(tier_path->data);
+    string_append(tmp_path, ".tmp");
+
+    bool result = true;
+    struct stat before;
+    FILE *file = stat(path->data, &before) == 0 ? fopen(path->data, "rb") : NULL;
+    if (file != NULL) {
+        DataHour *dh = datahour_load(file, stream);
+        fclose(file);
+
+        bool written = dh != NULL && dh->hour_id == hour_id && tier_write(dh, SAMPLES_PER_SECOND / options->tier_rate, tmp_path->data);
+        datahour_destroy(dh);
+
+        bool replaced = false;
+        if (written) {
+            struct stat after;
+            MUTEX_LOCK(&data_lock);
+            result = !hour_loaded(hour_id) && stat(path->data, &after) == 0 && same_file(&before, &after);
+            if (result && rename(tmp_path->data, tier_path->data) != 0) {
+                perror("rename");
+            } else if (result) {
+                if (unlink(path->data) != 0) {
+                    perror(path->data);
+                }
+                replaced = true;
+            }
+            MUTEX_UNLOCK(&data_lock);
+        }
+        if (!replaced) {
+            unlink(tmp_path->data);
+        }
+
+        // the index describes what is stored now
+        DataHour *tier = replaced ? tier_load(stream, hour_id) : NULL;
+        if (tier != NULL) {
+            HourIndex entry;
+            hour_index_compute(tier, &entry);
+            hour_index_update(&entry);
+            datahour_destroy(tier);
+            ZEJF_LOG(1, "Decimated %s to %d sps\n", path->data, options->tier_rate);
+        }
+    }
+    string_destroy(path);
+    string_destroy(tier_path);
+    string_destroy(tmp_path);
+    return result;
+}
+
+// only the hour index and the spectra are left, false if the hour is loaded
+bool drop_hour(int32_t hour_id) {
+    MUTEX_LOCK(&data_lock);
+    bool loaded = hour_loaded(hour_id);
+    for (int stream = 0; !loaded && stream < STREAM_COUNT; stream++) {
+        String *paths[2] = { get_datahour_path_newest(stream, hour_id), get_tier_path(stream, hour_id) };
+        for (int i = 0; i < 2; i++) {
+            if (paths[i] != NULL && unlink(paths[i]->data) == 0) {
+                ZEJF_LOG(1, "Removed %s\n", paths[i]->data);
+            } else if (paths[i] != NULL && errno != ENOENT) {
+                perror(paths[i]->data);
+            }
+            string_destroy(paths[i]);
+        }
+    }
+    MUTEX_UNLOCK(&data_lock);
+    return !loaded;
+}
+
+// Processes the hours in [*done_below, limit) and moves *done_below up to the
+// first hour it could not finish. Returns true if it stopped early.
+bool retention_stage(int32_t *hour_ids, size_t count, int32_t *done_below, int32_t limit, bool drop) {
+    int processed = 0;
+    bool finished = true;
+    for (size_t i = 0; i < count && hour_ids[i] < limit; i++) {
+        int32_t hour_id = hour_ids[i];
+        if (hour_id < *done_below) {
+            continue;
+        }
+        if (processed == RETENTION_MAX_HOURS_PER_PASS) {
+            return true;
+        }
+        bool done = true;
+        if (drop) {
+            done = drop_hour(hour_id);
+        } else {
+            for (int stream = 0; stream < STREAM_COUNT; stream++) {
+                done &= convert_hour(stream, hour_id);
+            }
+        }
+        if (!done) {
+            finished = false;
+            continue;
+        }
+        processed++;
+        if (finished) {
+            *done_below = hour_id + 1;
+        }
+    }
+
+    if (finished) {
+        *done_below = limit;
+    }
+    return false;
+}
+
+// Moves hours older than the configured limits down a tier. Returns true if
+// there is more work left for the next call.
+bool run_retention(void) {
+    if (options->keep_full_days <= 0) {
+        return false;
+    }
+
+    size_t count;
+    int32_t *hour_ids = hour_index_list(STREAM_RAW, &count);
+    if (hour_ids == NULL) {
+        return false;
+    }
+
+    int32_t now = hours();
+    int32_t full_limit = now - options->keep_full_days * 24;
+    int32_t decimated_limit = options->keep_decimated_days > 0 ? now - options->keep_decimated_days * 24 : INT32_MIN;
+
+    int32_t old_converted_below = converted_below;
+    int32_t old_dropped_below = dropped_below;
+    bool more = false;
+    if (decimated_limit != INT32_MIN) {
+        more |= retention_stage(hour_ids, count, &dropped_below, decimated_limit, true);
+    }
+    converted_below = MAX(converted_below, dropped_below);
+    if (!more) {
+        more = retention_stage(hour_ids, count, &converted_below, full_limit, false);
+    }
+
+    free(hour_ids);
+    if (converted_below != old_converted_below || dropped_below != old_dropped_below) {
+        retention_save();
+    }
+    return more;
+}
@@ -0,0 +1,33 @@
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "data.h"
+
+#define RETENTION_FILE "retention.dat"
+#define RETENTION_DEFAULT_TIER_FACTOR 10
+#define RETENTION_INTERVAL_MINUTES 10
+#define RETENTION_MAX_HOURS_PER_PASS 24
+#define RETENTION_MIN_WEIGHT 0.5
+
+// Decimated copy of an hour, one sample per factor log_ids starting at the
+// first log_id of the hour
+typedef struct tier_header_t
+{
+    int32_t hour_id;
+    int32_t factor;
+    int32_t sample_count;
+    int32_t reserved;
+} TierHeader;
+
+DataHour *tier_load(int stream, int32_t hour_id);
+
+void retention_init(void);
+
+bool retention_tiered(int32_t hour_id);
+
+bool run_retention(void);
+
+#endif
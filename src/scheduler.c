@@ -6,16 +6,31 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "clock_discipline.h"
 #include "data.h"
+#include "decimator.h"
+#include "hour_index.h"
+#include "hour_pool.h"
+#include "lock_profile.h"
+#include "metrics.h"
+#include "recent.h"
+#include "retention.h"
 #include "scheduler.h"
 #include "serial_reader.h"
 #include "server.h"
+#include "spectrum.h"
 #include "time_utils.h"
+#include "trace.h"
+#include "trigger.h"
 
 pthread_t serial_reader_thread;
 pthread_t log_queue_thread;
 
 pthread_t data_manager_thread;
+pthread_t spectrum_thread;
+pthread_t scrubber_thread;
+bool scrubber_started = false;
+pthread_t metrics_thread;
 
 pthread_t server_thread;
 pthread_t server_watchdog_thread;
@@ -32,7 +47,11 @@ void open_port() {
         pthread_join(serial_reader_thread, NULL);
         serial_port_needs_join = false;
     }
-    pthread_create(&serial_reader_thread, NULL, run_serial, options->serial->data);
+    if (options->replay_file != NULL) {
+        pthread_create(&serial_reader_thread, NULL, run_replay, options->replay_file->data);
+    } else {
+        pthread_create(&serial_reader_thread, NULL, run_serial, options->serial->data);
+    }
 }
 
 void close_port() {
@@ -83,17 +102,30 @@ void close_server() {
 void print_info() {
     printf("\n========= ZejfSeis Server v%s ===========\n", ZEJF_VERSION);
     printf("sample rate: %d sps\n", SAMPLES_PER_SECOND);
-    printf("serial port: %s\n", options->serial->data);
+    printf("serial port: %s\n", options->replay_file != NULL ? options->replay_file->data : options->serial->data);
     printf("server address: %s:%d\n", options->ip_address->data, options->port);
     printf("\nserial port open: %d\n", serial_port_running);
     printf("server open: %d\n", server_running);
+    int64_t indexed_samples;
+    size_t indexed_hours = hour_index_count(&indexed_samples);
     printf("\nloaded datahours: %ld\n", datahours_count());
+    printf("indexed hours: %ld (%ld samples)\n", indexed_hours, indexed_samples);
+    hour_pool_print();
     printf("maximum queue length: %ld\n", statistics.queue_max_length);
+    printf("queue overflows: %ld\n", statistics.queue_overflows);
+    printf("samples for decimated hours: %ld\n", statistics.tier_rejected);
     printf("gaps: %d\n", statistics.gaps);
     printf("arduino gaps: %d\n", statistics.arduino_gaps);
+    printf("clock loop bandwidth: %.4fHz\n", options->clock_bandwidth);
     printf("current serial port delay: %.3fms\n", last_avg_diff / 1000.0);
     printf("highest serial port delay: %.3fms\n", statistics.highest_avg_diff / 1000.0);
     printf("lowest serial port delay: %.3fms\n", statistics.lowest_avg_diff / 1000.0);
+    printf("calibration time: %.1fs\n", statistics.calibration_time_ms / 1000.0);
+    int64_t elapsed_ms = millis() - statistics.stored_since_ms;
+    printf("\nstored samples: %ld (%.1f sps)\n", statistics.stored_samples, elapsed_ms > 0 ? statistics.stored_samples * 1000.0 / elapsed_ms : 0);
+    printf("serial to storage latency: avg %.1fus, max %ldus\n",
+            statistics.ingest_latency_count > 0 ? statistics.ingest_latency_sum_us / (double) statistics.ingest_latency_count : 0,
+            statistics.ingest_latency_max_us);
     printf("\nactive connections: %ld\n", client_count());
     printf("================================\n\n");
 }
@@ -103,22 +135,52 @@ volatile bool stress_running = false;
 
 void *stress() {
     stress_count = 0;
-    int64_t start = (1663279200000l) / SAMPLE_TIME_MS;
-    int64_t end = (1672009200000l + 1000 * 60 * 60 * 24l) / SAMPLE_TIME_MS;
-    pthread_mutex_lock(&data_lock);
+    int64_t start = nanos_to_log_id(1663279200000l * 1000000l);
+    int64_t end = nanos_to_log_id((1672009200000l + 1000 * 60 * 60 * 24l) * 1000000l);
+    MUTEX_LOCK(&data_lock);
     while (start <= end) {
         int32_t hour_id = get_hour_id(start);
         printf("%d\n", hour_id);
-        DataHour *dh = get_datahour(hour_id, true, false);
+        DataHour *dh = get_datahour(STREAM_RAW, hour_id, true, false);
         if (dh != NULL) {
             dh->modified = true;
         }
-        start += (1000 * 60 * 60) / SAMPLE_TIME_MS;
+        start += SAMPLES_IN_HOUR;
     }
-    pthread_mutex_unlock(&data_lock);
+    MUTEX_UNLOCK(&data_lock);
     pthread_exit(0);
 }
 
+void clock_test(void) {
+    const double drifts[] = { 0, 50, -200 };
+    printf("clock discipline simulation, %d sps, bandwidth %.4fHz\n", SAMPLES_PER_SECOND, options->clock_bandwidth);
+    for (int i = 0; i < 3; i++) {
+        ClockSimulation sim = {
+            .sample_rate = SAMPLES_PER_SECOND,
+            .bandwidth = options->clock_bandwidth,
+            .drift_ppm = drifts[i],
+            .jitter_us = 2000,
+            .latency_us = 4000,
+            .duration_sec = 3600
+        };
+        clock_simulation_run(&sim);
+        printf("drift %+.0fppm: converged in %.1fs, steady state error mean %.1fus, rms %.1fus, peak %.1fus\n",
+                sim.drift_ppm, sim.convergence_sec, sim.steady_mean_us, sim.steady_rms_us, sim.steady_peak_us);
+    }
+}
+
+void start_scrubber(void) {
+    if (scrubber_running) {
+        printf("scrubber is already running\n");
+        return;
+    }
+    if (scrubber_started) {
+        pthread_join(scrubber_thread, NULL);
+    }
+    scrubber_running = true;
+    scrubber_started = true;
+    pthread_create(&scrubber_thread, NULL, run_scrubber, NULL);
+}
 
 void print_help(void) {
     printf("\n====== Available commands =======\n");
@@ -128,7 +190,12 @@ void print_help(void) {
     printf("openport - try to open serial port\n");
     printf("closeport - close serial port\n");
     printf("openserver - try to open TCP server\n");
-    printf("closeserver - close TCP server\n\n");
+    printf("closeserver - close TCP server\n");
+    printf("clocktest - simulate the clock discipline loop with a drifting oscillator\n");
+    printf("scrub - check all hour files in the background and rebuild the hour index\n");
+    printf("loglevel <level> - 0 logs everything, 1 info and errors, 2 only errors, 3 nothing\n");
+    printf("locks - print lock wait and hold times (needs a build with ZEJF_LOCK_PROFILE)\n");
+    printf("trace [on|off] - print the latency of samples from serial read to realtime write, or toggle tracing\n\n");
 }
 
 bool process_command(char *line) {
@@ -138,6 +205,21 @@ bool process_command(char *line) {
         print_help();
     } else if (strcmp(line, "info\n") == 0) {
         print_info();
+    } else if (strncmp(line, "loglevel ", 9) == 0) {
+        int level;
+        if (sscanf(line + 9, "%d", &level) == 1 && level >= ZEJF_LOG_DEBUG && level <= ZEJF_LOG_CRITICAL + 1) {
+            log_level = level;
+            printf("log level %d\n", level);
+        } else {
+            printf("log levels are %d (debug) to %d (nothing)\n", ZEJF_LOG_DEBUG, ZEJF_LOG_CRITICAL + 1);
+        }
+    } else if (strcmp(line, "locks\n") == 0) {
+        lock_profile_print();
+    } else if (strcmp(line, "trace\n") == 0) {
+        trace_print();
+    } else if (strcmp(line, "trace on\n") == 0 || strcmp(line, "trace off\n") == 0) {
+        trace_enabled = strcmp(line, "trace on\n") == 0;
+        printf("tracing %s\n", trace_enabled ? "on" : "off");
     } else if (strcmp(line, "openport\n") == 0 || strcmp(line, "port\n") == 0) {
         open_port();
     } else if (strcmp(line, "closeport\n") == 0 || strcmp(line, "close\n") == 0) {
@@ -154,12 +236,23 @@ bool process_command(char *line) {
         pthread_create(&stress_thread, NULL, stress, NULL);
         pthread_join(stress_thread, NULL);
         printf("done: %ldms\n", millis() - a);
+    } else if (strcmp(line, "clocktest\n") == 0) {
+        clock_test();
+    } else if (strcmp(line, "scrub\n") == 0) {
+        start_scrubber();
     } else if (strcmp(line, "resetstats\n") == 0) {
         statistics.arduino_gaps = 0;
         statistics.gaps = 0;
         statistics.highest_avg_diff = 0;
         statistics.lowest_avg_diff = 0;
         statistics.queue_max_length = 0;
+        statistics.queue_overflows = 0;
+        statistics.tier_rejected = 0;
+        statistics.stored_samples = 0;
+        statistics.stored_since_ms = millis();
+        statistics.ingest_latency_sum_us = 0;
+        statistics.ingest_latency_count = 0;
+        statistics.ingest_latency_max_us = 0;
         printf("statistics reset");
     } else {
         printf("Unknown command: %s", line);
@@ -188,9 +281,25 @@ void command_line() {
 
 void run_threads(Options *opts) {
     options = opts;
+    if (!logger_start(options->log_file != NULL ? options->log_file->data : NULL, (int64_t) options->log_file_size_mb * 1024 * 1024)) {
+        return;
+    }
+    statistics.stored_since_ms = millis();
 
     // init
+    hour_pool_init(options->huge_pages);
     data_init();
+    hour_index_init();
+    retention_init();
+    data_warm_start();
+    if (hour_index_needs_scrub()) {
+        ZEJF_LOG(1, "The hour index is empty, scrubbing the stored hours\n");
+        start_scrubber();
+    }
+    events_init();
+    decimators_init();
+    recent_init(options->recent_minutes);
+    spectrum_init();
     serial_init();
     server_init();
 
@@ -199,7 +308,11 @@ void run_threads(Options *opts) {
     pthread_create(&log_queue_thread, NULL, run_queue_thread, NULL);
     open_port();
     pthread_create(&data_manager_thread, NULL, run_data_manager, NULL);
+    pthread_create(&spectrum_thread, NULL, run_spectrum, NULL);
     pthread_create(&server_watchdog_thread, NULL, run_server_watchdog, NULL);
+    if (options->metrics_port > 0) {
+        pthread_create(&metrics_thread, NULL, run_metrics, options);
+    }
     open_server();
 
     command_line();
@@ -231,9 +344,28 @@ void zejf_exit(void) {
     pthread_cancel(data_manager_thread);
     pthread_join(data_manager_thread, NULL);
 
+    pthread_cancel(spectrum_thread);
+    pthread_join(spectrum_thread, NULL);
+
+    if (scrubber_started) {
+        pthread_cancel(scrubber_thread);
+        pthread_join(scrubber_thread, NULL);
+    }
+
+    if (options->metrics_port > 0) {
+        pthread_cancel(metrics_thread);
+        pthread_join(metrics_thread, NULL);
+        metrics_close();
+    }
+
     serial_reader_destroy();
     ZEJF_LOG(0, "serial reader destroyed\n");
 
     data_destroy();
+    hour_index_destroy();
+    events_destroy();
+    recent_destroy();
+    spectrum_destroy();
     ZEJF_LOG(0, "joined with data manager thread\n");
+    logger_stop();
 }
\ No newline at end of file
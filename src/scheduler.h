@@ -1,6 +1,9 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
+#include <stdint.h>
+
+#include "logger.h"
 #include "my_string.h"
 
 #define ZEJF_VERSION "1.5.1"
@@ -11,9 +14,10 @@
 #define ZEJF_LOG_INFO 1
 #define ZEJF_LOG_CRITICAL 2
 
+// default of the runtime log_level
 #define ZEJF_LOG_LEVEL 1
 #define ZEJF_LOG(p, x, ...)  \
-    do { if(p >= ZEJF_LOG_LEVEL) printf(x, ##__VA_ARGS__); } while(0)
+    do { if(p >= log_level) zejf_log(x, ##__VA_ARGS__); } while(0)
 
 
 typedef struct options_t
@@ -22,6 +26,24 @@ typedef struct options_t
     String *ip_address;
     int port;
     int sample_rate_id;
+    double clock_bandwidth;
+    String *capture_file;
+    String *replay_file;
+    double replay_speed;
+    double filter_low_hz;
+    double filter_high_hz;
+    double trigger_sta_sec;
+    double trigger_lta_sec;
+    double trigger_on;
+    double trigger_off;
+    int keep_full_days;
+    int keep_decimated_days;
+    int tier_rate;
+    int recent_minutes;
+    int metrics_port;
+    String *log_file;
+    int log_file_size_mb;
+    bool huge_pages;
 } Options;
 
 typedef struct statistics_t
@@ -29,8 +51,16 @@ typedef struct statistics_t
     size_t queue_max_length;
     int gaps;
     int arduino_gaps;
+    int64_t queue_overflows;
+    int64_t tier_rejected;
     double highest_avg_diff;
     double lowest_avg_diff;
+    int64_t stored_samples;
+    int64_t stored_since_ms;
+    int64_t calibration_time_ms;
+    int64_t ingest_latency_sum_us;
+    int64_t ingest_latency_count;
+    int64_t ingest_latency_max_us;
 } Statistics;
 
 extern Statistics statistics;
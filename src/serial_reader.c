@@ -18,18 +18,31 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 
+#include "capture.h"
+#include "clock_discipline.h"
 #include "data.h"
+#include "decimator.h"
+#include "filter.h"
+#include "lock_profile.h"
+#include "metrics.h"
+#include "recent.h"
 #include "scheduler.h"
 #include "serial_reader.h"
 #include "server.h"
 #include "time_utils.h"
-
-#define CALIBRATION_TRESHOLD 1500
+#include "trace.h"
+#include "trigger.h"
 
 LogQueue *log_queue;
 pthread_mutex_t log_queue_lock;
 
 sem_t log_queue_semaphore;
+// signalled whenever the queue thread frees slots
+pthread_cond_t log_queue_space = PTHREAD_COND_INITIALIZER;
+// set by the replay, which waits for room instead of losing samples
+volatile bool log_queue_blocking = false;
+bool log_queue_closed = false;
+bool log_queue_overflowing = false;
 
 volatile bool queue_thread_running = false;
 volatile bool serial_port_running = false;
@@ -51,7 +64,12 @@ int serial_init(void) {
 
 int64_t last_log_id = -1;
 
-void next_log(int32_t value, int64_t log_id) {
+void unlock_mutex(void *arg) {
+    MUTEX_UNLOCK((pthread_mutex_t *) arg);
+}
+
+// called with log_queue_lock held, wait makes a full queue block the caller
+void queue_log(int32_t value, int64_t log_id, bool wait) {
     if (last_log_id == -1) {
         last_log_id = log_id - 1;
     }
@@ -63,20 +81,79 @@ void next_log(int32_t value, int64_t log_id) {
 
     last_log_id = log_id;
 
+    // the queue thread reads the slots up to head without the lock, so a
+    // full queue drops the new sample instead of moving tail
+    if (wait) {
+        pthread_cleanup_push(unlock_mutex, &log_queue_lock);
+        while ((log_queue->head + 1) % LOG_QUEUE_SIZE == log_queue->tail && !log_queue_closed) {
+            // batches only post once they are queued, the queue thread has to run now
+            sem_post(&log_queue_semaphore);
+            COND_WAIT(&log_queue_space, &log_queue_lock);
+        }
+        pthread_cleanup_pop(0);
+    }
+    if ((log_queue->head + 1) % LOG_QUEUE_SIZE == log_queue->tail) {
+        if (!log_queue_overflowing) {
+            ZEJF_LOG(2, "Log queue overflow at log id %ld, dropping samples\n", log_id);
+            log_queue_overflowing = true;
+        }
+        statistics.queue_overflows++;
+        return;
+    }
+
+    int64_t now = micros();
     log_queue->logs[log_queue->head].log_id = log_id;
     log_queue->logs[log_queue->head].val = value;
+    log_queue->logs[log_queue->head].arrival_us = now;
 
     log_queue->head++;
     log_queue->head %= LOG_QUEUE_SIZE;
+    log_queue->head_time_us = now;
+}
+
+void next_log(int32_t value, int64_t log_id) {
+    queue_log(value, log_id, log_queue_blocking);
+}
+
+size_t next_logs(int64_t first_log_id, int32_t *values, size_t count) {
+    size_t skip = 0;
+    if (last_log_id != -1 && first_log_id <= last_log_id) {
+        skip = MIN(count, (size_t) (last_log_id - first_log_id + 1));
+        ZEJF_LOG(1, "dropped %ld samples from batch starting at %ld, last log id is %ld\n", skip, first_log_id, last_log_id);
+    }
+
+    // the client waits for room, the socket slows it down
+    for (size_t i = skip; i < count; i++) {
+        queue_log(values[i], first_log_id + i, true);
+    }
+
+    return count - skip;
+}
+
+int64_t batch_log_ids[LOG_QUEUE_SIZE];
+int32_t batch_values[LOG_QUEUE_SIZE];
+int32_t batch_filtered[LOG_QUEUE_SIZE];
+
+FilterChain filter_chain;
+bool filter_enabled = false;
 
-    if (log_queue->head == log_queue->tail) {
-        log_queue->tail++;
-        //TODO FATAL queue overflow
+Trigger trigger;
+
+// runs the filter over each stretch of consecutive log_ids in the batch
+void filter_batch(size_t count) {
+    size_t start = 0;
+    for (size_t i = 1; i <= count; i++) {
+        if (i == count || batch_log_ids[i] != batch_log_ids[i - 1] + 1) {
+            filter_process(&filter_chain, batch_log_ids[start], batch_values + start, batch_filtered + start, i - start);
+            start = i;
+        }
     }
 }
 
 void *run_queue_thread() {
     ZEJF_LOG(0, "QueueThread run\n");
+    filter_enabled = filter_init(&filter_chain, SAMPLES_PER_SECOND, options->filter_low_hz, options->filter_high_hz);
+    trigger_init(&trigger, SAMPLES_PER_SECOND, options->trigger_sta_sec, options->trigger_lta_sec, options->trigger_on, options->trigger_off);
     queue_thread_running = true;
     while (queue_thread_running) {
         sem_wait(&log_queue_semaphore);
@@ -85,12 +162,13 @@ void *run_queue_thread() {
             break;
         }
 
-        pthread_mutex_lock(&log_queue_lock);
+        MUTEX_LOCK_TIMED(&log_queue_lock, &metrics.log_queue_lock_wait);
 
         size_t head = log_queue->head;
         size_t tail = log_queue->tail;
+        int64_t head_time_us = log_queue->head_time_us;
 
-        pthread_mutex_unlock(&log_queue_lock);
+        MUTEX_UNLOCK(&log_queue_lock);
 
         if (head == tail) {
             continue;
@@ -107,22 +185,88 @@ void *run_queue_thread() {
         if (queue_length > statistics.queue_max_length) {
             statistics.queue_max_length = queue_length;
         }
+        METRIC_SET(metrics.queue_depth, (int64_t) queue_length);
 
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-        pthread_mutex_lock(&data_lock);
+        TraceBatch trace = { 0 };
+        if (trace_enabled) {
+            trace.dequeue_us = micros();
+            trace.arrival_us = log_queue->logs[tail].arrival_us;
+        }
 
+        size_t count = 0;
         while (tail != head) {
-            log_data(log_queue->logs[tail].log_id, log_queue->logs[tail].val);
+            batch_log_ids[count] = log_queue->logs[tail].log_id;
+            batch_values[count] = log_queue->logs[tail].val;
+            count++;
             tail++;
             tail %= LOG_QUEUE_SIZE;
         }
 
-        pthread_mutex_unlock(&data_lock);
+        if (filter_enabled) {
+            filter_batch(count);
+        }
+
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        MUTEX_LOCK_TIMED(&data_lock, &metrics.data_lock_wait);
+
+        for (size_t i = 0; i < count; i++) {
+            log_data(STREAM_RAW, batch_log_ids[i], batch_values[i]);
+            if (filter_enabled) {
+                log_data(STREAM_FILTERED, batch_log_ids[i], batch_filtered[i]);
+            }
+        }
+
+        MUTEX_UNLOCK(&data_lock);
+        if (trace_enabled) {
+            trace.stored_us = micros();
+        }
+
+        decimators_push(STREAM_RAW, batch_log_ids, batch_values, count);
+        if (filter_enabled) {
+            decimators_push(STREAM_FILTERED, batch_log_ids, batch_filtered, count);
+        }
+        recent_push(STREAM_RAW, batch_log_ids, batch_values, count);
+        if (filter_enabled) {
+            recent_push(STREAM_FILTERED, batch_log_ids, batch_filtered, count);
+        }
+
+        bool new_events = false;
+        for (size_t i = 0; i < count; i++) {
+            Event event;
+            if (trigger_update(&trigger, batch_log_ids[i], filter_enabled ? batch_filtered[i] : batch_values[i], &event)) {
+                events_push(&event);
+                new_events = true;
+            }
+        }
+
+        int64_t latency = micros() - head_time_us;
+        statistics.stored_samples += queue_length;
+        statistics.ingest_latency_sum_us += latency;
+        statistics.ingest_latency_count++;
+        if (latency > statistics.ingest_latency_max_us) {
+            statistics.ingest_latency_max_us = latency;
+        }
+        METRIC_ADD(metrics.ingested_samples, queue_length);
+        METRIC_SET(metrics.last_ingest_us, head_time_us);
+        metrics_observe(&metrics.ingest_latency, latency);
+        // recorded before the notify so that the output threads can find it
+        if (trace_enabled && trace.dequeue_us != 0) {
+            trace.notify_us = micros();
+            trace.first_log_id = batch_log_ids[0];
+            trace.last_log_id = batch_log_ids[count - 1];
+            trace.count = count;
+            trace_batch(&trace);
+        }
         server_realtime_notify();
+        if (new_events) {
+            server_events_notify();
+        }
 
-        pthread_mutex_lock(&log_queue_lock);
+        MUTEX_LOCK_TIMED(&log_queue_lock, &metrics.log_queue_lock_wait);
         log_queue->tail = tail;
-        pthread_mutex_unlock(&log_queue_lock);
+        log_queue_overflowing = false;
+        pthread_cond_broadcast(&log_queue_space);
+        MUTEX_UNLOCK(&log_queue_lock);
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
     }
     ZEJF_LOG(0, "QueueThread finish\n");
@@ -131,74 +275,55 @@ void *run_queue_thread() {
 
 void queue_thread_end(void) {
     queue_thread_running = false;
+    MUTEX_LOCK(&log_queue_lock);
+    log_queue_closed = true;
+    pthread_cond_broadcast(&log_queue_space);
+    MUTEX_UNLOCK(&log_queue_lock);
     sem_post(&log_queue_semaphore);
 }
 
-unsigned int count_diffs = 0;
-int64_t sum_diffs = 0;
+ClockDiscipline clock_discipline;
 double last_avg_diff = 0;
-bool last_set = false;
 bool calibrating = false;
+int64_t calibration_start_ms = 0;
 
-#define SHIFT_CHECK 80
-
-const char plus = '+';
-const char minus = '-';
-const char star = '*';
+#define CORRECTION_BUFFER_SIZE (CLOCK_MAX_STEPS + 1)
 
 void diff_control(int64_t diff, int shift) {
-    count_diffs++;
-    sum_diffs += diff;
-    if (count_diffs == SHIFT_CHECK) {
-        double avg_diff = sum_diffs / (double) count_diffs;
-        count_diffs = 0;
-        sum_diffs = 0;
-
-        if (last_set) {
-            if (calibrating && fabs(avg_diff) < CALIBRATION_TRESHOLD) {
-                calibrating = false;
-                ZEJF_LOG(1, "Calibration done, you can now see the data.\n");
-            }
-
-            double change = avg_diff - last_avg_diff;
-            double goal = calibrating ? -avg_diff / 4.0 : -avg_diff / 5.0;
-            int shift_goal = (shift + (goal - change) / SHIFT_CHECK);
-            int conf = (shift_goal - shift);
+    int conf;
+    if (!clock_discipline_update(&clock_discipline, diff, shift, &conf)) {
+        return;
+    }
 
-            if (calibrating) {
-                conf *= 1.50;
-            }
+    clock_source_update();
 
-            if (conf > 0) {
-                for (int i = 0; i < conf / 3 + 1; i++) {
-                    if (write(serial_port, &plus, 1) == -1) {
-                        perror("write");
-                        return;
-                    }
-                }
-            }
-            if (conf < 0) {
-                for (int i = 0; i < -conf / 3 + 1; i++) {
-                    if (write(serial_port, &minus, 1) == -1) {
-                        perror("write");
-                        return;
-                    }
-                }
-            }
+    if (calibrating && clock_discipline.locked) {
+        calibrating = false;
+        statistics.calibration_time_ms = millis() - calibration_start_ms;
+        ZEJF_LOG(1, "Calibration done, you can now see the data.\n");
+    }
 
-            ZEJF_LOG(0, "avg diff: %.5fms, changed by %.2fms, goal: %.2fms, shift: %d, target shift: %d\n", avg_diff / 1000.0, change / 1000.0, goal / 1000.0, shift, shift_goal);
+    if (conf != 0 && serial_port != -1) {
+        char corrections[CORRECTION_BUFFER_SIZE];
+        int count = conf > 0 ? conf : -conf;
+        memset(corrections, conf > 0 ? '+' : '-', count);
+        if (write(serial_port, corrections, count) == -1) {
+            perror("write");
+            return;
         }
+    }
 
-        last_avg_diff = avg_diff;
-        if (!calibrating) {
-            if (last_avg_diff > statistics.highest_avg_diff) {
-                statistics.highest_avg_diff = last_avg_diff;
-            }
-            if (last_avg_diff < statistics.lowest_avg_diff) {
-                statistics.lowest_avg_diff = last_avg_diff;
-            }
+    ZEJF_LOG(0, "avg diff: %.5fms, integrator: %.2f, shift: %d, correction: %d\n", clock_discipline.phase_error / 1000.0, clock_discipline.integrator, shift, conf);
+
+    last_avg_diff = clock_discipline.phase_error;
+    METRIC_SET(metrics.serial_diff_us, (int64_t) last_avg_diff);
+    if (!calibrating) {
+        if (last_avg_diff > statistics.highest_avg_diff) {
+            statistics.highest_avg_diff = last_avg_diff;
+        }
+        if (last_avg_diff < statistics.lowest_avg_diff) {
+            statistics.lowest_avg_diff = last_avg_diff;
         }
-        last_set = true;
     }
 }
 
@@ -206,11 +331,11 @@ int64_t first_log_id = -1;
 int first_log_num = 0;
 int last_log_num = 0;
 
-void next_sample(int shift, int log_num, int32_t value) {
-    int64_t time = micros();
+void next_sample(int shift, int log_num, int32_t value, int64_t time) {
     if (first_log_id == -1) {
-        first_log_id = time / (1000 * SAMPLE_TIME_MS) + 1;
-        ZEJF_LOG(1, "Calibrating %ld us\n", first_log_id * 1000 * SAMPLE_TIME_MS - time);
+        first_log_id = nanos_to_log_id(time) + 1;
+        calibration_start_ms = millis();
+        ZEJF_LOG(1, "Calibrating %ld us\n", (log_id_to_nanos(first_log_id) - time) / 1000);
         first_log_num = log_num;
     } else {
         if (log_num == last_log_num) {
@@ -223,22 +348,22 @@ void next_sample(int shift, int log_num, int32_t value) {
             ZEJF_LOG(0, "ERR COMM GAP!\n");
         }
 
-        int64_t expected_time = (first_log_id + (log_num - first_log_num)) * SAMPLE_TIME_MS * 1000;
-        int64_t diff = time - expected_time;
+        int64_t expected_time = log_id_to_nanos(first_log_id + (log_num - first_log_num));
+        int64_t diff = (time - expected_time) / 1000;
         diff_control(diff, shift);
     }
 
     if (!calibrating) {
-        pthread_mutex_lock(&log_queue_lock);
+        MUTEX_LOCK_TIMED(&log_queue_lock, &metrics.log_queue_lock_wait);
         next_log(value, first_log_id + (log_num - first_log_num));
-        pthread_mutex_unlock(&log_queue_lock);
+        MUTEX_UNLOCK(&log_queue_lock);
 
         sem_post(&log_queue_semaphore);
     }
     last_log_num = log_num;
 }
 
-bool decode(char *buffer) {
+bool decode(char *buffer, int64_t time) {
     if (buffer[0] != 's') {
         return false;
     }
@@ -256,25 +381,66 @@ bool decode(char *buffer) {
     int log_num = atoi(l + 1);
     int32_t value = atol(v + 1);
 
-    next_sample(shift, log_num, value);
+    next_sample(shift, log_num, value, time);
 
     return true;
 }
 
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE CAPTURE_MAX_RECORD
 #define LINE_BUFFER_SIZE 64
 #define IGNORE 10
+#define REPLAY_MAX_PAUSE_MS 5000
 
-void run_reader(char *serial, int serial_port) {
-    count_diffs = 0;
-    sum_diffs = 0;
+char line_buffer[LINE_BUFFER_SIZE];
+int line_buffer_ptr = 0;
+
+void reader_reset(void) {
+    clock_discipline_init(&clock_discipline, SAMPLES_PER_SECOND, options->clock_bandwidth);
+    clock_source_reset();
     first_log_id = -1;
     first_log_num = 0;
     last_log_num = 0;
     calibrating = true;
-    last_set = false;
     last_log_id = -1;
     last_avg_diff = 0;
+    line_buffer_ptr = 0;
+}
+
+void process_bytes(char *buffer, ssize_t count, int64_t time) {
+    for (ssize_t i = 0; i < count; i++) {
+        line_buffer[line_buffer_ptr] = buffer[i];
+        line_buffer_ptr++;
+        if (buffer[i] == '\n') {
+            line_buffer[line_buffer_ptr - 1] = '\0';
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            if (!decode(line_buffer, time)) {
+                ZEJF_LOG(0, "Arduino: %s\n", line_buffer);
+            }
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            line_buffer_ptr = 0;
+        }
+        if (line_buffer_ptr == LINE_BUFFER_SIZE - 1) {
+            ZEJF_LOG(0, "ERR SERIAL READER BUFF OVERFLOW\n");
+            line_buffer_ptr = 0;
+        }
+    }
+}
+
+void capture_cleanup(void *arg) {
+    capture_close(*(Capture **) arg);
+}
+
+// senddata from clients doesn't wait for room once the replay is gone
+void replay_cleanup(void *arg) {
+    log_queue_blocking = false;
+    capture_cleanup(arg);
+}
+
+void run_reader(char *serial, int serial_port) {
+    reader_reset();
+
+    Capture *capture = NULL;
+    pthread_cleanup_push(capture_cleanup, &capture);
 
     char msg[2];
     msg[0] = 'r';
@@ -288,48 +454,109 @@ void run_reader(char *serial, int serial_port) {
 
     ZEJF_LOG(1, "Serial port connected\n");
 
+    if (options->capture_file != NULL) {
+        capture = capture_open(options->capture_file->data, SAMPLES_PER_SECOND, clock_source_now());
+        if (capture != NULL) {
+            ZEJF_LOG(1, "Capturing serial data to %s\n", options->capture_file->data);
+        }
+    }
+
     char buffer[BUFFER_SIZE];
-    char line_buffer[LINE_BUFFER_SIZE];
-    int line_buffer_ptr = 0;
 
     struct stat stats;
 
     while (true) {
         ssize_t count = read(serial_port, buffer, BUFFER_SIZE);
-        
+        int64_t time = clock_source_now();
+
         // maybe EOF
         if (count <= 0) {
             if (stat(serial, &stats) == -1) {
                 break;
             }
+            continue;
         }
 
-        for (ssize_t i = 0; i < count; i++) {
-            line_buffer[line_buffer_ptr] = buffer[i];
-            line_buffer_ptr++;
-            if (buffer[i] == '\n') {
-                line_buffer[line_buffer_ptr - 1] = '\0';
-                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-                if (!decode(line_buffer)) {
-                    ZEJF_LOG(0, "Arduino: %s\n", line_buffer);
-                }
-                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-                line_buffer_ptr = 0;
-            }
-            if (line_buffer_ptr == LINE_BUFFER_SIZE - 1) {
-                ZEJF_LOG(0, "ERR SERIAL READER BUFF OVERFLOW\n");
-                line_buffer_ptr = 0;
-            }
+        if (capture != NULL && !capture_write(capture, time, buffer, count)) {
+            ZEJF_LOG(2, "Capture stopped\n");
+            capture_close(capture);
+            capture = NULL;
         }
+
+        process_bytes(buffer, count, time);
     }
 
 end:
 
+    pthread_cleanup_pop(1);
     ZEJF_LOG(0, "Serial reader thread finish\n");
     serial_port_running = false;
     pthread_exit(0);
 }
 
+void *run_replay(void *arg) {
+    char *path = (char *) arg;
+    serial_port_needs_join = true;
+    serial_port_running = true;
+
+    int sample_rate;
+    Capture *replay = replay_open(path, &sample_rate);
+    if (replay == NULL) {
+        serial_port_running = false;
+        pthread_exit(0);
+    }
+
+    if (sample_rate != SAMPLES_PER_SECOND) {
+        ZEJF_LOG(2, "Capture %s was recorded at %d sps\n", path, sample_rate);
+        capture_close(replay);
+        serial_port_running = false;
+        pthread_exit(0);
+    }
+
+    pthread_cleanup_push(replay_cleanup, &replay);
+
+    ZEJF_LOG(1, "Replaying %s at %.1fx speed\n", path, options->replay_speed);
+    log_queue_blocking = true;
+
+    char buffer[BUFFER_SIZE];
+    size_t count;
+    int64_t time;
+    int64_t base_time = -1;
+    int64_t base_ns = 0;
+    int64_t last_time = 0;
+
+    while (replay_next(replay, &time, buffer, &count)) {
+        if (count == 0) {
+            reader_reset();
+            base_time = -1;
+            continue;
+        }
+
+        if (options->replay_speed > 0) {
+            int64_t now = nanos();
+            if (base_time == -1 || (time - last_time) / options->replay_speed > REPLAY_MAX_PAUSE_MS * 1000000.0) {
+                base_time = time;
+                base_ns = now;
+            }
+            int64_t wait = base_ns + (int64_t) ((time - base_time) / options->replay_speed) - now;
+            if (wait > 0) {
+                struct timespec ts;
+                ts.tv_sec = wait / 1000000000;
+                ts.tv_nsec = wait % 1000000000;
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        last_time = time;
+        process_bytes(buffer, count, time);
+    }
+
+    pthread_cleanup_pop(1);
+    ZEJF_LOG(1, "Replay of %s finished\n", path);
+    serial_port_running = false;
+    pthread_exit(0);
+}
+
 void *run_serial(void *arg) {
     char *serial = (char *) arg;
     serial_port_needs_join = true;
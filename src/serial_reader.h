@@ -22,12 +22,14 @@ typedef struct log_t
 {
     int64_t log_id;
     int32_t val;
+    int64_t arrival_us;
 } Log;
 
 typedef struct log_queue_t
 {
     size_t head;
     size_t tail;
+    int64_t head_time_us;
     Log logs[LOG_QUEUE_SIZE];
 } LogQueue;
 
@@ -37,6 +39,8 @@ int serial_init(void);
 
 void* run_serial(void *arg);
 
+void *run_replay(void *arg);
+
 void *run_queue_thread();
 
 void queue_thread_end(void);
@@ -45,4 +49,6 @@ void serial_reader_destroy(void);
 
 void next_log(int32_t value, int64_t log_id);
 
+size_t next_logs(int64_t first_log_id, int32_t *values, size_t count);
+
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <arpa/inet.h>
+#include <math.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,11 +19,20 @@
 #include "arraylist.h"
 #include "com_utils.h"
 #include "data.h"
+#include "decimator.h"
+#include "hour_index.h"
+#include "lock_profile.h"
+#include "metrics.h"
 #include "my_string.h"
+#include "recent.h"
+#include "retention.h"
 #include "scheduler.h"
 #include "serial_reader.h"
 #include "server.h"
+#include "spectrum.h"
 #include "time_utils.h"
+#include "trace.h"
+#include "trigger.h"
 
 volatile bool server_running = false;
 volatile bool server_needs_join = false;
@@ -38,36 +48,154 @@ void server_init() {
     signal(SIGPIPE, SIG_IGN);
 }
 
-void register_request(ServerClient *client, int64_t first_log_id, int64_t last_log_id) {
+void register_request(ServerClient *client, int type, int64_t first_log_id, int64_t last_log_id) {
     ZEJF_LOG(0, "registering DataRequest from %ld to %ld\n", first_log_id, last_log_id);
     if (last_log_id < first_log_id) {
         ZEJF_LOG(1, "invalid request\n");
         return;
     }
 
-    if ((last_log_id - first_log_id) * SAMPLE_TIME_MS / (1000 * 60 * 60l) > DATA_REQUEST_MAX_LENGTH_HOURS) {
+    if ((last_log_id - first_log_id) / SAMPLES_IN_HOUR > DATA_REQUEST_MAX_LENGTH_HOURS) {
         ZEJF_LOG(1, "too long request\n");
         return;
     }
 
-    pthread_mutex_lock(&client->data_requests_mutex);
+    MUTEX_LOCK(&client->data_requests_mutex);
 
     if ((client->requests_head + 1) % DATA_REQUEST_BUFFER == client->requests_tail) {
-        pthread_mutex_unlock(&client->data_requests_mutex);
+        MUTEX_UNLOCK(&client->data_requests_mutex);
         ZEJF_LOG(1, "ERROR: maximum number of DataRequests reached for client #%ld\n", client->id);
         return;
     }
 
     ZEJF_LOG(0, "HEAD %d, TAIL %d, MAX = %d\n", client->requests_head, client->requests_tail, DATA_REQUEST_BUFFER);
 
+    client->data_requests[client->requests_head].type = type;
+    client->data_requests[client->requests_head].stream = client->stream;
+    client->data_requests[client->requests_head].rate = client->rate;
+    client->data_requests[client->requests_head].queued = false;
     client->data_requests[client->requests_head].first_log_id = first_log_id;
     client->data_requests[client->requests_head].last_log_id = last_log_id;
     client->requests_head = (client->requests_head + 1) % DATA_REQUEST_BUFFER;
-    pthread_mutex_unlock(&client->data_requests_mutex);
+    MUTEX_UNLOCK(&client->data_requests_mutex);
 
     sem_post(&client->output_semaphore);
 }
 
+// senddata_batch / senddata_binary: first log_id, sample count, then the values
+// either one per line or as big-endian int32, at most an hour of them
+void receive_batch(ServerClient *client, bool binary) {
+    int64_t first_log_id;
+    int64_t count;
+    if (!read_64_checked(client->file, &first_log_id) || !read_64_checked(client->file, &count)) {
+        ZEJF_LOG(1, "client #%ld sent an invalid batch header\n", client->id);
+        return;
+    }
+    if (count <= 0 || count > SAMPLES_IN_HOUR) {
+        ZEJF_LOG(1, "client #%ld sent invalid batch size %ld\n", client->id, count);
+        return;
+    }
+
+    int32_t values[SENDDATA_BATCH_MAX];
+
+    while (count > 0) {
+        size_t chunk = MIN(count, SENDDATA_BATCH_MAX);
+        if (binary) {
+            if (fread(values, sizeof(int32_t), chunk, client->file) != chunk) {
+                ZEJF_LOG(1, "client #%ld binary batch truncated\n", client->id);
+                return;
+            }
+            for (size_t i = 0; i < chunk; i++) {
+                values[i] = (int32_t) ntohl((uint32_t) values[i]);
+            }
+        } else {
+            for (size_t i = 0; i < chunk; i++) {
+                int64_t value;
+                if (!read_64_checked(client->file, &value) || value < INT32_MIN || value > INT32_MAX) {
+                    ZEJF_LOG(1, "client #%ld text batch truncated or invalid\n", client->id);
+                    return;
+                }
+                values[i] = (int32_t) value;
+            }
+        }
+
+        MUTEX_LOCK_TIMED(&log_queue_lock, &metrics.log_queue_lock_wait);
+        size_t accepted = next_logs(first_log_id, values, chunk);
+        MUTEX_UNLOCK(&log_queue_lock);
+
+        if (accepted > 0) {
+            sem_post(&log_queue_semaphore);
+        }
+
+        first_log_id += chunk;
+        count -= chunk;
+    }
+}
+
+// datahour_digests: hour_id followed by the client's 60 minute digests,
+// only the minutes that differ are sent back
+void check_digests(ServerClient *client) {
+    int32_t hour_id = (int32_t) read_64(client->file);
+    uint64_t digests[DIGEST_MINUTES];
+    uint64_t hour_digest = 0;
+    for (int minute = 0; minute < DIGEST_MINUTES; minute++) {
+        digests[minute] = read_u64(client->file);
+        hour_digest += digests[minute];
+    }
+
+    // the full rate samples of old hours are gone, sending them would only
+    // replace the client's
+    if (retention_tiered(hour_id)) {
+        return;
+    }
+
+    uint64_t server_digests[DIGEST_MINUTES];
+    MUTEX_LOCK(&data_lock);
+    DataHour *loaded = get_datahour(STREAM_RAW, hour_id, false, false);
+    if (loaded != NULL) {
+        memcpy(server_digests, loaded->minute_digests, sizeof(server_digests));
+    }
+    MUTEX_UNLOCK(&data_lock);
+
+    if (loaded == NULL) {
+        // the digests add up, so a matching hour needs no samples at all
+        HourIndex entry;
+        if (hour_index_lookup(STREAM_RAW, hour_id, &entry) && entry.digest == hour_digest) {
+            return;
+        }
+
+        // read privately, the loaded hours are for live data
+        DataHour *dh = datahour_read_file(STREAM_RAW, hour_id, false);
+        if (dh == NULL) {
+            return;
+        }
+        memcpy(server_digests, dh->minute_digests, sizeof(server_digests));
+        datahour_destroy(dh);
+    }
+
+    int64_t minute_log_ids = SAMPLES_IN_HOUR / DIGEST_MINUTES;
+    int first_differing = -1;
+    for (int minute = 0; minute <= DIGEST_MINUTES; minute++) {
+        bool differs = minute < DIGEST_MINUTES && digests[minute] != server_digests[minute];
+        if (differs && first_differing == -1) {
+            first_differing = minute;
+        } else if (!differs && first_differing != -1) {
+            register_request(client, REQUEST_LOGS, get_first_log_id(hour_id) + first_differing * minute_log_ids, get_first_log_id(hour_id) + minute * minute_log_ids - 1);
+            first_differing = -1;
+        }
+    }
+}
+
+// realtime decimators start filling as soon as a client might need them
+void prepare_decimator(ServerClient *client) {
+    if (client->rate == 0) {
+        return;
+    }
+    MUTEX_LOCK(&decimators_lock);
+    decimator_get(client->stream, client->rate);
+    MUTEX_UNLOCK(&decimators_lock);
+}
+
 void process_client_command(ServerClient *client, char *command) {
     if (strcmp(command, "realtime\n") == 0) {
         int64_t last_log_id = read_64(client->file);
@@ -77,27 +205,82 @@ void process_client_command(ServerClient *client, char *command) {
     } else if (strcmp(command, "getdata\n") == 0) {
         int64_t first_log_id = read_64(client->file);
         int64_t last_log_id = read_64(client->file);
-        register_request(client, first_log_id, last_log_id);
+        register_request(client, REQUEST_LOGS, first_log_id, last_log_id);
+    } else if (strcmp(command, "spectrogram\n") == 0) {
+        int64_t first_log_id = read_64(client->file);
+        int64_t last_log_id = read_64(client->file);
+        register_request(client, REQUEST_SPECTROGRAM, first_log_id, last_log_id);
+    } else if (strcmp(command, "recent\n") == 0) {
+        int64_t first_log_id = read_64(client->file);
+        MUTEX_LOCK(&data_lock);
+        int64_t last_log_id = last_received_log_id;
+        MUTEX_UNLOCK(&data_lock);
+        // the ring only has full rate samples
+        register_request(client, client->rate == 0 ? REQUEST_RECENT : REQUEST_LOGS, first_log_id, last_log_id);
+    } else if (strcmp(command, "download\n") == 0) {
+        int64_t first_log_id = read_64(client->file);
+        int64_t last_log_id = read_64(client->file);
+        MUTEX_LOCK(&client->data_requests_mutex);
+        client->download_stream = client->stream;
+        client->download_next = first_log_id;
+        client->download_last = last_log_id;
+        MUTEX_UNLOCK(&client->data_requests_mutex);
+        sem_post(&client->output_semaphore);
     } else if (strcmp(command, "heartbeat\n") == 0) {
         client->last_heartbeat = millis();
     } else if (strcmp(command, "datahour_check\n") == 0) {
         int32_t hour_id = (int32_t) read_64(client->file);
         int64_t sample_count = read_64(client->file);
-        pthread_mutex_lock(&data_lock);
-        DataHour *dh = get_datahour(hour_id, true, false);
-        pthread_mutex_unlock(&data_lock);
-        if (dh != NULL && dh->sample_count != sample_count) {
-            register_request(client, get_first_log_id(hour_id), get_first_log_id(hour_id + 1) - 1);
+        // hours in memory may have unsaved samples, the others are answered by the index
+        // or indexed now
+        MUTEX_LOCK(&data_lock);
+        DataHour *dh = get_datahour(STREAM_RAW, hour_id, false, false);
+        int64_t stored_count = dh != NULL ? dh->sample_count : -1;
+        MUTEX_UNLOCK(&data_lock);
+        HourIndex entry;
+        if (stored_count == -1 && hour_index_lookup(STREAM_RAW, hour_id, &entry)) {
+            stored_count = entry.sample_count;
+        }
+        if (stored_count != -1 && stored_count != sample_count && !retention_tiered(hour_id)) {
+            register_request(client, REQUEST_LOGS, get_first_log_id(hour_id), get_first_log_id(hour_id + 1) - 1);
         }
+    } else if (strcmp(command, "datahour_digests\n") == 0) {
+        check_digests(client);
     } else if (strcmp(command, "senddata\n") == 0) {
         int32_t value = (int32_t) read_64(client->file);
         int64_t log_id = read_64(client->file);
 
-        pthread_mutex_lock(&log_queue_lock);
+        MUTEX_LOCK_TIMED(&log_queue_lock, &metrics.log_queue_lock_wait);
         next_log(value, log_id);
-        pthread_mutex_unlock(&log_queue_lock);
+        MUTEX_UNLOCK(&log_queue_lock);
 
         sem_post(&log_queue_semaphore);
+    } else if (strcmp(command, "stream\n") == 0) {
+        int64_t stream = read_64(client->file);
+        if (stream >= 0 && stream < STREAM_COUNT) {
+            client->stream = (int) stream;
+            prepare_decimator(client);
+        } else {
+            ZEJF_LOG(1, "client #%ld requested unknown stream %ld\n", client->id, stream);
+        }
+    } else if (strcmp(command, "rate\n") == 0) {
+        int64_t rate = read_64(client->file);
+        if (rate == 0 || rate == SAMPLES_PER_SECOND) {
+            client->rate = 0;
+        } else if (decimation_rate_valid((int) rate)) {
+            client->rate = (int) rate;
+            prepare_decimator(client);
+        } else {
+            ZEJF_LOG(1, "client #%ld requested unsupported rate %ld\n", client->id, rate);
+        }
+    } else if (strcmp(command, "events\n") == 0) {
+        client->last_sent_event_seq = last_event_seq;
+        client->events = !client->events;
+        ZEJF_LOG(0, "events toggled for client #%ld\n", client->id);
+    } else if (strcmp(command, "senddata_batch\n") == 0) {
+        receive_batch(client, false);
+    } else if (strcmp(command, "senddata_binary\n") == 0) {
+        receive_batch(client, true);
     } else {
         ZEJF_LOG(1, "client #%ld received unknown command '%s'\n", client->id, command);
     }
@@ -120,10 +303,34 @@ void *run_input_thread(void *arg) {
 
 #define SEND_BUFFER_SIZE 2048
 
-bool send_logs(int fd, int64_t start, int64_t end, int64_t *last_ptr, char *command) {
+__thread ServerClient *output_client = NULL;
+
+// all writes to a client happen in its output thread
+ssize_t send_bytes(int fd, const void *data, size_t size) {
+    ssize_t result = write(fd, data, size);
+    if (result > 0 && output_client != NULL) {
+        METRIC_ADD(output_client->bytes_sent, result);
+    }
+    return result;
+}
+
+// write() may take only a part of the buffer
+bool send_all(int fd, const void *data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = send_bytes(fd, (const char *) data + written, size - written);
+        if (result <= 0) {
+            return false;
+        }
+        written += result;
+    }
+    return true;
+}
+
+bool send_logs(int fd, int stream, int64_t start, int64_t end, int64_t *last_ptr, char *command) {
     int64_t count = (end - start) + 1;
 
-    if (write(fd, command, strlen(command)) <= 0) {
+    if (send_bytes(fd, command, strlen(command)) <= 0) {
         return false;
     }
 
@@ -134,15 +341,15 @@ bool send_logs(int fd, int64_t start, int64_t end, int64_t *last_ptr, char *comm
     while (count > 0) {
         send_buffer_ptr = send_buffer;
         pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-        pthread_mutex_lock(&data_lock);
+        MUTEX_LOCK_TIMED(&data_lock, &metrics.data_lock_wait);
         while (count > 0) {
-            int32_t val = get_log(start);
+            int32_t val = get_log(stream, start);
             sn_count = 0;
             if (val != ERR_VAL) {
                 sn_count = snprintf(send_buffer_ptr, 48, "%d\n%ld\n", val, start);
                 if (sn_count < 0) {
                     ZEJF_LOG(0, "snprintf fail\n");
-                    pthread_mutex_unlock(&data_lock);
+                    MUTEX_UNLOCK(&data_lock);
                     pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
                     return false;
                 }
@@ -157,14 +364,14 @@ bool send_logs(int fd, int64_t start, int64_t end, int64_t *last_ptr, char *comm
             }
         }
 
-        pthread_mutex_unlock(&data_lock);
+        MUTEX_UNLOCK(&data_lock);
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
         if (send_buffer_ptr - send_buffer == 0) {
             continue;
         }
 
-        if (write(fd, send_buffer, send_buffer_ptr - send_buffer) <= 0) {
+        if (send_bytes(fd, send_buffer, send_buffer_ptr - send_buffer) <= 0) {
             perror("write");
             return false;
         }
@@ -178,7 +385,7 @@ bool send_logs(int fd, int64_t start, int64_t end, int64_t *last_ptr, char *comm
         return false;
     }
 
-    if (write(fd, msg, strlen(msg)) <= 0) {
+    if (send_bytes(fd, msg, strlen(msg)) <= 0) {
         perror("write");
         return false;
     }
@@ -186,11 +393,316 @@ bool send_logs(int fd, int64_t start, int64_t end, int64_t *last_ptr, char *comm
     return true;
 }
 
+bool send_values(int fd, char *command, int64_t *log_ids, int32_t *values, size_t count) {
+    if (send_bytes(fd, command, strlen(command)) <= 0) {
+        return false;
+    }
+
+    char send_buffer[SEND_BUFFER_SIZE];
+    char *send_buffer_ptr = send_buffer;
+
+    for (size_t i = 0; i <= count; i++) {
+        if (i == count || (send_buffer_ptr - send_buffer) >= SEND_BUFFER_SIZE - 48) {
+            if (send_buffer_ptr != send_buffer && send_bytes(fd, send_buffer, send_buffer_ptr - send_buffer) <= 0) {
+                perror("write");
+                return false;
+            }
+            send_buffer_ptr = send_buffer;
+        }
+        if (i < count) {
+            send_buffer_ptr += snprintf(send_buffer_ptr, 48, "%d\n%ld\n", values[i], log_ids[i]);
+        }
+    }
+
+    char msg[32];
+    int sn_count = snprintf(msg, 32, "%d\n", ERR_VAL);
+    if (send_bytes(fd, msg, sn_count) <= 0) {
+        perror("write");
+        return false;
+    }
+
+    return true;
+}
+
+#define DECIMATION_READ_CHUNK 4096
+
+// Samples of the range whose log_id is a multiple of the decimation factor,
+// each filtered from the raw samples around it. Windows containing a missing
+// sample are skipped.
+void decimation_buffer_free(DecimationBuffer *buffer) {
+    free(buffer->raw);
+    free(buffer->missing);
+    free(buffer->log_ids);
+    free(buffer->values);
+    buffer->raw = NULL;
+    buffer->missing = NULL;
+    buffer->log_ids = NULL;
+    buffer->values = NULL;
+    buffer->capacity = 0;
+}
+
+void decimation_buffer_destroy(DecimationBuffer *buffer) {
+    decimation_buffer_free(buffer);
+    fir_destroy(&buffer->fir);
+    buffer->fir.factor = 0;
+}
+
+// there are never more outputs than raw samples, all arrays have the same length
+bool decimation_buffer_reserve(DecimationBuffer *buffer, int factor, size_t capacity) {
+    if (buffer->fir.factor != factor) {
+        fir_destroy(&buffer->fir);
+        if (!fir_init(&buffer->fir, factor)) {
+            buffer->fir.factor = 0;
+            return false;
+        }
+    }
+
+    if (capacity <= buffer->capacity) {
+        return true;
+    }
+
+    decimation_buffer_free(buffer);
+    buffer->raw = malloc(capacity * sizeof(double));
+    buffer->missing = malloc(capacity * sizeof(int32_t));
+    buffer->log_ids = malloc(capacity * sizeof(int64_t));
+    buffer->values = malloc(capacity * sizeof(int32_t));
+    if (buffer->raw == NULL || buffer->missing == NULL || buffer->log_ids == NULL || buffer->values == NULL) {
+        perror("malloc");
+        decimation_buffer_free(buffer);
+        return false;
+    }
+    buffer->capacity = capacity;
+    return true;
+}
+
+bool send_decimated_logs(int fd, DecimationBuffer *buffer, int stream, int rate, int64_t start, int64_t end, int64_t *last_ptr, char *command) {
+    int64_t factor = SAMPLES_PER_SECOND / rate;
+    int64_t taps = DECIMATOR_TAPS_PER_FACTOR * factor + 1;
+    int64_t first_out = ((start + factor - 1) / factor) * factor;
+    int64_t out_count = first_out <= end ? (end - first_out) / factor + 1 : 0;
+    int64_t raw_count = out_count > 0 ? (out_count - 1) * factor + taps : 0;
+
+    if (!decimation_buffer_reserve(buffer, (int) factor, raw_count + 1)) {
+        return false;
+    }
+
+    Fir fir = buffer->fir;
+    int64_t raw_first = first_out - fir.half;
+    double *raw = buffer->raw;
+    int32_t *missing = buffer->missing;
+    int64_t *log_ids = buffer->log_ids;
+    int32_t *values = buffer->values;
+
+    missing[0] = 0;
+    for (int64_t i = 0; i < raw_count; i += DECIMATION_READ_CHUNK) {
+        int64_t chunk_end = MIN(raw_count, i + DECIMATION_READ_CHUNK);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        MUTEX_LOCK(&data_lock);
+        for (int64_t j = i; j < chunk_end; j++) {
+            int32_t val = get_log(stream, raw_first + j);
+            raw[j] = val == ERR_VAL ? 0 : val;
+            missing[j + 1] = missing[j] + (val == ERR_VAL);
+        }
+        MUTEX_UNLOCK(&data_lock);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    size_t count = 0;
+    for (int64_t k = 0; k < out_count; k++) {
+        int64_t offset = k * factor;
+        if (missing[offset + fir.taps] != missing[offset]) {
+            continue;
+        }
+        log_ids[count] = first_out + offset;
+        values[count] = (int32_t) lround(fir_apply(&fir, raw + offset));
+        count++;
+    }
+
+    bool result = send_values(fd, command, log_ids, values, count);
+    *last_ptr = end;
+    return result;
+}
+
+// Header with the band center frequencies in mHz, then one line per computed
+// minute of the hour that overlaps the range: first log_id of the minute,
+// sample count and the band values in hundredths of dB
+bool send_spectrogram(int fd, int32_t hour_id, SpectrumHour *sh, int64_t start, int64_t end) {
+    bool available = sh != NULL;
+    int bands = available ? SPECTRUM_BANDS : 0;
+
+    char send_buffer[SEND_BUFFER_SIZE];
+    int len = snprintf(send_buffer, sizeof(send_buffer), "spectrogram\n%d\n%d\n", available ? sh->fft_size : 0, bands);
+    for (int band = 0; band < bands; band++) {
+        len += snprintf(send_buffer + len, sizeof(send_buffer) - len, band == 0 ? "%ld" : ",%ld", lround(spectrum_band_frequency(band) * 1000.0));
+    }
+    len += snprintf(send_buffer + len, sizeof(send_buffer) - len, "\n");
+    if (send_bytes(fd, send_buffer, len) <= 0) {
+        perror("write");
+        return false;
+    }
+
+    int64_t minute_log_ids = 60l * SAMPLES_PER_SECOND;
+    for (int minute = 0; available && minute < SPECTRUM_MINUTES; minute++) {
+        int64_t minute_start = get_first_log_id(hour_id) + minute * minute_log_ids;
+        if (minute_start + minute_log_ids <= start || minute_start > end || sh->sample_counts[minute] <= 0) {
+            continue;
+        }
+
+        len = snprintf(send_buffer, sizeof(send_buffer), "%ld\n%d\n", minute_start, sh->sample_counts[minute]);
+        for (int band = 0; band < SPECTRUM_BANDS; band++) {
+            len += snprintf(send_buffer + len, sizeof(send_buffer) - len, band == 0 ? "%d" : ",%d", sh->values[minute][band]);
+        }
+        len += snprintf(send_buffer + len, sizeof(send_buffer) - len, "\n");
+        if (send_bytes(fd, send_buffer, len) <= 0) {
+            perror("write");
+            return false;
+        }
+    }
+
+    len = snprintf(send_buffer, sizeof(send_buffer), "%d\n", ERR_VAL);
+    if (send_bytes(fd, send_buffer, len) <= 0) {
+        perror("write");
+        return false;
+    }
+
+    return true;
+}
+
+// the ring part of a recent request in one write
+bool send_recent(int fd, int stream, int64_t first_log_id, int64_t *oldest_log_id) {
+    size_t size;
+    char *message = recent_read(stream, first_log_id, &size, oldest_log_id);
+    if (message == NULL) {
+        return true;
+    }
+
+    bool result = send_all(fd, message, size);
+    if (!result) {
+        perror("write");
+    }
+    free(message);
+    return result;
+}
+
+bool send_hour_logs(int fd, DataHour *dh, int64_t start, int64_t end) {
+    if (!send_all(fd, "logs\n", 5)) {
+        return false;
+    }
+
+    char send_buffer[DOWNLOAD_BUFFER_SIZE];
+    char *send_buffer_ptr = send_buffer;
+    int64_t hour_start = get_first_log_id(dh->hour_id);
+
+    for (int64_t log_id = start; log_id <= end + 1; log_id++) {
+        if (log_id > end || (send_buffer_ptr - send_buffer) >= DOWNLOAD_BUFFER_SIZE - 48) {
+            if (!send_all(fd, send_buffer, send_buffer_ptr - send_buffer)) {
+                perror("write");
+                return false;
+            }
+            send_buffer_ptr = send_buffer;
+        }
+        int32_t value = log_id <= end ? datahour_get(dh, log_id - hour_start) : ERR_VAL;
+        if (value != ERR_VAL) {
+            send_buffer_ptr += snprintf(send_buffer_ptr, 48, "%d\n%ld\n", value, log_id);
+        }
+    }
+
+    char msg[32];
+    int sn_count = snprintf(msg, 32, "%d\n", ERR_VAL);
+    if (!send_all(fd, msg, sn_count)) {
+        perror("write");
+        return false;
+    }
+
+    return true;
+}
+
+// Sends the next hour of the download that has data, then the log_id to
+// resume from. Hours are read privately, so at most one is held at a time.
+bool send_download(ServerClient *client) {
+    MUTEX_LOCK(&client->data_requests_mutex);
+    int stream = client->download_stream;
+    int64_t start = client->download_next;
+    int64_t last = client->download_last;
+    MUTEX_UNLOCK(&client->data_requests_mutex);
+
+    if (start > last) {
+        return true;
+    }
+
+    int64_t next = start;
+    int64_t end = next;
+    DataHour *dh = NULL;
+    for (int i = 0; i < DOWNLOAD_MAX_EMPTY_HOURS && next <= last && dh == NULL; i++) {
+        int32_t hour_id = get_hour_id(next);
+        end = MIN(last, get_first_log_id(hour_id + 1) - 1);
+        dh = datahour_read(stream, hour_id);
+        if (dh == NULL) {
+            next = end + 1;
+        }
+    }
+
+    if (dh != NULL) {
+        bool result = send_hour_logs(client->socket, dh, next, end);
+        datahour_destroy(dh);
+        if (!result) {
+            return false;
+        }
+        next = end + 1;
+    }
+
+    char msg[48];
+    int len = snprintf(msg, sizeof(msg), "cursor\n%ld\n", next);
+    if (!send_all(client->socket, msg, len)) {
+        perror("write");
+        return false;
+    }
+
+    // a new download command replaces this one
+    MUTEX_LOCK(&client->data_requests_mutex);
+    if (client->download_stream == stream && client->download_next == start && client->download_last == last) {
+        client->download_next = next;
+    }
+    MUTEX_UNLOCK(&client->data_requests_mutex);
+
+    if (next <= last) {
+        sem_post(&client->output_semaphore);
+    }
+    return true;
+}
+
+#define DECIMATED_REALTIME_MAX DECIMATOR_RING_SIZE
+
+bool send_decimated_realtime(ServerClient *client) {
+    int64_t log_ids[DECIMATED_REALTIME_MAX];
+    int32_t values[DECIMATED_REALTIME_MAX];
+
+    MUTEX_LOCK(&decimators_lock);
+    Decimator *decimator = decimator_get(client->stream, client->rate);
+    size_t count = decimator == NULL ? 0 : decimator_read(decimator, client->last_sent_log_id, log_ids, values, DECIMATED_REALTIME_MAX);
+    MUTEX_UNLOCK(&decimators_lock);
+
+    if (count == 0) {
+        return true;
+    }
+
+    client->last_sent_log_id = log_ids[count - 1];
+    if (send_values(client->socket, "realtime\n", log_ids, values, count)) {
+        metrics_observe(&metrics.realtime_latency, micros() - METRIC_GET(metrics.last_ingest_us));
+    }
+
+    return true;
+}
+
 bool send_realtime(ServerClient *client) {
+    if (client->rate != 0) {
+        return send_decimated_realtime(client);
+    }
+
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-    pthread_mutex_lock(&data_lock);
+    MUTEX_LOCK(&data_lock);
     int64_t last_log = last_received_log_id;
-    pthread_mutex_unlock(&data_lock);
+    MUTEX_UNLOCK(&data_lock);
     pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
     if (client->last_sent_log_id == last_log) {
@@ -201,31 +713,78 @@ bool send_realtime(ServerClient *client) {
         return true;
     }
 
-    if (last_log - client->last_sent_log_id > (REALTIME_MAX_GAP_MINUTES * 60 * 1000) / SAMPLE_TIME_MS) {
+    if (last_log - client->last_sent_log_id > REALTIME_MAX_GAP_MINUTES * 60l * SAMPLES_PER_SECOND) {
         client->last_sent_log_id = last_log - 1;
     }
 
-    send_logs(client->socket, client->last_sent_log_id + 1, last_log, &client->last_sent_log_id, "realtime\n");
+    int64_t first_log = client->last_sent_log_id + 1;
+    if (send_logs(client->socket, client->stream, first_log, last_log, &client->last_sent_log_id, "realtime\n")) {
+        metrics_observe(&metrics.realtime_latency, micros() - METRIC_GET(metrics.last_ingest_us));
+        if (trace_enabled) {
+            trace_write(first_log, last_log);
+        }
+    }
 
     return true;
 }
 
 bool send_requests(ServerClient *client) {
     int head, tail;
-    pthread_mutex_lock(&client->data_requests_mutex);
+    MUTEX_LOCK(&client->data_requests_mutex);
     head = client->requests_head;
     tail = client->requests_tail;
-    pthread_mutex_unlock(&client->data_requests_mutex);
+    MUTEX_UNLOCK(&client->data_requests_mutex);
 
     int64_t sent = 0;
 
     while (tail != head) {
         DataRequest *request = &(client->data_requests[tail]);
-        int64_t count = request->last_log_id - request->first_log_id + 1;
-        count = MIN(count, (DATA_REQUEST_CHUNK_SIZE_MINUTES * 60 * 1000) / SAMPLE_TIME_MS - sent);
-        sent += count;
 
-        send_logs(client->socket, request->first_log_id, request->first_log_id + count - 1, &request->first_log_id, "logs\n");
+        // one hour per pass
+        if (request->type == REQUEST_SPECTROGRAM) {
+            // missing minutes are left to the spectrum thread, the request
+            // waits for them and realtime data keeps going meanwhile
+            int32_t hour_id = get_hour_id(request->first_log_id);
+            if (request->queued && spectrum_pending(hour_id)) {
+                break;
+            }
+            SpectrumHour sh;
+            bool available = spectrum_read_hour(hour_id, &sh);
+            if (available && !request->queued && spectrum_hour_missing(&sh)) {
+                spectrum_queue(hour_id, 0);
+                request->queued = true;
+                break;
+            }
+            request->queued = false;
+
+            int64_t end = MIN(request->last_log_id, get_first_log_id(hour_id + 1) - 1);
+            if (!send_spectrogram(client->socket, hour_id, available ? &sh : NULL, request->first_log_id, end)) {
+                return false;
+            }
+            request->first_log_id = end < request->last_log_id ? end + 1 : end;
+        } else if (request->type == REQUEST_RECENT) {
+            // whatever is older than the ring is sent as an ordinary request
+            int64_t oldest_log_id;
+            if (!send_recent(client->socket, request->stream, request->first_log_id, &oldest_log_id)) {
+                return false;
+            }
+            if (oldest_log_id > request->first_log_id) {
+                request->type = REQUEST_LOGS;
+                request->last_log_id = MIN(request->last_log_id, oldest_log_id - 1);
+                continue;
+            }
+            request->first_log_id = request->last_log_id;
+        } else {
+            int64_t count = request->last_log_id - request->first_log_id + 1;
+            count = MIN(count, DATA_REQUEST_CHUNK_SIZE_MINUTES * 60l * SAMPLES_PER_SECOND - sent);
+            sent += count;
+
+            if (request->rate != 0) {
+                send_decimated_logs(client->socket, &client->decimation, request->stream, request->rate, request->first_log_id, request->first_log_id + count - 1, &request->first_log_id, "logs\n");
+            } else {
+                send_logs(client->socket, request->stream, request->first_log_id, request->first_log_id + count - 1, &request->first_log_id, "logs\n");
+            }
+        }
 
         if (request->first_log_id >= request->last_log_id) {
             tail++;
@@ -236,9 +795,9 @@ bool send_requests(ServerClient *client) {
         }
     }
 
-    pthread_mutex_lock(&client->data_requests_mutex);
+    MUTEX_LOCK(&client->data_requests_mutex);
     client->requests_tail = tail;
-    pthread_mutex_unlock(&client->data_requests_mutex);
+    MUTEX_UNLOCK(&client->data_requests_mutex);
 
     struct timespec ts;
     ts.tv_sec = 0;
@@ -248,9 +807,27 @@ bool send_requests(ServerClient *client) {
     return true;
 }
 
+bool send_events(ServerClient *client) {
+    Event event;
+    char msg[96];
+    while (client->last_sent_event_seq < last_event_seq) {
+        client->last_sent_event_seq++;
+        if (!events_get(client->last_sent_event_seq, &event)) {
+            continue;
+        }
+        int len = snprintf(msg, sizeof(msg), "event\n%s\n%ld\n%.3f\n", event.type == EVENT_TRIGGER ? "trigger" : "detrigger", event.log_id, event.ratio);
+        if (send_bytes(client->socket, msg, len) <= 0) {
+            perror("write");
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool send_heartbeat(ServerClient *client) {
     client->heartbeat_request = false;
-    if (write(client->socket, "heartbeat\n", 10) == -1) {
+    if (send_bytes(client->socket, "heartbeat\n", 10) == -1) {
         perror("write");
         return false;
     }
@@ -260,6 +837,7 @@ bool send_heartbeat(ServerClient *client) {
 
 void *run_output_thread(void *arg) {
     ServerClient *client = (ServerClient *) arg;
+    output_client = client;
 
     while (client->connected) {
         sem_wait(&client->output_semaphore);
@@ -276,9 +854,17 @@ void *run_output_thread(void *arg) {
             break;
         }
 
+        if (client->events && !send_events(client)) {
+            break;
+        }
+
         if (!send_requests(client)) {
             break;
         }
+
+        if (!send_download(client)) {
+            break;
+        }
     }
 
     ZEJF_LOG(0, "client #%ld output thread finish\n", client->id);
@@ -288,9 +874,9 @@ void *run_output_thread(void *arg) {
 }
 
 void server_realtime_notify(void) {
-    pthread_mutex_lock(&clients_lock);
+    MUTEX_LOCK(&clients_lock);
     if (clients == NULL) {
-        pthread_mutex_unlock(&clients_lock);
+        MUTEX_UNLOCK(&clients_lock);
         return;
     }
     for (size_t i = 0; i < clients->item_count; i++) {
@@ -300,7 +886,23 @@ void server_realtime_notify(void) {
         }
     }
 
-    pthread_mutex_unlock(&clients_lock);
+    MUTEX_UNLOCK(&clients_lock);
+}
+
+void server_events_notify(void) {
+    MUTEX_LOCK(&clients_lock);
+    if (clients == NULL) {
+        MUTEX_UNLOCK(&clients_lock);
+        return;
+    }
+    for (size_t i = 0; i < clients->item_count; i++) {
+        ServerClient *client = *(ServerClient **) list_get(clients, i);
+        if (client->events) {
+            sem_post(&client->output_semaphore);
+        }
+    }
+
+    MUTEX_UNLOCK(&clients_lock);
 }
 
 bool send_initial_info(int socket) {
@@ -311,7 +913,7 @@ bool send_initial_info(int socket) {
     snprintf(msg[3], 32, "last_log_id:%ld\n", last_received_log_id);
 
     for (int i = 0; i < 4; i++) {
-        if (!write(socket, msg[i], strlen(msg[i]))) {
+        if (!send_all(socket, msg[i], strlen(msg[i]))) {
             perror("write");
             return false;
         }
@@ -334,6 +936,10 @@ void client_connect(int socket) {
     client->socket = socket;
     client->file = fdopen(socket, "r");
     client->realtime = false;
+    client->stream = STREAM_RAW;
+    client->rate = 0;
+    client->events = false;
+    client->last_sent_event_seq = 0;
     client->id = next_client_id++;
     client->last_heartbeat = millis();
     client->last_sent_log_id = -1;
@@ -343,6 +949,13 @@ void client_connect(int socket) {
     client->requests_head = 0;
     client->requests_tail = 0;
 
+    client->bytes_sent = 0;
+
+    client->download_next = 0;
+    client->download_last = -1;
+
+    memset(&client->decimation, 0, sizeof(DecimationBuffer));
+
     sem_init(&client->output_semaphore, 0, 0);
 
     pthread_mutex_init(&client->data_requests_mutex, NULL);
@@ -350,9 +963,9 @@ void client_connect(int socket) {
     pthread_create(&client->input_thread, NULL, run_input_thread, client);
     pthread_create(&client->output_thread, NULL, run_output_thread, client);
 
-    pthread_mutex_lock(&clients_lock);
+    MUTEX_LOCK(&clients_lock);
     list_append(clients, &client);
-    pthread_mutex_unlock(&clients_lock);
+    MUTEX_UNLOCK(&clients_lock);
 
     ZEJF_LOG(0, "current client count: %ld\n", clients->item_count);
 }
@@ -373,6 +986,7 @@ void client_destructor(void **ptr) {
     pthread_join(client->output_thread, NULL);
 
     sem_destroy(&client->output_semaphore);
+    decimation_buffer_destroy(&client->decimation);
 
     fclose(client->file);
     client->file = NULL;
@@ -446,7 +1060,7 @@ void *run_server_watchdog() {
     while (true) {
         sleep(2);
         pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-        pthread_mutex_lock(&clients_lock);
+        MUTEX_LOCK(&clients_lock);
         size_t i = 0;
         int64_t time = millis();
         while (i < clients->item_count) {
@@ -461,12 +1075,23 @@ void *run_server_watchdog() {
             }
             i++;
         }
-        pthread_mutex_unlock(&clients_lock);
+        MUTEX_UNLOCK(&clients_lock);
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
     }
     pthread_exit(0);
 }
 
+void server_write_metrics(FILE *out) {
+    MUTEX_LOCK(&clients_lock);
+    fprintf(out, "# HELP zejf_clients Connected clients\n# TYPE zejf_clients gauge\nzejf_clients %ld\n", clients == NULL ? 0 : clients->item_count);
+    fprintf(out, "# HELP zejf_client_bytes_sent_total Bytes sent to a client\n# TYPE zejf_client_bytes_sent_total counter\n");
+    for (size_t i = 0; clients != NULL && i < clients->item_count; i++) {
+        ServerClient *client = *(ServerClient **) list_get(clients, i);
+        fprintf(out, "zejf_client_bytes_sent_total{client=\"%ld\"} %lu\n", client->id, METRIC_GET(client->bytes_sent));
+    }
+    MUTEX_UNLOCK(&clients_lock);
+}
+
 size_t client_count(void) {
     if (clients == NULL) {
         return 0;
@@ -481,8 +1106,8 @@ void server_close(void) {
 }
 
 void server_destroy(void) {
-    pthread_mutex_lock(&clients_lock);
+    MUTEX_LOCK(&clients_lock);
     list_destroy(clients, client_destructor);
     clients = NULL;
-    pthread_mutex_unlock(&clients_lock);
+    MUTEX_UNLOCK(&clients_lock);
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include "decimator.h"
+
 #define CLIENT_TIMEOUT_SEC 20
 #define REALTIME_MAX_GAP_MINUTES 5
 
@@ -13,21 +15,51 @@
 #define DATA_REQUEST_MAX_LENGTH_HOURS 24
 #define DATA_REQUEST_CHUNK_SIZE_MINUTES 15
 
+#define SENDDATA_BATCH_MAX 1024
+
+#define DOWNLOAD_MAX_EMPTY_HOURS 24
+#define DOWNLOAD_BUFFER_SIZE 65536
+
 extern volatile bool server_running;
 extern volatile bool server_needs_join;
 
+#define REQUEST_LOGS 0
+#define REQUEST_SPECTROGRAM 1
+#define REQUEST_RECENT 2
+
 typedef struct datarequest_t
 {
+    int type;
+    // as selected when the request was made
+    int stream;
+    int rate;
+    // the spectrum thread has the current hour of a spectrogram request
+    bool queued;
     int64_t first_log_id;
     int64_t last_log_id;
 } DataRequest;
 
+// reused by the decimated requests of one client, grown as needed
+typedef struct decimation_buffer_t
+{
+    Fir fir; // factor 0 until the first request
+    size_t capacity;
+    double *raw;
+    int32_t *missing;
+    int64_t *log_ids;
+    int32_t *values;
+} DecimationBuffer;
+
 typedef struct serverclient_t
 {
     int socket;
     bool connected;
     bool realtime;
     bool heartbeat_request;
+    volatile int stream;
+    volatile int rate;
+    volatile bool events;
+    int64_t last_sent_event_seq;
     FILE *file;
     pthread_t input_thread;
     pthread_t output_thread;
@@ -38,25 +70,38 @@ typedef struct serverclient_t
 
     size_t id;
     int64_t last_heartbeat;
+    uint64_t bytes_sent;
 
     pthread_mutex_t data_requests_mutex;
     int requests_head;
     int requests_tail;
     DataRequest data_requests[DATA_REQUEST_BUFFER];
+    DecimationBuffer decimation;
+
+    // download cursor, the range is done once next is past last
+    int download_stream;
+    int64_t download_next;
+    int64_t download_last;
 } ServerClient;
 
 void server_init();
 
+bool send_logs(int fd, int stream, int64_t start, int64_t end, int64_t *last_ptr, char *command);
+
 void *server_run(void *arg);
 
 void *run_server_watchdog();
 
 void server_realtime_notify(void);
 
+void server_events_notify(void);
+
 void server_close(void);
 
 void server_destroy();
 
+void server_write_metrics(FILE *out);
+
 size_t client_count(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "data.h"
+#include "fft.h"
+#include "lock_profile.h"
+#include "my_string.h"
+#include "scheduler.h"
+#include "spectrum.h"
+#include "time_utils.h"
+
+pthread_mutex_t spectrum_lock;
+
+pthread_mutex_t spectrum_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+sem_t spectrum_semaphore;
+SpectrumQueued spectrum_queued[SPECTRUM_QUEUE_SIZE];
+int spectrum_queued_count = 0;
+int32_t spectrum_working_hour = -1;
+
+// newest raw sample seen by log_data, only used with data_lock held
+int64_t spectrum_newest_log_id = -1;
+
+// everything below is only used with spectrum_lock held
+Fft fft;
+int fft_size = 0;
+double *window = NULL;
+double window_power = 0;
+double *fft_re = NULL;
+double *fft_im = NULL;
+double *psd = NULL;
+int32_t *minute_samples = NULL;
+int band_first_bin[SPECTRUM_BANDS];
+int band_last_bin[SPECTRUM_BANDS];
+
+int spectrum_fft_size(void) {
+    return fft_size;
+}
+
+// bands are spaced geometrically from the first frequency bin to nyquist
+double spectrum_band_frequency(int band) {
+    double ratio = pow(fft_size / 2.0, 1.0 / SPECTRUM_BANDS);
+    return SAMPLES_PER_SECOND / (double) fft_size * pow(ratio, band + 0.5);
+}
+
+void spectrum_init(void) {
+    pthread_mutex_init(&spectrum_lock, NULL);
+    sem_init(&spectrum_semaphore, 0, 0);
+
+    // about four segments per minute, so that Welch averaging with 50 % overlap
+    // has seven of them to work with
+    fft_size = 2;
+    while (fft_size * 2 <= 60 * SAMPLES_PER_SECOND / 4) {
+        fft_size *= 2;
+    }
+
+    if (!fft_init(&fft, fft_size)) {
+        fft_size = 0;
+        return;
+    }
+
+    window = malloc(fft_size * sizeof(double));
+    fft_re = malloc(fft_size * sizeof(double));
+    fft_im = malloc(fft_size * sizeof(double));
+    psd = malloc((fft_size / 2 + 1) * sizeof(double));
+    minute_samples = malloc(60 * SAMPLES_PER_SECOND * sizeof(int32_t));
+    if (window == NULL || fft_re == NULL || fft_im == NULL || psd == NULL || minute_samples == NULL) {
+        perror("malloc");
+        spectrum_destroy();
+        return;
+    }
+
+    window_power = 0;
+    for (int i = 0; i < fft_size; i++) {
+        window[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / fft_size);
+        window_power += window[i] * window[i];
+    }
+
+    double ratio = pow(fft_size / 2.0, 1.0 / SPECTRUM_BANDS);
+    for (int band = 0; band < SPECTRUM_BANDS; band++) {
+        double low = pow(ratio, band);
+        double high = pow(ratio, band + 1);
+        band_first_bin[band] = (int) ceil(low);
+        band_last_bin[band] = band == SPECTRUM_BANDS - 1 ? fft_size / 2 : (int) ceil(high) - 1;
+        if (band_last_bin[band] < band_first_bin[band]) {
+            band_first_bin[band] = band_last_bin[band] = (int) lround(sqrt(low * high));
+        }
+    }
+}
+
+void spectrum_destroy(void) {
+    if (fft_size != 0) {
+        fft_destroy(&fft);
+    }
+    fft_size = 0;
+    free(window);
+    free(fft_re);
+    free(fft_im);
+    free(psd);
+    free(minute_samples);
+    window = fft_re = fft_im = psd = NULL;
+    minute_samples = NULL;
+}
+
+int16_t to_centi_db(double power) {
+    if (power <= 0) {
+        return SPECTRUM_NO_DATA + 1;
+    }
+    double value = round(1000.0 * log10(power));
+    return (int16_t) MAX(SPECTRUM_NO_DATA + 1, MIN(INT16_MAX, value));
+}
+
+// Welch estimate over the segments of the minute that have no gaps
+int32_t compute_minute(int16_t *values) {
+    int count = 60 * SAMPLES_PER_SECOND;
+    int32_t valid = 0;
+    for (int i = 0; i < count; i++) {
+        if (minute_samples[i] != ERR_VAL) {
+            valid++;
+        }
+    }
+
+    int segments = 0;
+    memset(psd, 0, (fft_size / 2 + 1) * sizeof(double));
+
+    for (int start = 0; start + fft_size <= count; start += fft_size / 2) {
+        int32_t *segment = minute_samples + start;
+        double mean = 0;
+        bool complete = true;
+        for (int i = 0; i < fft_size; i++) {
+            if (segment[i] == ERR_VAL) {
+                complete = false;
+                break;
+            }
+            mean += segment[i];
+        }
+        if (!complete) {
+            continue;
+        }
+        mean /= fft_size;
+
+        for (int i = 0; i < fft_size; i++) {
+            fft_re[i] = (segment[i] - mean) * window[i];
+            fft_im[i] = 0;
+        }
+        fft_forward(&fft, fft_re, fft_im);
+
+        for (int k = 0; k <= fft_size / 2; k++) {
+            psd[k] += fft_re[k] * fft_re[k] + fft_im[k] * fft_im[k];
+        }
+        segments++;
+    }
+
+    if (segments == 0) {
+        for (int band = 0; band < SPECTRUM_BANDS; band++) {
+            values[band] = SPECTRUM_NO_DATA;
+        }
+        return valid;
+    }
+
+    // one sided density, the DC and nyquist bins have no mirror image
+    double scale = 1.0 / (SAMPLES_PER_SECOND * window_power * segments);
+    for (int band = 0; band < SPECTRUM_BANDS; band++) {
+        double sum = 0;
+        for (int k = band_first_bin[band]; k <= band_last_bin[band]; k++) {
+            sum += psd[k] * (k == fft_size / 2 ? 1.0 : 2.0);
+        }
+        values[band] = to_centi_db(sum * scale / (band_last_bin[band] - band_first_bin[band] + 1));
+    }
+
+    return valid;
+}
+
+String *get_spectrum_path(int32_t hour_id) {
+    String *path = get_datahour_path_newest(STREAM_RAW, hour_id);
+    if (path == NULL) {
+        return NULL;
+    }
+    strcpy(strrchr(path->data, '.'), ".psd");
+    return path;
+}
+
+void spectrum_hour_init(SpectrumHour *sh, int32_t hour_id) {
+    sh->hour_id = hour_id;
+    sh->fft_size = fft_size;
+    for (int minute = 0; minute < SPECTRUM_MINUTES; minute++) {
+        sh->sample_counts[minute] = SPECTRUM_NOT_COMPUTED;
+    }
+}
+
+void spectrum_hour_load(SpectrumHour *sh, int32_t hour_id) {
+    String *path = get_spectrum_path(hour_id);
+    if (path == NULL) {
+        spectrum_hour_init(sh, hour_id);
+        return;
+    }
+
+    FILE *file = fopen(path->data, "rb");
+    string_destroy(path);
+    if (file == NULL) {
+        spectrum_hour_init(sh, hour_id);
+        return;
+    }
+
+    // a different fft size means the file was written for another setup
+    if (fread(sh, sizeof(SpectrumHour), 1, file) != 1 || sh->hour_id != hour_id || sh->fft_size != fft_size) {
+        spectrum_hour_init(sh, hour_id);
+    }
+    fclose(file);
+}
+
+bool spectrum_hour_save(SpectrumHour *sh) {
+    String *path = get_spectrum_path(sh->hour_id);
+    if (path == NULL) {
+        return false;
+    }
+
+    if (mkpath(path->data, 0700) != 0) {
+        perror("mkdir");
+        string_destroy(path);
+        return false;
+    }
+
+    // readers don't take spectrum_lock, so the file is replaced as a whole
+    String *tmp_path = string_create(path->data);
+    string_append(tmp_path, ".tmp");
+    FILE *file = fopen(tmp_path->data, "wb");
+    if (file == NULL) {
+        perror(tmp_path->data);
+        string_destroy(path);
+        string_destroy(tmp_path);
+        return false;
+    }
+
+    bool result = fwrite(sh, sizeof(SpectrumHour), 1, file) == 1;
+    result = fclose(file) == 0 && result;
+    if (result && rename(tmp_path->data, path->data) != 0) {
+        perror("rename");
+        result = false;
+    }
+    if (!result) {
+        unlink(tmp_path->data);
+    }
+    string_destroy(path);
+    string_destroy(tmp_path);
+    return result;
+}
+
+// a late sample moves last_received_log_id back, the newest one seen doesn't
+int64_t spectrum_last_log_id(void) {
+    MUTEX_LOCK(&data_lock);
+    int64_t last_log_id = MAX(last_received_log_id, spectrum_newest_log_id);
+    MUTEX_UNLOCK(&data_lock);
+    return last_log_id;
+}
+
+// copies one minute of raw data, false if the hour does not exist
+bool copy_minute(int32_t hour_id, int minute) {
+    MUTEX_LOCK(&data_lock);
+    DataHour *dh = get_datahour(STREAM_RAW, hour_id, true, false);
+    if (dh != NULL) {
+        datahour_read_samples(dh, minute * 60 * SAMPLES_PER_SECOND, 60 * SAMPLES_PER_SECOND, minute_samples);
+    }
+    MUTEX_UNLOCK(&data_lock);
+    return dh != NULL;
+}
+
+// Computes the minutes of the hour that are complete and were not computed yet
+// or are stale, and stores them
+bool spectrum_update_hour(int32_t hour_id, uint64_t stale_minutes) {
+    SpectrumHour sh;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    int64_t last_log_id = spectrum_last_log_id();
+
+    if (last_log_id == -1) {
+        last_log_id = nanos_to_log_id(nanos());
+    }
+
+    MUTEX_LOCK(&spectrum_lock);
+    if (fft_size == 0) {
+        MUTEX_UNLOCK(&spectrum_lock);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        return false;
+    }
+
+    spectrum_hour_load(&sh, hour_id);
+
+    bool modified = false;
+    bool hour_exists = true;
+    for (int minute = 0; minute < SPECTRUM_MINUTES; minute++) {
+        int64_t minute_end = get_first_log_id(hour_id) + (minute + 1) * 60l * SAMPLES_PER_SECOND - 1;
+        bool stale = (stale_minutes >> minute) & 1;
+        if ((sh.sample_counts[minute] != SPECTRUM_NOT_COMPUTED && !stale) || minute_end + SPECTRUM_DELAY_SEC * SAMPLES_PER_SECOND > last_log_id) {
+            continue;
+        }
+
+        if (hour_exists) {
+            hour_exists = copy_minute(hour_id, minute);
+        }
+
+        if (!hour_exists) {
+            sh.sample_counts[minute] = 0;
+            for (int band = 0; band < SPECTRUM_BANDS; band++) {
+                sh.values[minute][band] = SPECTRUM_NO_DATA;
+            }
+            continue;
+        }
+
+        sh.sample_counts[minute] = compute_minute(sh.values[minute]);
+        modified = true;
+    }
+
+    // nothing worth a file if there was no data at all
+    if (modified) {
+        spectrum_hour_save(&sh);
+    }
+
+    MUTEX_UNLOCK(&spectrum_lock);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+    return true;
+}
+
+// hands the hour to the spectrum thread, merging with an earlier entry
+void spectrum_queue(int32_t hour_id, uint64_t stale_minutes) {
+    MUTEX_LOCK(&spectrum_queue_lock);
+    int i = 0;
+    while (i < spectrum_queued_count && spectrum_queued[i].hour_id != hour_id) {
+        i++;
+    }
+    bool wake = true;
+    if (i < spectrum_queued_count) {
+        wake = (spectrum_queued[i].stale_minutes | stale_minutes) != spectrum_queued[i].stale_minutes;
+        spectrum_queued[i].stale_minutes |= stale_minutes;
+    } else if (spectrum_queued_count < SPECTRUM_QUEUE_SIZE) {
+        spectrum_queued[spectrum_queued_count].hour_id = hour_id;
+        spectrum_queued[spectrum_queued_count].stale_minutes = stale_minutes;
+        spectrum_queued_count++;
+    } else {
+        ZEJF_LOG(1, "Spectrum queue full, hour %d not queued\n", hour_id);
+        wake = false;
+    }
+    MUTEX_UNLOCK(&spectrum_queue_lock);
+
+    if (wake) {
+        sem_post(&spectrum_semaphore);
+    }
+}
+
+// true while the hour is queued or being computed
+bool spectrum_pending(int32_t hour_id) {
+    MUTEX_LOCK(&spectrum_queue_lock);
+    bool pending = spectrum_working_hour == hour_id;
+    for (int i = 0; i < spectrum_queued_count && !pending; i++) {
+        pending = spectrum_queued[i].hour_id == hour_id;
+    }
+    MUTEX_UNLOCK(&spectrum_queue_lock);
+    return pending;
+}
+
+// called by log_data for every raw sample, a sample in a minute that was
+// already due makes its stored spectrum stale
+void spectrum_sample(int64_t log_id) {
+    // the hours loaded at startup already count
+    if (spectrum_newest_log_id == -1) {
+        spectrum_newest_log_id = last_received_log_id;
+    }
+    if (log_id > spectrum_newest_log_id) {
+        spectrum_newest_log_id = log_id;
+        return;
+    }
+
+    int64_t minute_log_ids = 60l * SAMPLES_PER_SECOND;
+    int64_t minute = log_id / minute_log_ids;
+    if ((minute + 1) * minute_log_ids - 1 + SPECTRUM_DELAY_SEC * SAMPLES_PER_SECOND > spectrum_newest_log_id) {
+        return;
+    }
+    spectrum_queue((int32_t) (minute / SPECTRUM_MINUTES), 1ull << (minute % SPECTRUM_MINUTES));
+}
+
+// the stored spectra of the hour, false if they are not available at all
+bool spectrum_read_hour(int32_t hour_id, SpectrumHour *result) {
+    if (fft_size == 0) {
+        return false;
+    }
+    spectrum_hour_load(result, hour_id);
+    return true;
+}
+
+// whether some minutes that are complete were never computed
+bool spectrum_hour_missing(SpectrumHour *sh) {
+    int64_t last_log_id = spectrum_last_log_id();
+
+    for (int minute = 0; minute < SPECTRUM_MINUTES; minute++) {
+        int64_t minute_end = get_first_log_id(sh->hour_id) + (minute + 1) * 60l * SAMPLES_PER_SECOND - 1;
+        if (sh->sample_counts[minute] == SPECTRUM_NOT_COMPUTED && minute_end + SPECTRUM_DELAY_SEC * SAMPLES_PER_SECOND <= last_log_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void run_queued(void) {
+    while (true) {
+        MUTEX_LOCK(&spectrum_queue_lock);
+        if (spectrum_queued_count == 0) {
+            spectrum_working_hour = -1;
+            MUTEX_UNLOCK(&spectrum_queue_lock);
+            return;
+        }
+        SpectrumQueued entry = spectrum_queued[0];
+        spectrum_queued_count--;
+        memmove(spectrum_queued, spectrum_queued + 1, spectrum_queued_count * sizeof(SpectrumQueued));
+        spectrum_working_hour = entry.hour_id;
+        MUTEX_UNLOCK(&spectrum_queue_lock);
+
+        spectrum_update_hour(entry.hour_id, entry.stale_minutes);
+    }
+}
+
+void *run_spectrum() {
+    // only uses the cpu time nobody else wants
+    struct sched_param param = { 0 };
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        ZEJF_LOG(1, "Cannot lower the priority of the spectrum thread\n");
+    }
+
+    int64_t minute_log_ids = 60l * SAMPLES_PER_SECOND;
+    int64_t next_minute = -1;
+    int64_t next_pass_ms = 0;
+
+    while (true) {
+        // queued hours are done right away, the new minutes every interval
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SPECTRUM_INTERVAL_SEC;
+        sem_timedwait(&spectrum_semaphore, &deadline);
+
+        run_queued();
+        if (millis() < next_pass_ms) {
+            continue;
+        }
+        next_pass_ms = millis() + SPECTRUM_INTERVAL_SEC * 1000;
+
+        int64_t last_log_id = spectrum_last_log_id();
+        if (last_log_id == -1) {
+            continue;
+        }
+
+        // minutes before this one are complete
+        int64_t complete = (last_log_id - SPECTRUM_DELAY_SEC * SAMPLES_PER_SECOND + 1) / minute_log_ids;
+        if (next_minute == -1 || complete - next_minute > SPECTRUM_MINUTES) {
+            next_minute = complete - 1;
+        }
+
+        for (int64_t minute = next_minute; minute < complete; minute = (minute / SPECTRUM_MINUTES + 1) * SPECTRUM_MINUTES) {
+            spectrum_update_hour((int32_t) (minute / SPECTRUM_MINUTES), 0);
+        }
+
+        if (complete > next_minute) {
+            next_minute = complete;
+        }
+    }
+}
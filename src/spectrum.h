@@ -0,0 +1,58 @@
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SPECTRUM_BANDS 64
+#define SPECTRUM_MINUTES 60
+#define SPECTRUM_INTERVAL_SEC 10
+#define SPECTRUM_DELAY_SEC 5
+#define SPECTRUM_NO_DATA INT16_MIN
+#define SPECTRUM_NOT_COMPUTED -1
+#define SPECTRUM_QUEUE_SIZE 64
+
+// Welch PSD of every minute of one hour of raw data, averaged into log spaced
+// bands and stored in hundredths of dB relative to 1 count^2/Hz
+typedef struct spectrum_hour_t
+{
+    int32_t hour_id;
+    int32_t fft_size;
+    int32_t sample_counts[SPECTRUM_MINUTES];
+    int16_t values[SPECTRUM_MINUTES][SPECTRUM_BANDS];
+} SpectrumHour;
+
+// an hour waiting for the spectrum thread, the stale minutes are recomputed
+// along with the ones never computed
+typedef struct spectrum_queued_t
+{
+    int32_t hour_id;
+    uint64_t stale_minutes;
+} SpectrumQueued;
+
+extern pthread_mutex_t spectrum_lock;
+
+void spectrum_init(void);
+
+void spectrum_destroy(void);
+
+int spectrum_fft_size(void);
+
+double spectrum_band_frequency(int band);
+
+bool spectrum_update_hour(int32_t hour_id, uint64_t stale_minutes);
+
+void spectrum_queue(int32_t hour_id, uint64_t stale_minutes);
+
+bool spectrum_pending(int32_t hour_id);
+
+void spectrum_sample(int64_t log_id);
+
+bool spectrum_read_hour(int32_t hour_id, SpectrumHour *result);
+
+bool spectrum_hour_missing(SpectrumHour *sh);
+
+void *run_spectrum();
+
+#endif
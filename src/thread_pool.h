@@ -0,0 +1,44 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*ThreadPoolTask)(void *arg);
+
+typedef struct thread_pool_job_t
+{
+    ThreadPoolTask task;
+    void *arg;
+} ThreadPoolJob;
+
+// Fixed number of workers and a bounded queue, submitting blocks while the
+// queue is full
+typedef struct thread_pool_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t idle;
+
+    ThreadPoolJob *jobs;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t running;
+    bool stopping;
+
+    pthread_t *threads;
+    size_t thread_count;
+} ThreadPool;
+
+ThreadPool *thread_pool_create(size_t thread_count, size_t capacity);
+
+void thread_pool_submit(ThreadPool *pool, ThreadPoolTask task, void *arg);
+
+void thread_pool_wait(ThreadPool *pool);
+
+void thread_pool_destroy(ThreadPool *pool);
+
+#endif
@@ -22,16 +22,34 @@ int64_t micros(void) {
     return s1 + s2;
 }
 
+int64_t nanos(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_REALTIME, &time);
+    return (int64_t) (time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
 int32_t hours(void) {
     struct timeval time;
     gettimeofday(&time, NULL);
     return (int32_t) (time.tv_sec / (60 * 60));
 }
 
+// log_id n is the sample taken at exactly n / SAMPLES_PER_SECOND seconds since epoch,
+// so every hour holds exactly SAMPLES_IN_HOUR log_ids whatever the rate is
+
 int32_t get_hour_id(int64_t log_id) {
-    return (log_id * (SAMPLE_TIME_MS)) / (1000 * 60 * 60);
+    return log_id / SAMPLES_IN_HOUR;
 }
 
 int64_t get_first_log_id(int32_t hour_id) {
-    return (hour_id * 1000l * 60 * 60) / SAMPLE_TIME_MS;
+    return (int64_t) hour_id * SAMPLES_IN_HOUR;
+}
+
+// split into whole seconds first so that the multiplication can't overflow
+int64_t log_id_to_nanos(int64_t log_id) {
+    return (log_id / SAMPLES_PER_SECOND) * 1000000000l + ((log_id % SAMPLES_PER_SECOND) * 1000000000l) / SAMPLES_PER_SECOND;
+}
+
+int64_t nanos_to_log_id(int64_t time_ns) {
+    return (time_ns / 1000000000l) * SAMPLES_PER_SECOND + ((time_ns % 1000000000l) * SAMPLES_PER_SECOND) / 1000000000l;
 }
\ No newline at end of file
@@ -10,10 +10,16 @@ int64_t millis(void);
 
 int64_t micros(void);
 
+int64_t nanos(void);
+
 int32_t hours(void);
 
 int32_t get_hour_id(int64_t log_id);
 
 int64_t get_first_log_id(int32_t hour_id);
 
+int64_t log_id_to_nanos(int64_t log_id);
+
+int64_t nanos_to_log_id(int64_t time_ns);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "lock_profile.h"
+#include "time_utils.h"
+#include "trace.h"
+
+volatile bool trace_enabled = false;
+
+TraceStages trace_stages;
+
+// every TRACE_SAMPLE_INTERVAL-th batch waits here for its realtime write
+TraceBatch trace_ring[TRACE_RING_SIZE];
+int64_t trace_ring_count = 0;
+int64_t trace_batches = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// called by the queue thread once the batch is stored, right before clients are notified
+void trace_batch(TraceBatch *batch) {
+    metrics_observe(&trace_stages.queue, batch->dequeue_us - batch->arrival_us);
+    metrics_observe(&trace_stages.store, batch->stored_us - batch->dequeue_us);
+    metrics_observe(&trace_stages.notify, batch->notify_us - batch->stored_us);
+
+    if (trace_batches++ % TRACE_SAMPLE_INTERVAL != 0) {
+        return;
+    }
+
+    MUTEX_LOCK(&trace_lock);
+    batch->write_us = 0;
+    trace_ring[trace_ring_count % TRACE_RING_SIZE] = *batch;
+    trace_ring_count++;
+    MUTEX_UNLOCK(&trace_lock);
+}
+
+// an output thread wrote the realtime samples first_log_id to last_log_id
+void trace_write(int64_t first_log_id, int64_t last_log_id) {
+    int64_t now = micros();
+    MUTEX_LOCK(&trace_lock);
+    for (int64_t i = MAX(0, trace_ring_count - TRACE_RING_SIZE); i < trace_ring_count; i++) {
+        TraceBatch *batch = &trace_ring[i % TRACE_RING_SIZE];
+        if (batch->write_us != 0 || batch->last_log_id < first_log_id || batch->last_log_id > last_log_id) {
+            continue;
+        }
+        batch->write_us = now;
+        metrics_observe(&trace_stages.write, now - batch->notify_us);
+        metrics_observe(&trace_stages.total, now - batch->arrival_us);
+    }
+    MUTEX_UNLOCK(&trace_lock);
+}
+
+void trace_print(void) {
+    TraceBatch batches[TRACE_PRINT_COUNT];
+    MUTEX_LOCK(&trace_lock);
+    int64_t first = MAX(0, trace_ring_count - TRACE_PRINT_COUNT);
+    int count = trace_ring_count - first;
+    for (int i = 0; i < count; i++) {
+        batches[i] = trace_ring[(first + i) % TRACE_RING_SIZE];
+    }
+    MUTEX_UNLOCK(&trace_lock);
+
+    printf("\n========= Sample latency ===========\n");
+    printf("tracing: %s, %ld batches\n", trace_enabled ? "on" : "off", trace_batches);
+    metrics_print_histogram("serial to queue thread", &trace_stages.queue);
+    metrics_print_histogram("log_data", &trace_stages.store);
+    metrics_print_histogram("stored to notify", &trace_stages.notify);
+    metrics_print_histogram("notify to write", &trace_stages.write);
+    metrics_print_histogram("serial to write", &trace_stages.total);
+
+    printf("\nlast log id, samples, queue, store, notify, write (us)\n");
+    for (int i = 0; i < count; i++) {
+        TraceBatch *batch = &batches[i];
+        printf("%ld %ld %ld %ld %ld ", batch->last_log_id, batch->count, batch->dequeue_us - batch->arrival_us, batch->stored_us - batch->dequeue_us, batch->notify_us - batch->stored_us);
+        if (batch->write_us != 0) {
+            printf("%ld\n", batch->write_us - batch->notify_us);
+        } else {
+            printf("-\n");
+        }
+    }
+    printf("================================\n\n");
+}
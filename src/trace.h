@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+#define TRACE_RING_SIZE 64
+#define TRACE_SAMPLE_INTERVAL 16
+#define TRACE_PRINT_COUNT 16
+
+// Timestamps of one queue thread batch, in micros(). arrival_us is the
+// arrival of its oldest sample, write_us the first realtime write that
+// contained its newest sample.
+typedef struct trace_batch_t
+{
+    int64_t first_log_id;
+    int64_t last_log_id;
+    size_t count;
+    int64_t arrival_us;
+    int64_t dequeue_us;
+    int64_t stored_us;
+    int64_t notify_us;
+    int64_t write_us;
+} TraceBatch;
+
+typedef struct trace_stages_t
+{
+    Histogram queue;
+    Histogram store;
+    Histogram notify;
+    Histogram write;
+    Histogram total;
+} TraceStages;
+
+extern volatile bool trace_enabled;
+
+void trace_batch(TraceBatch *batch);
+
+void trace_write(int64_t first_log_id, int64_t last_log_id);
+
+void trace_print(void);
+
+#endif
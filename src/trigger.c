@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "data.h"
+#include "lock_profile.h"
+#include "scheduler.h"
+#include "time_utils.h"
+#include "trigger.h"
+
+Event events[EVENT_BUFFER];
+int64_t last_event_seq = 0;
+pthread_mutex_t events_lock;
+FILE *event_log = NULL;
+
+void trigger_init(Trigger *trigger, int sample_rate, double sta_sec, double lta_sec, double on, double off) {
+    trigger->sta_coef = 1.0 / (sta_sec * sample_rate);
+    trigger->lta_coef = 1.0 / (lta_sec * sample_rate);
+    trigger->dc_coef = trigger->lta_coef;
+    trigger->on = on;
+    trigger->off = off;
+    trigger->warmup_samples = (int64_t) (lta_sec * sample_rate);
+    trigger->warmup = trigger->warmup_samples;
+    trigger->mean = 0;
+    trigger->sta = 0;
+    trigger->lta = 0;
+    trigger->last_log_id = -1;
+    trigger->triggered = false;
+    trigger->peak_ratio = 0;
+}
+
+bool trigger_update(Trigger *trigger, int64_t log_id, int32_t value, Event *event) {
+    if (value == ERR_VAL) {
+        return false;
+    }
+
+    // the averages are meaningless after a gap, let the LTA fill up again
+    if (trigger->last_log_id == -1 || log_id != trigger->last_log_id + 1) {
+        trigger->mean = value;
+        trigger->sta = 0;
+        trigger->lta = 0;
+        trigger->warmup = trigger->warmup_samples;
+    }
+    trigger->last_log_id = log_id;
+
+    trigger->mean += (value - trigger->mean) * trigger->dc_coef;
+    double x = value - trigger->mean;
+    double energy = x * x;
+    trigger->sta += (energy - trigger->sta) * trigger->sta_coef;
+    trigger->lta += (energy - trigger->lta) * trigger->lta_coef;
+
+    if (trigger->warmup > 0) {
+        trigger->warmup--;
+        return false;
+    }
+
+    if (trigger->lta <= 0) {
+        return false;
+    }
+
+    double ratio = trigger->sta / trigger->lta;
+
+    if (!trigger->triggered) {
+        if (ratio < trigger->on) {
+            return false;
+        }
+        trigger->triggered = true;
+        trigger->peak_ratio = ratio;
+        event->type = EVENT_TRIGGER;
+        event->ratio = ratio;
+    } else {
+        if (ratio > trigger->peak_ratio) {
+            trigger->peak_ratio = ratio;
+        }
+        if (ratio > trigger->off) {
+            return false;
+        }
+        trigger->triggered = false;
+        event->type = EVENT_DETRIGGER;
+        event->ratio = trigger->peak_ratio;
+    }
+
+    event->log_id = log_id;
+    return true;
+}
+
+void events_init(void) {
+    pthread_mutex_init(&events_lock, NULL);
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s%d_sps", MAIN_FOLDER, SAMPLES_PER_SECOND);
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        perror(path);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s%d_sps/%s", MAIN_FOLDER, SAMPLES_PER_SECOND, EVENT_LOG_FILE);
+    event_log = fopen(path, "a");
+    if (event_log == NULL) {
+        perror(path);
+    }
+}
+
+// one line per event: UTC time, type, log_id and STA/LTA ratio (peak ratio for detrigger)
+void events_push(Event *event) {
+    MUTEX_LOCK(&events_lock);
+    event->seq = ++last_event_seq;
+    events[event->seq % EVENT_BUFFER] = *event;
+    MUTEX_UNLOCK(&events_lock);
+
+    int64_t time_ns = log_id_to_nanos(event->log_id);
+    time_t seconds = time_ns / 1000000000;
+    struct tm t;
+    char text[32];
+    gmtime_r(&seconds, &t);
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &t);
+
+    char *type = event->type == EVENT_TRIGGER ? "trigger" : "detrigger";
+    ZEJF_LOG(1, "%s at %s.%03ld UTC, STA/LTA %.2f\n", type, text, (time_ns / 1000000) % 1000, event->ratio);
+
+    if (event_log != NULL) {
+        fprintf(event_log, "%s.%03ld %s %ld %.3f\n", text, (time_ns / 1000000) % 1000, type, event->log_id, event->ratio);
+        fflush(event_log);
+    }
+}
+
+bool events_get(int64_t seq, Event *event) {
+    bool result = false;
+    MUTEX_LOCK(&events_lock);
+    if (seq > 0 && seq <= last_event_seq && seq > last_event_seq - EVENT_BUFFER) {
+        *event = events[seq % EVENT_BUFFER];
+        result = true;
+    }
+    MUTEX_UNLOCK(&events_lock);
+    return result;
+}
+
+void events_destroy(void) {
+    if (event_log != NULL) {
+        fclose(event_log);
+        event_log = NULL;
+    }
+    pthread_mutex_destroy(&events_lock);
+}
@@ -0,0 +1,60 @@
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRIGGER_DEFAULT_STA_SEC 1.0
+#define TRIGGER_DEFAULT_LTA_SEC 60.0
+#define TRIGGER_DEFAULT_ON 4.0
+#define TRIGGER_DEFAULT_OFF 1.5
+
+#define EVENT_BUFFER 64
+#define EVENT_LOG_FILE "events.log"
+
+#define EVENT_TRIGGER 0
+#define EVENT_DETRIGGER 1
+
+typedef struct event_t
+{
+    int64_t seq;
+    int type;
+    int64_t log_id;
+    double ratio;
+} Event;
+
+// Recursive STA/LTA on the energy of the signal, O(1) per sample
+typedef struct trigger_t
+{
+    double sta_coef;
+    double lta_coef;
+    double dc_coef;
+    double on;
+    double off;
+
+    double mean;
+    double sta;
+    double lta;
+    int64_t warmup;
+    int64_t warmup_samples;
+    int64_t last_log_id;
+
+    bool triggered;
+    double peak_ratio;
+} Trigger;
+
+extern int64_t last_event_seq;
+
+void trigger_init(Trigger *trigger, int sample_rate, double sta_sec, double lta_sec, double on, double off);
+
+bool trigger_update(Trigger *trigger, int64_t log_id, int32_t value, Event *event);
+
+void events_init(void);
+
+void events_push(Event *event);
+
+bool events_get(int64_t seq, Event *event);
+
+void events_destroy(void);
+
+#endif
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Pretends to be the ZejfSeis Arduino on a pseudo terminal so that the server
+// can be run and measured without hardware. Must match SAMPLE_RATES in data.c.
+const int SAMPLE_RATES[] = { 20, 40, 60, 100, 200, 500, 1000 };
+#define SAMPLE_RATE_COUNT (int) (sizeof(SAMPLE_RATES) / sizeof(SAMPLE_RATES[0]))
+
+#define SHIFT_UNIT_NS 1000
+
+volatile bool running = true;
+
+void on_signal(int sig) {
+    (void) sig;
+    running = false;
+}
+
+void print_usage(void) {
+    printf("Usage: [-d <drift ppm>] [-j <jitter us>] [-g <gap probability>] [-w <log_num wraparound>] [-t <duration s>]\n");
+}
+
+int64_t monotonic_nanos(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t) (time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+void sleep_until(int64_t time_ns) {
+    struct timespec ts;
+    ts.tv_sec = time_ns / 1000000000;
+    ts.tv_nsec = time_ns % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && running) {
+    }
+}
+
+int open_pty(void) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1) {
+        perror("posix_openpt");
+        return -1;
+    }
+    if (grantpt(master) == -1 || unlockpt(master) == -1) {
+        perror("grantpt");
+        close(master);
+        return -1;
+    }
+
+    struct termios tty;
+    if (tcgetattr(master, &tty) == 0) {
+        cfmakeraw(&tty);
+        tcsetattr(master, TCSANOW, &tty);
+    }
+
+    return master;
+}
+
+int wait_for_rate(int master) {
+    char c;
+    bool got_r = false;
+    while (running) {
+        ssize_t count = read(master, &c, 1);
+        if (count <= 0) {
+            // no slave connected yet
+            usleep(100 * 1000);
+            continue;
+        }
+        if (got_r && c >= '0' && c < '0' + SAMPLE_RATE_COUNT) {
+            return c - '0';
+        }
+        got_r = c == 'r';
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    double drift_ppm = 0;
+    double jitter_us = 0;
+    double gap_probability = 0;
+    int wraparound = 32768;
+    int duration = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:j:g:w:t:")) != -1) {
+        switch (opt) {
+        case 'd':
+            drift_ppm = atof(optarg);
+            break;
+        case 'j':
+            jitter_us = atof(optarg);
+            break;
+        case 'g':
+            gap_probability = atof(optarg);
+            break;
+        case 'w':
+            wraparound = atoi(optarg);
+            break;
+        case 't':
+            duration = atoi(optarg);
+            break;
+        default:
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (wraparound < 2) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    int master = open_pty();
+    if (master == -1) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%s\n", ptsname(master));
+    fflush(stdout);
+
+    int rate_id = wait_for_rate(master);
+    if (rate_id == -1) {
+        close(master);
+        return EXIT_FAILURE;
+    }
+
+    int sample_rate = SAMPLE_RATES[rate_id];
+    fprintf(stderr, "simulating %d sps, drift %.1fppm, jitter %.0fus, gaps %.4f, wraparound %d\n", sample_rate, drift_ppm, jitter_us, gap_probability, wraparound);
+
+    srand(1);
+
+    int shift = 0;
+    int log_num = 0;
+    int64_t sent = 0;
+    int64_t skipped = 0;
+    int64_t corrections = 0;
+    int64_t start = monotonic_nanos();
+    int64_t next = start;
+    double phase = 0;
+
+    struct pollfd pfd = { .fd = master, .events = POLLIN };
+
+    while (running && (duration == 0 || next - start < duration * 1000000000l)) {
+        next += (int64_t) (1000000000.0 / sample_rate * (1.0 + drift_ppm / 1000000.0)) + shift * SHIFT_UNIT_NS;
+
+        int64_t jitter = (int64_t) (jitter_us * 1000.0 * rand() / RAND_MAX);
+        sleep_until(next + jitter);
+
+        while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+            char buffer[64];
+            ssize_t count = read(master, buffer, sizeof(buffer));
+            if (count <= 0) {
+                break;
+            }
+            for (ssize_t i = 0; i < count; i++) {
+                if (buffer[i] == '+') {
+                    shift++;
+                    corrections++;
+                } else if (buffer[i] == '-') {
+                    shift--;
+                    corrections++;
+                }
+            }
+        }
+
+        log_num = (log_num + 1) % wraparound;
+
+        if (gap_probability > 0 && rand() < gap_probability * RAND_MAX) {
+            skipped++;
+            continue;
+        }
+
+        phase += 2.0 * M_PI / sample_rate;
+        int32_t value = (int32_t) (10000.0 * sin(phase) + (rand() % 200) - 100);
+
+        char line[64];
+        int len = snprintf(line, sizeof(line), "s%dv%dl%d\n", shift, value, log_num);
+        if (write(master, line, len) == -1) {
+            if (errno == EIO) {
+                // slave closed, wait for the server to reopen the port
+                usleep(100 * 1000);
+                continue;
+            }
+            perror("write");
+            break;
+        }
+        sent++;
+    }
+
+    fprintf(stderr, "sent %ld samples, skipped %ld, corrections %ld, final shift %d\n", sent, skipped, corrections, shift);
+
+    close(master);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arraylist.h"
+#include "data.h"
+#include "hour_index.h"
+#include "server.h"
+#include "time_utils.h"
+
+#define BENCHMARK_LIST_ITEMS 1000000
+#define BENCHMARK_LIST_REMOVE_ITEMS 20000
+#define BENCHMARK_LOOKUPS 2000000
+#define BENCHMARK_MISS_HOURS 8
+#define BENCHMARK_FILE_OPS 5
+
+// Every benchmark runs once to warm up and then repeats times on the same
+// data. The best and the mean time per operation are printed as CSV on the
+// original stdout. The server code logs with printf and perror, so stdout
+// and stderr themselves go to /dev/null.
+typedef int64_t (*Benchmark)(int64_t *operations);
+
+FILE *results = NULL;
+int repeats = 5;
+int32_t base_hour_id;
+uint32_t random_state;
+
+int64_t monotonic_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// fixed seed, every run sees the same samples
+int32_t random_sample(void) {
+    random_state = random_state * 1664525u + 1013904223u;
+    return (int32_t) (random_state >> 12) - (1 << 19);
+}
+
+void run_benchmark(const char *name, Benchmark benchmark) {
+    int64_t best = INT64_MAX;
+    int64_t total = 0;
+    int64_t operations = 0;
+    random_state = 12345;
+    benchmark(&operations);
+    for (int i = 0; i < repeats; i++) {
+        random_state = 12345;
+        int64_t elapsed = benchmark(&operations);
+        best = MIN(best, elapsed);
+        total += elapsed;
+    }
+    fprintf(results, "%s,%d,%ld,%.2f,%.2f\n", name, SAMPLES_PER_SECOND, operations, best / (double) operations, total / (double) repeats / operations);
+    fflush(results);
+}
+
+void set_sample_rate(int sample_rate) {
+    SAMPLES_PER_SECOND = sample_rate;
+    SAMPLES_IN_HOUR = SAMPLES_PER_SECOND * 60 * 60;
+}
+
+int64_t bench_list_append(int64_t *operations) {
+    ArrayList *list = list_create(sizeof(int64_t));
+    int64_t start = monotonic_ns();
+    for (int64_t i = 0; i < BENCHMARK_LIST_ITEMS; i++) {
+        list_append(list, &i);
+    }
+    int64_t elapsed = monotonic_ns() - start;
+    list_destroy(list, NULL);
+    *operations = BENCHMARK_LIST_ITEMS;
+    return elapsed;
+}
+
+// from the front, the expensive end
+int64_t bench_list_remove(int64_t *operations) {
+    ArrayList *list = list_create(sizeof(int64_t));
+    for (int64_t i = 0; i < BENCHMARK_LIST_REMOVE_ITEMS; i++) {
+        list_append(list, &i);
+    }
+    int64_t start = monotonic_ns();
+    while (list->item_count > 0) {
+        list_remove(list, 0, NULL);
+    }
+    int64_t elapsed = monotonic_ns() - start;
+    list_destroy(list, NULL);
+    *operations = BENCHMARK_LIST_REMOVE_ITEMS;
+    return elapsed;
+}
+
+// one hour of the raw stream, creating the hour on the first call
+int64_t bench_log_data(int64_t *operations) {
+    int64_t first_log_id = get_first_log_id(base_hour_id);
+    int64_t start = monotonic_ns();
+    pthread_mutex_lock(&data_lock);
+    for (int64_t i = 0; i < SAMPLES_IN_HOUR; i++) {
+        log_data(STREAM_RAW, first_log_id + i, random_sample());
+    }
+    pthread_mutex_unlock(&data_lock);
+    *operations = SAMPLES_IN_HOUR;
+    return monotonic_ns() - start;
+}
+
+int64_t bench_get_log(int64_t *operations) {
+    int64_t first_log_id = get_first_log_id(base_hour_id);
+    int64_t start = monotonic_ns();
+    pthread_mutex_lock(&data_lock);
+    for (int64_t i = 0; i < SAMPLES_IN_HOUR; i++) {
+        get_log(STREAM_RAW, first_log_id + i);
+    }
+    pthread_mutex_unlock(&data_lock);
+    *operations = SAMPLES_IN_HOUR;
+    return monotonic_ns() - start;
+}
+
+// cycles through the loaded hours so that every lookup scans the list
+int64_t bench_get_datahour_hit(int64_t *operations) {
+    int64_t start = monotonic_ns();
+    pthread_mutex_lock(&data_lock);
+    for (int64_t i = 0; i < BENCHMARK_LOOKUPS; i++) {
+        get_datahour(STREAM_RAW, base_hour_id - i % PERMANENTLY_LOADED_HOURS, true, true);
+    }
+    pthread_mutex_unlock(&data_lock);
+    *operations = BENCHMARK_LOOKUPS;
+    return monotonic_ns() - start;
+}
+
+// saved hours loaded from disk, the page cache is warm after the first run
+int64_t bench_get_datahour_miss(int64_t *operations) {
+    data_destroy();
+    data_init();
+    int64_t start = monotonic_ns();
+    pthread_mutex_lock(&data_lock);
+    for (int i = 0; i < BENCHMARK_MISS_HOURS; i++) {
+        get_datahour(STREAM_RAW, base_hour_id - i, true, false);
+    }
+    pthread_mutex_unlock(&data_lock);
+    *operations = BENCHMARK_MISS_HOURS;
+    return monotonic_ns() - start;
+}
+
+int64_t bench_send_logs(int64_t *operations) {
+    int fd = open("/dev/null", O_WRONLY);
+    int64_t first_log_id = get_first_log_id(base_hour_id);
+    int64_t last_sent;
+    int64_t start = monotonic_ns();
+    send_logs(fd, STREAM_RAW, first_log_id, first_log_id + SAMPLES_IN_HOUR - 1, &last_sent, "logs\n");
+    int64_t elapsed = monotonic_ns() - start;
+    close(fd);
+    *operations = SAMPLES_IN_HOUR;
+    return elapsed;
+}
+
+DataHour *file_hour = NULL;
+
+int64_t bench_datahour_save(int64_t *operations) {
+    int64_t start = monotonic_ns();
+    for (int i = 0; i < BENCHMARK_FILE_OPS; i++) {
+        file_hour->modified = true;
+        datahour_save(file_hour);
+    }
+    *operations = BENCHMARK_FILE_OPS;
+    return monotonic_ns() - start;
+}
+
+int64_t bench_datahour_load(int64_t *operations) {
+    String *path = get_datahour_path_newest(STREAM_RAW, base_hour_id);
+    int64_t start = monotonic_ns();
+    for (int i = 0; i < BENCHMARK_FILE_OPS; i++) {
+        FILE *file = fopen(path->data, "rb");
+        datahour_destroy(datahour_load(file, STREAM_RAW));
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+    int64_t elapsed = monotonic_ns() - start;
+    string_destroy(path);
+    *operations = BENCHMARK_FILE_OPS;
+    return elapsed;
+}
+
+void run_file_benchmarks(void) {
+    for (int i = 0; i < SAMPLE_RATE_COUNT; i++) {
+        set_sample_rate(SAMPLE_RATES[i]);
+        hour_index_init();
+        file_hour = datahour_create(STREAM_RAW, base_hour_id);
+        random_state = 12345;
+        for (int j = 0; j < SAMPLES_IN_HOUR; j++) {
+            datahour_set(file_hour, j, random_sample());
+        }
+        file_hour->sample_count = SAMPLES_IN_HOUR;
+
+        run_benchmark("datahour_save", bench_datahour_save);
+        run_benchmark("datahour_load", bench_datahour_load);
+
+        datahour_destroy(file_hour);
+        hour_index_destroy();
+    }
+}
+
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void) st;
+    (void) flag;
+    (void) ftw;
+    return remove(path);
+}
+
+void print_usage(void) {
+    printf("Usage: [-r <sample rate>] [-n <repeats>] [-d <scratch directory>]\n");
+    printf("Prints benchmark,sample_rate,operations,best_ns_per_op,mean_ns_per_op\n");
+}
+
+int main(int argc, char *argv[]) {
+    int sample_rate = 100;
+    char *directory = NULL;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "r:n:d:")) != -1) {
+        switch (opt) {
+        case 'r':
+            sample_rate = atoi(optarg);
+            break;
+        case 'n':
+            repeats = atoi(optarg);
+            break;
+        case 'd':
+            directory = optarg;
+            break;
+        default:
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (sample_rate <= 0 || repeats < 1) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    char scratch[] = "/tmp/zejfseis_benchmark_XXXXXX";
+    if (directory == NULL && (directory = mkdtemp(scratch)) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    if (chdir(directory) != 0) {
+        perror(directory);
+        return EXIT_FAILURE;
+    }
+
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL || freopen("/dev/null", "w", stderr) == NULL) {
+        perror("stdout");
+        return EXIT_FAILURE;
+    }
+    fprintf(results, "benchmark,sample_rate,operations,best_ns_per_op,mean_ns_per_op\n");
+
+    // a fixed hour keeps the file paths the same between runs
+    base_hour_id = 480000;
+    set_sample_rate(sample_rate);
+    data_init();
+    hour_index_init();
+
+    run_benchmark("list_append", bench_list_append);
+    run_benchmark("list_remove", bench_list_remove);
+    run_benchmark("log_data", bench_log_data);
+    run_benchmark("get_log", bench_get_log);
+    run_benchmark("get_datahour_hit", bench_get_datahour_hit);
+    run_benchmark("send_logs", bench_send_logs);
+
+    // copies of the logged hour are saved for the misses
+    pthread_mutex_lock(&data_lock);
+    DataHour *source = get_datahour(STREAM_RAW, base_hour_id, true, false);
+    for (int i = 1; source != NULL && i < BENCHMARK_MISS_HOURS; i++) {
+        DataHour *dh = get_datahour(STREAM_RAW, base_hour_id - i, false, true);
+        dh->sample_width = source->sample_width;
+        memcpy(dh->samples, source->samples, datahour_samples_size(source));
+        dh->sample_count = source->sample_count;
+        dh->modified = true;
+    }
+    pthread_mutex_unlock(&data_lock);
+    data_destroy();
+    data_init();
+    run_benchmark("get_datahour_miss", bench_get_datahour_miss);
+    data_destroy();
+    hour_index_destroy();
+
+    run_file_benchmarks();
+
+    if (directory == scratch) {
+        nftw(directory, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    fclose(results);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "data.h"
+#include "miniseed.h"
+#include "my_string.h"
+#include "thread_pool.h"
+#include "time_utils.h"
+
+#define FORMAT_MSEED 0
+#define FORMAT_CSV 1
+
+#define CSV_LINE_MAX 64
+
+// One hour of output. Hours are encoded in parallel and written in order by
+// the main thread, at most jobs_in_flight of them exist at a time.
+typedef struct export_job_t
+{
+    int32_t hour_id;
+    int64_t first_log_id;
+    int64_t last_log_id;
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    int64_t samples;
+    bool done;
+} ExportJob;
+
+int format = FORMAT_MSEED;
+int stream = STREAM_RAW;
+MseedChannel channel = { "XX", "ZEJF", "", "", 0 };
+
+pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+bool job_reserve(ExportJob *job, size_t size) {
+    if (job->size + size <= job->capacity) {
+        return true;
+    }
+    size_t capacity = job->capacity == 0 ? MSEED_RECORD_LENGTH * 16 : job->capacity;
+    while (job->size + size > capacity) {
+        capacity *= 2;
+    }
+    uint8_t *data = realloc(job->data, capacity);
+    if (data == NULL) {
+        perror("realloc");
+        return false;
+    }
+    job->data = data;
+    job->capacity = capacity;
+    return true;
+}
+
+// the newest file name first, older server versions used the other two
+DataHour *load_hour(int32_t hour_id) {
+    String *paths[3] = {
+        get_datahour_path_newest(stream, hour_id),
+        stream == STREAM_RAW ? get_datahour_path_new(hour_id) : NULL,
+        stream == STREAM_RAW ? get_datahour_path_old(hour_id) : NULL
+    };
+
+    DataHour *dh = NULL;
+    for (int i = 0; i < 3 && dh == NULL; i++) {
+        if (paths[i] == NULL) {
+            continue;
+        }
+        FILE *file = fopen(paths[i]->data, "rb");
+        if (file == NULL) {
+            continue;
+        }
+        dh = datahour_load(file, stream);
+        fclose(file);
+        if (dh != NULL && dh->hour_id != hour_id) {
+            datahour_destroy(dh);
+            dh = NULL;
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        string_destroy(paths[i]);
+    }
+    return dh;
+}
+
+void encode_mseed(ExportJob *job, int32_t *samples, int64_t first_log_id, size_t count) {
+    size_t offset = 0;
+    while (offset < count) {
+        if (!job_reserve(job, MSEED_RECORD_LENGTH)) {
+            return;
+        }
+        offset += mseed_encode_record(&channel, log_id_to_nanos(first_log_id + offset), samples + offset, count - offset, job->data + job->size);
+        job->size += MSEED_RECORD_LENGTH;
+    }
+}
+
+void encode_csv(ExportJob *job, int32_t *samples, int64_t first_log_id, size_t count) {
+    char date[32];
+    time_t date_second = -1;
+    for (size_t i = 0; i < count; i++) {
+        if (!job_reserve(job, CSV_LINE_MAX)) {
+            return;
+        }
+        int64_t log_id = first_log_id + i;
+        int64_t time_ns = log_id_to_nanos(log_id);
+        time_t second = time_ns / 1000000000;
+        if (second != date_second) {
+            struct tm t;
+            gmtime_r(&second, &t);
+            strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &t);
+            date_second = second;
+        }
+        job->size += snprintf((char *) job->data + job->size, CSV_LINE_MAX, "%ld,%s.%06ldZ,%d\n", log_id, date, (time_ns % 1000000000) / 1000, samples[i]);
+    }
+}
+
+// splits the hour into runs of consecutive samples
+void run_export_job(void *arg) {
+    ExportJob *job = (ExportJob *) arg;
+    DataHour *dh = load_hour(job->hour_id);
+
+    if (dh != NULL) {
+        int32_t *samples = datahour_widen(dh);
+        int64_t hour_start = get_first_log_id(job->hour_id);
+        int64_t i = job->first_log_id - hour_start;
+        int64_t end = job->last_log_id - hour_start;
+        while (i <= end) {
+            if (samples[i] == ERR_VAL) {
+                i++;
+                continue;
+            }
+            int64_t run = i;
+            while (i <= end && samples[i] != ERR_VAL) {
+                i++;
+            }
+            if (format == FORMAT_MSEED) {
+                encode_mseed(job, samples + run, hour_start + run, i - run);
+            } else {
+                encode_csv(job, samples + run, hour_start + run, i - run);
+            }
+            job->samples += i - run;
+        }
+        datahour_destroy(dh);
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    job->done = true;
+    pthread_cond_broadcast(&job_done);
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS in UTC
+bool parse_time(const char *text, int64_t *log_id) {
+    struct tm t;
+    memset(&t, 0, sizeof(t));
+    const char *end = strptime(text, "%Y-%m-%dT%H:%M:%S", &t);
+    if (end == NULL || *end != '\0') {
+        memset(&t, 0, sizeof(t));
+        end = strptime(text, "%Y-%m-%d", &t);
+        if (end == NULL || *end != '\0') {
+            return false;
+        }
+    }
+    *log_id = nanos_to_log_id((int64_t) timegm(&t) * 1000000000);
+    return true;
+}
+
+void print_usage(void) {
+    printf("Usage: -r <sample rate> -f <from> -t <to> -o <output file> [-F mseed|csv] [-d <server directory>] [-j <threads>]\n");
+    printf("       [-n <network>] [-s <station>] [-l <location>] [-c <channel>] [--filtered]\n");
+    printf("Times are UTC, YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS, the end is exclusive\n");
+}
+
+int main(int argc, char *argv[]) {
+    int sample_rate = 0;
+    char *from = NULL;
+    char *to = NULL;
+    char *output = NULL;
+    char *directory = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    static struct option long_options[] = {
+        { "filtered", no_argument, 0, 'L' },
+        { 0, 0, 0, 0 }
+    };
+
+    int opt = 0;
+    int long_index = 0;
+    while ((opt = getopt_long(argc, argv, "r:f:t:o:F:d:j:n:s:l:c:", long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'r':
+            sample_rate = atoi(optarg);
+            break;
+        case 'f':
+            from = optarg;
+            break;
+        case 't':
+            to = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'F':
+            if (strcmp(optarg, "csv") == 0) {
+                format = FORMAT_CSV;
+            } else if (strcmp(optarg, "mseed") != 0) {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            directory = optarg;
+            break;
+        case 'j':
+            threads = atol(optarg);
+            break;
+        case 'n':
+            snprintf(channel.network, sizeof(channel.network), "%s", optarg);
+            break;
+        case 's':
+            snprintf(channel.station, sizeof(channel.station), "%s", optarg);
+            break;
+        case 'l':
+            snprintf(channel.location, sizeof(channel.location), "%s", optarg);
+            break;
+        case 'c':
+            snprintf(channel.channel, sizeof(channel.channel), "%s", optarg);
+            break;
+        case 'L':
+            stream = STREAM_FILTERED;
+            break;
+        default:
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    int64_t first_log_id;
+    int64_t end_log_id;
+    if (sample_rate <= 0 || from == NULL || to == NULL || output == NULL || threads < 1) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    SAMPLES_PER_SECOND = sample_rate;
+    SAMPLES_IN_HOUR = SAMPLES_PER_SECOND * 60 * 60;
+    channel.sample_rate = sample_rate;
+    if (channel.channel[0] == '\0') {
+        snprintf(channel.channel, sizeof(channel.channel), "%s", sample_rate >= 80 ? "HHZ" : "BHZ");
+    }
+
+    if (!parse_time(from, &first_log_id) || !parse_time(to, &end_log_id) || end_log_id <= first_log_id) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = fopen(output, "wb");
+    if (out == NULL) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+
+    if (directory != NULL && chdir(directory) != 0) {
+        perror(directory);
+        fclose(out);
+        return EXIT_FAILURE;
+    }
+
+    if (format == FORMAT_CSV) {
+        fprintf(out, "log_id,time,value\n");
+    }
+
+    int32_t first_hour = get_hour_id(first_log_id);
+    int32_t last_hour = get_hour_id(end_log_id - 1);
+    size_t jobs_in_flight = threads * 2;
+
+    ExportJob *jobs = calloc(jobs_in_flight, sizeof(ExportJob));
+    ThreadPool *pool = thread_pool_create(threads, jobs_in_flight);
+    if (jobs == NULL || pool == NULL) {
+        perror("calloc");
+        fclose(out);
+        return EXIT_FAILURE;
+    }
+
+    int64_t start_ms = millis();
+    int64_t total_samples = 0;
+    int64_t total_bytes = 0;
+    int sequence = 1;
+    bool result = true;
+    int32_t next_submit = first_hour;
+
+    for (int32_t next_write = first_hour; next_write <= last_hour; next_write++) {
+        while (next_submit <= last_hour && (size_t) (next_submit - next_write) < jobs_in_flight) {
+            ExportJob *job = &jobs[(next_submit - first_hour) % jobs_in_flight];
+            job->hour_id = next_submit;
+            job->first_log_id = MAX(first_log_id, get_first_log_id(next_submit));
+            job->last_log_id = MIN(end_log_id, get_first_log_id(next_submit + 1)) - 1;
+            job->size = 0;
+            job->samples = 0;
+            job->done = false;
+            thread_pool_submit(pool, run_export_job, job);
+            next_submit++;
+        }
+
+        ExportJob *job = &jobs[(next_write - first_hour) % jobs_in_flight];
+        pthread_mutex_lock(&jobs_lock);
+        while (!job->done) {
+            pthread_cond_wait(&job_done, &jobs_lock);
+        }
+        pthread_mutex_unlock(&jobs_lock);
+
+        if (format == FORMAT_MSEED) {
+            for (size_t offset = 0; offset < job->size; offset += MSEED_RECORD_LENGTH) {
+                mseed_set_sequence(job->data + offset, sequence++);
+            }
+        }
+
+        if (result && job->size > 0 && fwrite(job->data, job->size, 1, out) != 1) {
+            perror("fwrite");
+            result = false;
+        }
+        total_samples += job->samples;
+        total_bytes += job->size;
+    }
+
+    thread_pool_destroy(pool);
+    for (size_t i = 0; i < jobs_in_flight; i++) {
+        free(jobs[i].data);
+    }
+    free(jobs);
+
+    if (fclose(out) != 0) {
+        perror(output);
+        result = false;
+    }
+
+    double seconds = (millis() - start_ms) / 1000.0;
+    printf("Exported %ld samples from %d hours, %.1f MB in %.2fs\n", total_samples, last_hour - first_hour + 1, total_bytes / 1e6, seconds);
+
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
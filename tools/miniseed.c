@@ -0,0 +1,156 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "miniseed.h"
+
+#define FRAME_WORDS 16
+
+// Steim-2 packings from the densest one: samples per word, bits per
+// difference, the 2 bit nibble and the 2 bit dnib in the top of the word
+typedef struct steim2_packing_t
+{
+    int count;
+    int bits;
+    uint32_t nibble;
+    uint32_t dnib;
+} Steim2Packing;
+
+const Steim2Packing STEIM2_PACKINGS[] = {
+    { 7, 4, 3, 2 },
+    { 6, 5, 3, 1 },
+    { 5, 6, 3, 0 },
+    { 4, 8, 1, 0 },
+    { 3, 10, 2, 3 },
+    { 2, 15, 2, 2 },
+    { 1, 30, 2, 1 },
+};
+
+#define STEIM2_PACKING_COUNT ((int) (sizeof(STEIM2_PACKINGS) / sizeof(Steim2Packing)))
+
+void put_u16(uint8_t *ptr, uint16_t value) {
+    ptr[0] = value >> 8;
+    ptr[1] = value;
+}
+
+void put_u32(uint8_t *ptr, uint32_t value) {
+    ptr[0] = value >> 24;
+    ptr[1] = value >> 16;
+    ptr[2] = value >> 8;
+    ptr[3] = value;
+}
+
+void put_padded(uint8_t *ptr, const char *text, size_t length) {
+    memset(ptr, ' ', length);
+    memcpy(ptr, text, strnlen(text, length));
+}
+
+bool fits(int64_t diff, int bits) {
+    return diff >= -(1ll << (bits - 1)) && diff < (1ll << (bits - 1));
+}
+
+void write_header(MseedChannel *channel, int64_t start_ns, size_t sample_count, uint8_t *record) {
+    mseed_set_sequence(record, 1);
+    record[6] = 'D';
+    record[7] = ' ';
+    put_padded(record + 8, channel->station, 5);
+    put_padded(record + 13, channel->location, 2);
+    put_padded(record + 15, channel->channel, 3);
+    put_padded(record + 18, channel->network, 2);
+
+    time_t seconds = start_ns / 1000000000;
+    struct tm t;
+    gmtime_r(&seconds, &t);
+    put_u16(record + 20, t.tm_year + 1900);
+    put_u16(record + 22, t.tm_yday + 1);
+    record[24] = t.tm_hour;
+    record[25] = t.tm_min;
+    record[26] = t.tm_sec;
+    put_u16(record + 28, (start_ns % 1000000000) / 100000);
+
+    put_u16(record + 30, sample_count);
+    put_u16(record + 32, channel->sample_rate);
+    put_u16(record + 34, 1);
+    record[39] = 1; // blockette count
+    put_u16(record + 44, MSEED_HEADER_LENGTH);
+    put_u16(record + 46, 48);
+
+    // blockette 1000: Steim-2, big endian
+    put_u16(record + 48, 1000);
+    put_u16(record + 50, 0);
+    record[52] = 11;
+    record[53] = 1;
+    record[54] = MSEED_RECORD_LENGTH_EXPONENT;
+}
+
+// Encodes one record of consecutive samples and returns how many of them it
+// holds. A record ends early if a difference does not fit into 30 bits, the
+// next one then starts from that sample.
+size_t mseed_encode_record(MseedChannel *channel, int64_t start_ns, int32_t *samples, size_t count, uint8_t *record) {
+    memset(record, 0, MSEED_RECORD_LENGTH);
+
+    uint8_t *data = record + MSEED_HEADER_LENGTH;
+    int frame_count = (MSEED_RECORD_LENGTH - MSEED_HEADER_LENGTH) / (FRAME_WORDS * 4);
+    int frame = 0;
+    int word = 3; // the first frame starts with the integration constants
+    uint32_t nibbles = 0;
+    size_t encoded = 0;
+
+    while (encoded < count && frame < frame_count) {
+        const Steim2Packing *packing = NULL;
+        for (int p = 0; p < STEIM2_PACKING_COUNT && packing == NULL; p++) {
+            if (encoded + STEIM2_PACKINGS[p].count > count) {
+                continue;
+            }
+            bool ok = true;
+            for (int i = 0; i < STEIM2_PACKINGS[p].count && ok; i++) {
+                size_t index = encoded + i;
+                int64_t diff = index == 0 ? 0 : (int64_t) samples[index] - samples[index - 1];
+                ok = fits(diff, STEIM2_PACKINGS[p].bits);
+            }
+            if (ok) {
+                packing = &STEIM2_PACKINGS[p];
+            }
+        }
+
+        if (packing == NULL) {
+            break;
+        }
+
+        uint32_t value = packing->nibble == 1 ? 0 : packing->dnib << 30;
+        uint32_t mask = (1u << packing->bits) - 1;
+        for (int i = 0; i < packing->count; i++) {
+            size_t index = encoded + i;
+            int64_t diff = index == 0 ? 0 : (int64_t) samples[index] - samples[index - 1];
+            value |= ((uint32_t) diff & mask) << (packing->bits * (packing->count - 1 - i));
+        }
+
+        put_u32(data + (frame * FRAME_WORDS + word) * 4, value);
+        nibbles |= packing->nibble << (30 - 2 * word);
+        encoded += packing->count;
+
+        if (++word == FRAME_WORDS) {
+            put_u32(data + frame * FRAME_WORDS * 4, nibbles);
+            nibbles = 0;
+            word = 1;
+            frame++;
+        }
+    }
+
+    if (word != 1) {
+        put_u32(data + frame * FRAME_WORDS * 4, nibbles);
+    }
+
+    put_u32(data + 4, samples[0]);
+    put_u32(data + 8, samples[encoded - 1]);
+    write_header(channel, start_ns, encoded, record);
+
+    return encoded;
+}
+
+void mseed_set_sequence(uint8_t *record, int sequence) {
+    char text[8];
+    snprintf(text, sizeof(text), "%06d", sequence % 1000000);
+    memcpy(record, text, 6);
+}
@@ -0,0 +1,24 @@
+#ifndef MINISEED_H
+#define MINISEED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MSEED_RECORD_LENGTH 4096
+#define MSEED_RECORD_LENGTH_EXPONENT 12
+#define MSEED_HEADER_LENGTH 64
+
+typedef struct mseed_channel_t
+{
+    char network[3];
+    char station[6];
+    char location[3];
+    char channel[4];
+    int sample_rate;
+} MseedChannel;
+
+size_t mseed_encode_record(MseedChannel *channel, int64_t start_ns, int32_t *samples, size_t count, uint8_t *record);
+
+void mseed_set_sequence(uint8_t *record, int sequence);
+
+#endif
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Runs the server against the Arduino simulator and prints its statistics.
+# Usage: tools/simulate.sh <build dir> <sample rate> <duration s> [simulator options]
+
+set -e
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 <build dir> <sample rate> <duration s> [simulator options]"
+    exit 1
+fi
+
+BUILD=$(cd "$1" && pwd)
+RATE=$2
+DURATION=$3
+shift 3
+
+WORKDIR=$(mktemp -d)
+PTY_FILE="$WORKDIR/pty"
+
+"$BUILD/zejfseis_arduino_simulator" "$@" > "$PTY_FILE" &
+SIM_PID=$!
+
+while [ ! -s "$PTY_FILE" ]; do
+    sleep 0.1
+done
+PTY=$(head -n 1 "$PTY_FILE")
+
+SERVER=$(ls "$BUILD"/zejfseis_server_* | head -n 1)
+
+cd "$WORKDIR"
+(sleep "$DURATION"; echo info; echo exit) | "$SERVER" -s "$PTY" -i 127.0.0.1 -p 0 -r "$RATE" \
+    | sed -n '/=========/,/=================/p'
+
+kill "$SIM_PID" 2> /dev/null || true
+wait "$SIM_PID" 2> /dev/null || true
+rm -rf "$WORKDIR"